@@ -0,0 +1,137 @@
+// ble_decoder.h
+// decoder interface of ble_sensor_mqtt_pub
+//
+// a decoder turns the advertising reports of one kind of sensor into readings. the built in sensor types 1 to 8
+// are decoders too, more are loaded at startup from the shared objects in decoder_directory. a plugin exports
+//
+//     int ble_decoders(const ble_decoder_t **decoders)
+//
+// which points decoders at its array of decoders and returns how many there are. each decoder handles one sensor
+// type, the number given as type for the sensor in the configuration file. the type of each configured sensor is
+// resolved to its decoder once at startup, a report from the sensor then costs a call to match and, when that
+// passes, one to decode. both are given the decoder itself, so one pair of functions can serve several types
+// through the context of each
+//
+// a plugin only needs this header, build it with
+//     gcc -Wall -O2 -fPIC -shared -o my_decoder.so my_decoder.c
+// see decoder_switchbot.c for an example
+
+#ifndef BLE_DECODER_H
+#define BLE_DECODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// changed whenever a structure below changes, decoders built for another version are not loaded
+#define BLE_DECODER_ABI_VERSION 3
+
+// advertising report
+// the manufacturer data (by company id) and service data (by 16 bit uuid) of one report, as views into the HCI
+// buffer after the 2 byte id. the views have been checked against the end of the report, a decoder only needs to
+// check the length it is given
+#define AD_MAX_VIEWS 4
+
+typedef struct
+{
+    uint16_t id; // company id or service uuid
+    const uint8_t *data;
+    int length;
+} ad_view_t;
+
+typedef struct
+{
+    int event_type; // 0 = ADV_IND, 1 = ADV_DIRECT_IND, 2 = ADV_SCAN_IND, 3 = ADV_NONCONN_IND, 4 = SCAN_RSP
+    int8_t rssi;
+    bool malformed; // the AD structures ran past the end of the report, only those before are kept
+    int manufacturer_count;
+    ad_view_t manufacturer[AD_MAX_VIEWS];
+    int service_count;
+    ad_view_t service[AD_MAX_VIEWS];
+} ad_report_t;
+
+// manufacturer data after the company id, NULL and a length of 0 if the report has none from this company
+static inline const uint8_t *ad_manufacturer_data(const ad_report_t *report, uint16_t company, int *length)
+{
+    int n;
+
+    for (n = 0; n < report->manufacturer_count; n++)
+    {
+        if (report->manufacturer[n].id == company)
+        {
+            *length = report->manufacturer[n].length;
+            return report->manufacturer[n].data;
+        }
+    }
+    *length = 0;
+    return NULL;
+}
+
+// service data after the uuid, NULL and a length of 0 if the report has none for this uuid
+static inline const uint8_t *ad_service_data(const ad_report_t *report, uint16_t uuid, int *length)
+{
+    int n;
+
+    for (n = 0; n < report->service_count; n++)
+    {
+        if (report->service[n].id == uuid)
+        {
+            *length = report->service[n].length;
+            return report->service[n].data;
+        }
+    }
+    *length = 0;
+    return NULL;
+}
+
+// decoded reading
+// temperature and humidity are filtered, kept in the statistics and history and published, the other fields are
+// published when their bit is set in fields. any other measurements go in values, published under their name
+#define READING_TEMPERATURE 0x01
+#define READING_HUMIDITY 0x02
+#define READING_BATTERY_PCT 0x04
+#define READING_BATTERY_MV 0x08
+#define READING_FRAME 0x10
+
+#define READING_MAX_VALUES 12
+
+typedef struct
+{
+    const char *name; // JSON key, lower case without spaces
+    int index;        // 0, or 1, 2 ... for more measurements of the same kind in one report, published as name2 ...
+    int decimals;
+    double value;
+} reading_value_t;
+
+typedef struct
+{
+    uint32_t fields; // READING_* bits of the values set
+    double temperature_celsius;
+    double humidity; // percent
+    int battery_pct;
+    int battery_mv;
+    int frame; // packet counter of the sensor
+    int value_count; // set to 0 before decode is called
+    reading_value_t values[READING_MAX_VALUES];
+} reading_t;
+
+typedef struct ble_decoder ble_decoder_t;
+
+struct ble_decoder
+{
+    int abi_version;       // BLE_DECODER_ABI_VERSION
+    int type;              // sensor type in the configuration file, 1 to 8 and 99 are taken
+    const char *make;      // device manufacturer and model for Home Assistant
+    const char *model;
+    const char *entities;  // Home Assistant entities the sensor has, F and T temperature, H humidity, B battery,
+                           // V battery voltage, S signal strength
+    // quick test of the event type and the data the decoder needs, called for every report from the sensor
+    bool (*match)(const ble_decoder_t *decoder, const ad_report_t *report);
+    // fill in the reading from a report that matched, false if the values are not usable
+    bool (*decode)(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading);
+    const void *context;   // for the decoder's own use, e.g. a table of offsets
+};
+
+#define BLE_DECODERS_SYMBOL "ble_decoders"
+typedef int (*ble_decoders_function_t)(const ble_decoder_t **decoders);
+
+#endif
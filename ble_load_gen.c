@@ -0,0 +1,482 @@
+// ble_load_gen.c
+// gcc -O2 -o ble_load_gen ble_load_gen.c
+//
+// virtual bluetooth controller for load testing ble_sensor_mqtt_pub
+//
+// creates an HCI controller through /dev/vhci, answers the commands the kernel and ble_sensor_mqtt_pub send it,
+// and while scanning is enabled injects LE advertising reports: ATC format readings from a set of configured
+// sensors, and manufacturer data from a set of foreign devices, each at its own rate.
+// every sensor report sent is logged as "seconds.nanoseconds mac frame" (CLOCK_REALTIME) so the published
+// readings can be matched to it, see load_test.sh
+//
+// needs root (or access to /dev/vhci) and the hci_vhci kernel module
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#define PROGRAM_NAME "ble_load_gen"
+#define VHCI_DEVICE "/dev/vhci"
+
+// HCI packet types
+#define HCI_COMMAND_PKT 0x01
+#define HCI_EVENT_PKT 0x04
+#define HCI_VENDOR_PKT 0xff
+
+// events
+#define EVT_CMD_COMPLETE 0x0e
+#define EVT_LE_META_EVENT 0x3e
+#define EVT_LE_ADVERTISING_REPORT 0x02
+
+// commands with a reply the controller has to fill in, or whose length is known
+#define OP_READ_LOCAL_VERSION 0x1001
+#define OP_READ_LOCAL_COMMANDS 0x1002
+#define OP_READ_LOCAL_FEATURES 0x1003
+#define OP_READ_BUFFER_SIZE 0x1005
+#define OP_READ_BD_ADDR 0x1009
+#define OP_LE_READ_BUFFER_SIZE 0x2002
+#define OP_LE_READ_LOCAL_FEATURES 0x2003
+#define OP_LE_READ_ADV_TX_POWER 0x2007
+#define OP_LE_SET_SCAN_ENABLE 0x200c
+#define OP_LE_READ_ACCEPT_LIST_SIZE 0x200f
+#define OP_LE_READ_SUPPORTED_STATES 0x201c
+#define OP_LE_SET_EVENT_MASK 0x2001
+#define OP_LE_SET_SCAN_PARAMETERS 0x200b
+#define OP_LE_CLEAR_ACCEPT_LIST 0x2010
+#define OP_SET_EVENT_MASK 0x0c01
+#define OP_RESET 0x0c03
+#define OP_READ_LOCAL_NAME 0x0c14
+
+// reply to any other command, long enough for any return parameters the kernel expects
+#define DEFAULT_REPLY_LENGTH 249
+
+#define MAX_SENSORS 128 // as many as ble_sensor_mqtt_pub takes
+#define MAX_FOREIGN 100000
+
+int sensor_count = 100;
+int foreign_count = 2000;
+double sensor_rate = 100.0;   // sensor reports per second, all sensors together
+double foreign_rate = 1000.0; // foreign reports per second
+int duration = 60;            // seconds of scanning, 0 = until stopped
+char *sent_log_file = NULL;
+char *config_file = NULL;
+
+int vhci;
+int hci_index;
+bool scanning = false;
+uint8_t sensor_frame[MAX_SENSORS];
+uint16_t sensor_seq[MAX_SENSORS];
+FILE *sent_log = NULL;
+volatile sig_atomic_t keep_running = 1;
+
+void stop(int sig)
+{
+    (void)sig;
+    keep_running = 0;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sensors are A4:C1:38:00:hh:ll, foreign devices are random looking but fixed by their number
+void sensor_mac(int n, uint8_t mac[6])
+{
+    // little endian, as in the HCI packets
+    mac[0] = n & 0xff;
+    mac[1] = (n >> 8) & 0xff;
+    mac[2] = 0x00;
+    mac[3] = 0x38;
+    mac[4] = 0xc1;
+    mac[5] = 0xa4;
+}
+
+void foreign_mac(int n, uint8_t mac[6])
+{
+    uint32_t h = (uint32_t)n * 2654435761u;
+
+    mac[0] = h & 0xff;
+    mac[1] = (h >> 8) & 0xff;
+    mac[2] = (h >> 16) & 0xff;
+    mac[3] = (h >> 24) & 0xff;
+    mac[4] = n & 0xff;
+    mac[5] = 0x40 | ((n >> 8) & 0x3f); // random static address would be 0xc0, keep it out of the sensors' range
+}
+
+void write_packet(const uint8_t *packet, int length)
+{
+    if (write(vhci, packet, length) != length)
+    {
+        fprintf(stderr, "Write to %s failed: %s\n", VHCI_DEVICE, strerror(errno));
+        exit(1);
+    }
+}
+
+void command_complete(uint16_t opcode, const uint8_t *parameters, int length)
+{
+    uint8_t packet[3 + 3 + 255];
+
+    packet[0] = HCI_EVENT_PKT;
+    packet[1] = EVT_CMD_COMPLETE;
+    packet[2] = 3 + length;
+    packet[3] = 1; // number of commands the host may send
+    packet[4] = opcode & 0xff;
+    packet[5] = opcode >> 8;
+    memcpy(packet + 6, parameters, length);
+    write_packet(packet, 6 + length);
+}
+
+// answer a command from the host, pretending to be an LE only bluetooth 4.0 controller
+void handle_command(const uint8_t *packet, int length)
+{
+    uint8_t reply[DEFAULT_REPLY_LENGTH];
+    uint16_t opcode;
+    int reply_length = 1;
+
+    if (length < 4)
+    {
+        return;
+    }
+    opcode = packet[1] | packet[2] << 8;
+    memset(reply, 0, sizeof(reply));
+
+    switch (opcode)
+    {
+    case OP_READ_LOCAL_VERSION:
+        reply[1] = 0x06; // HCI version 4.0
+        reply[4] = 0x06; // LMP version 4.0
+        reply[5] = 0xff; // manufacturer 0xffff, for testing
+        reply[6] = 0xff;
+        reply_length = 9;
+        break;
+    case OP_READ_LOCAL_COMMANDS:
+        reply_length = 65; // none of the optional commands
+        break;
+    case OP_READ_LOCAL_FEATURES:
+        reply[5] = 0x60; // LE supported, BR/EDR not supported
+        reply_length = 9;
+        break;
+    case OP_READ_BUFFER_SIZE:
+        reply[1] = 0xfb; // ACL MTU 251, 8 packets
+        reply[4] = 8;
+        reply_length = 8;
+        break;
+    case OP_READ_BD_ADDR:
+        reply[1] = hci_index & 0xff;
+        reply[2] = 0x00;
+        reply[3] = 0x5e;
+        reply[4] = 0xac;
+        reply[5] = 0x1d;
+        reply[6] = 0x00;
+        reply_length = 7;
+        break;
+    case OP_LE_READ_BUFFER_SIZE:
+        reply[1] = 0xfb; // LE MTU 251, 8 packets
+        reply[3] = 8;
+        reply_length = 4;
+        break;
+    case OP_LE_READ_LOCAL_FEATURES:
+    case OP_LE_READ_SUPPORTED_STATES:
+        reply_length = 9;
+        break;
+    case OP_LE_READ_ADV_TX_POWER:
+    case OP_LE_READ_ACCEPT_LIST_SIZE:
+        reply[1] = 8;
+        reply_length = 2;
+        break;
+    case OP_LE_SET_SCAN_ENABLE:
+        if (length >= 5)
+        {
+            scanning = packet[4] != 0;
+            fprintf(stderr, "Scanning %s\n", scanning ? "enabled" : "disabled");
+        }
+        break;
+    case OP_READ_LOCAL_NAME:
+        reply_length = 249;
+        break;
+    case OP_RESET:
+    case OP_SET_EVENT_MASK:
+    case OP_LE_SET_EVENT_MASK:
+    case OP_LE_SET_SCAN_PARAMETERS:
+    case OP_LE_CLEAR_ACCEPT_LIST:
+        break;
+    default:
+        // status 0 then zeros, the kernel only warns when a reply is longer than it expects
+        reply_length = DEFAULT_REPLY_LENGTH;
+        break;
+    }
+    command_complete(opcode, reply, reply_length);
+}
+
+// one LE advertising report event with a single report
+void advertising_report(uint8_t event_type, const uint8_t mac[6], const uint8_t *data, int data_length, int8_t rssi)
+{
+    uint8_t packet[3 + 2 + 9 + 31 + 1];
+
+    packet[0] = HCI_EVENT_PKT;
+    packet[1] = EVT_LE_META_EVENT;
+    packet[2] = 2 + 9 + data_length + 1;
+    packet[3] = EVT_LE_ADVERTISING_REPORT;
+    packet[4] = 1; // number of reports
+    packet[5] = event_type;
+    packet[6] = 0; // public address
+    memcpy(packet + 7, mac, 6);
+    packet[13] = data_length;
+    memcpy(packet + 14, data, data_length);
+    packet[14 + data_length] = (uint8_t)rssi;
+    write_packet(packet, 15 + data_length);
+}
+
+// ATC custom format: service data 0x181A, mac (big endian), temperature * 10, humidity, battery %, battery mV, frame
+void send_sensor(int n)
+{
+    uint8_t mac[6];
+    uint8_t data[17];
+    struct timespec ts;
+    int16_t temperature;
+    uint16_t seq;
+    int i;
+
+    sensor_mac(n, mac);
+    seq = sensor_seq[n]++;
+    // a slow drift so the glitch filter passes every reading
+    temperature = 200 + (n % 50) + (seq / 64) % 5;
+
+    data[0] = 16;
+    data[1] = 0x16;
+    data[2] = 0x1a;
+    data[3] = 0x18;
+    for (i = 0; i < 6; i++)
+    {
+        data[4 + i] = mac[5 - i];
+    }
+    data[10] = temperature >> 8;
+    data[11] = temperature & 0xff;
+    data[12] = 40 + n % 30;
+    data[13] = 90;
+    data[14] = 2950 >> 8;
+    data[15] = 2950 & 0xff;
+    data[16] = sensor_frame[n]++;
+
+    advertising_report(0x00, mac, data, sizeof(data), -50 - n % 40);
+
+    if (sent_log != NULL)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        fprintf(sent_log, "%ld.%09ld %02X:%02X:%02X:%02X:%02X:%02X %d\n", (long)ts.tv_sec, ts.tv_nsec,
+                mac[5], mac[4], mac[3], mac[2], mac[1], mac[0], data[16]);
+    }
+}
+
+// flags and 22 bytes of manufacturer data, about what a phone or tracker sends
+void send_foreign(int n)
+{
+    uint8_t mac[6];
+    uint8_t data[28];
+    int i;
+
+    foreign_mac(n, mac);
+    data[0] = 2;
+    data[1] = 0x01;
+    data[2] = 0x1a;
+    data[3] = 24;
+    data[4] = 0xff;
+    data[5] = 0x4c; // company 0x004C
+    data[6] = 0x00;
+    for (i = 7; i < (int)sizeof(data); i++)
+    {
+        data[i] = (uint8_t)(n * 31 + i);
+    }
+    advertising_report(n & 1 ? 0x03 : 0x00, mac, data, sizeof(data), -60 - n % 35);
+}
+
+// the sensors section of a configuration file for the sensors this run sends
+void write_config(const char *file)
+{
+    FILE *fp;
+    uint8_t mac[6];
+    int n;
+
+    fp = fopen(file, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not create %s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    fprintf(fp, "sensors:\n");
+    for (n = 0; n < sensor_count; n++)
+    {
+        sensor_mac(n, mac);
+        fprintf(fp, "  - name: \"Load %d\"\n", n);
+        fprintf(fp, "    unique: \"load_%d\"\n", n);
+        fprintf(fp, "    location: \"Load test %d\"\n", n);
+        fprintf(fp, "    type: 1\n");
+        fprintf(fp, "    mac: \"%02X:%02X:%02X:%02X:%02X:%02X\"\n\n", mac[5], mac[4], mac[3], mac[2], mac[1], mac[0]);
+    }
+    fclose(fp);
+}
+
+// create the controller, returns its hciN number
+int vhci_open(void)
+{
+    uint8_t request[2] = {HCI_VENDOR_PKT, 0x00}; // primary controller
+    uint8_t response[4];
+
+    vhci = open(VHCI_DEVICE, O_RDWR);
+    if (vhci < 0)
+    {
+        fprintf(stderr, "Could not open %s: %s (modprobe hci_vhci, run as root)\n", VHCI_DEVICE, strerror(errno));
+        exit(1);
+    }
+    write_packet(request, sizeof(request));
+    if (read(vhci, response, sizeof(response)) != sizeof(response) || response[0] != HCI_VENDOR_PKT)
+    {
+        fprintf(stderr, "No controller index from %s\n", VHCI_DEVICE);
+        exit(1);
+    }
+    return response[2] | response[3] << 8;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "usage: %s [-s sensors] [-f foreign devices] [-r sensor reports/s] [-R foreign reports/s]\n"
+                    "       [-d seconds] [-l sent log] [-c sensors config]\n",
+            PROGRAM_NAME);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t packet[300];
+    struct pollfd pfd;
+    double start = 0.0;
+    double elapsed;
+    long sensors_sent = 0;
+    long foreign_sent = 0;
+    int next_sensor = 0;
+    int opt;
+    int length;
+
+    while ((opt = getopt(argc, argv, "s:f:r:R:d:l:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            sensor_count = atoi(optarg);
+            break;
+        case 'f':
+            foreign_count = atoi(optarg);
+            break;
+        case 'r':
+            sensor_rate = atof(optarg);
+            break;
+        case 'R':
+            foreign_rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'l':
+            sent_log_file = optarg;
+            break;
+        case 'c':
+            config_file = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (sensor_count < 0 || sensor_count > MAX_SENSORS || foreign_count < 0 || foreign_count > MAX_FOREIGN)
+    {
+        fprintf(stderr, "Up to %d sensors and %d foreign devices\n", MAX_SENSORS, MAX_FOREIGN);
+        exit(1);
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    if (config_file != NULL)
+    {
+        write_config(config_file);
+    }
+    if (sent_log_file != NULL)
+    {
+        sent_log = fopen(sent_log_file, "w");
+        if (sent_log == NULL)
+        {
+            fprintf(stderr, "Could not create %s: %s\n", sent_log_file, strerror(errno));
+            exit(1);
+        }
+    }
+
+    hci_index = vhci_open();
+    fprintf(stdout, "hci%d\n", hci_index);
+    fflush(stdout);
+
+    pfd.fd = vhci;
+    pfd.events = POLLIN;
+    while (keep_running)
+    {
+        // answer commands, waking at least every millisecond to keep the report rates
+        if (poll(&pfd, 1, 1) > 0)
+        {
+            length = read(vhci, packet, sizeof(packet));
+            if (length <= 0)
+            {
+                break;
+            }
+            if (packet[0] == HCI_COMMAND_PKT)
+            {
+                handle_command(packet, length);
+            }
+        }
+
+        if (!scanning)
+        {
+            continue;
+        }
+        if (start == 0.0)
+        {
+            start = now_seconds();
+        }
+        elapsed = now_seconds() - start;
+        if (duration > 0 && elapsed >= duration)
+        {
+            break;
+        }
+
+        // catch up with the configured rates
+        while (sensor_count > 0 && sensors_sent < elapsed * sensor_rate)
+        {
+            send_sensor(next_sensor);
+            next_sensor = (next_sensor + 1) % sensor_count;
+            sensors_sent++;
+        }
+        while (foreign_count > 0 && foreign_sent < elapsed * foreign_rate)
+        {
+            send_foreign(rand() % foreign_count);
+            foreign_sent++;
+        }
+    }
+
+    if (sent_log != NULL)
+    {
+        fclose(sent_log);
+    }
+    fprintf(stderr, "Sent %ld sensor and %ld foreign reports\n", sensors_sent, foreign_sent);
+    // closing /dev/vhci removes the controller
+    close(vhci);
+    return 0;
+}
@@ -0,0 +1,189 @@
+// ble_readings.h
+// shared memory ring of the readings of ble_sensor_mqtt_pub
+//
+// with readings_ring set, every reading that passes the glitch filter is also written to the POSIX shared memory
+// object of that name, so programs on the same machine (a display, a logger, a fan controller) can follow the
+// readings at memory speed, without the MQTT server and without a system call per reading. the object is a header,
+// a table of the configured sensors and a ring of fixed size records. there is one writer and readers never write,
+// so any number of them can follow the ring. each slot has a version, odd while the record is being written, that a
+// reader checks before and after copying the record (a seqlock). a reader that falls more than the ring size behind
+// goes on from the oldest reading left and is told how many it lost
+//
+//     const ble_readings_t *ring = ble_readings_open("/ble_sensor_mqtt_pub");
+//     uint32_t next = ble_readings_head(ring);
+//     uint32_t lost = 0;
+//     ble_reading_record_t record;
+//
+//     for (;;)
+//     {
+//         while (ble_readings_read(ring, &next, &record, &lost))
+//             printf("%s %.2f\n", ring->sensors[record.sensor].name, record.temperature_celsius);
+//         usleep(100000);
+//     }
+//
+// the sequence numbers count on across restarts of ble_sensor_mqtt_pub and wrap at 2^32. when it starts with a
+// different ring size or layout it sets replaced in the old object and creates a new one, open it again then.
+// see ble_readings_tail.c for an example, build with -lrt on glibc before 2.34
+
+#ifndef BLE_READINGS_H
+#define BLE_READINGS_H
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ble_decoder.h"
+
+#define BLE_READINGS_MAGIC "BLER"
+// changed whenever a structure below changes
+#define BLE_READINGS_VERSION 2
+#define BLE_READINGS_MAX_SENSORS 128
+#define BLE_READINGS_NAME_SIZE 16
+
+// a configured sensor, the strings are cut to fit
+typedef struct
+{
+    int32_t type;
+    char mac[18];
+    char unique[64];
+    char name[64];
+    char location[64];
+} ble_readings_sensor_t;
+
+typedef struct
+{
+    char name[BLE_READINGS_NAME_SIZE]; // JSON key, see reading_value_t
+    int32_t index;
+    int32_t decimals;
+    double value;
+} ble_readings_value_t;
+
+// one reading, a copy of the decoder's reading_t with the value names in the record
+typedef struct
+{
+    uint32_t sequence;  // of the reading in the ring
+    int32_t sensor;     // index in sensors
+    int64_t time;       // unix time
+    int32_t rssi;
+    uint32_t fields;    // READING_* bits of the values set
+    double temperature_celsius;
+    double humidity;
+    int32_t battery_pct;
+    int32_t battery_mv;
+    int32_t frame;
+    int32_t value_count;
+    ble_readings_value_t values[READING_MAX_VALUES];
+} ble_reading_record_t;
+
+typedef struct
+{
+    uint32_t version; // sequence << 1 once the record is written, odd while it is being written
+    uint32_t reserved;
+    ble_reading_record_t record;
+} ble_readings_slot_t;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;      // BLE_READINGS_VERSION
+    uint32_t size;         // slots in the ring, a power of 2
+    uint32_t sensor_count;
+    uint32_t head;         // sequence of the next reading to be written
+    uint32_t replaced;     // not 0 once ble_sensor_mqtt_pub has started over with a new object
+    ble_readings_sensor_t sensors[BLE_READINGS_MAX_SENSORS];
+    ble_readings_slot_t slots[];
+} ble_readings_t;
+
+#define BLE_READINGS_BYTES(size) (sizeof(ble_readings_t) + (size_t)(size) * sizeof(ble_readings_slot_t))
+
+// map the ring read only, NULL if it is not there (yet) or was written for another version of this header
+static inline const ble_readings_t *ble_readings_open(const char *name)
+{
+    const ble_readings_t *ring;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ble_readings_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    ring = (const ble_readings_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        return NULL;
+    }
+    // the magic is written last when the ring is created
+    if (memcmp(ring->magic, BLE_READINGS_MAGIC, 4) != 0 || ring->version != BLE_READINGS_VERSION ||
+        (size_t)st.st_size != BLE_READINGS_BYTES(ring->size))
+    {
+        munmap((void *)ring, st.st_size);
+        return NULL;
+    }
+    return ring;
+}
+
+static inline void ble_readings_close(const ble_readings_t *ring)
+{
+    munmap((void *)ring, BLE_READINGS_BYTES(ring->size));
+}
+
+// sequence of the next reading to be written, start here to get only new readings
+static inline uint32_t ble_readings_head(const ble_readings_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+// copy the reading *next into record and step next on, false if it has not been written yet. readings that were
+// overwritten before they could be read are skipped and added to lost, which may be NULL
+static inline bool ble_readings_read(const ble_readings_t *ring, uint32_t *next, ble_reading_record_t *record, uint32_t *lost)
+{
+    const ble_readings_slot_t *slot;
+    uint32_t head;
+    uint32_t version;
+
+    for (;;)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == *next)
+        {
+            return false;
+        }
+        if (head - *next > ring->size)
+        {
+            if (lost != NULL)
+            {
+                *lost += head - *next - ring->size;
+            }
+            *next = head - ring->size;
+        }
+        slot = &ring->slots[*next & (ring->size - 1)];
+        version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+        if (version == *next << 1)
+        {
+            memcpy(record, &slot->record, sizeof(*record));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->version, __ATOMIC_RELAXED) == version)
+            {
+                (*next)++;
+                return true;
+            }
+        }
+        // the writer has come round to this slot again, the reading is gone
+        if (lost != NULL)
+        {
+            (*lost)++;
+        }
+        (*next)++;
+    }
+}
+
+#endif
@@ -0,0 +1,58 @@
+// ble_readings_tail.c
+// example reader of the shared memory readings ring of ble_sensor_mqtt_pub, prints each new reading on a line
+// gcc -Wall -O2 -o ble_readings_tail ble_readings_tail.c -lrt
+//
+// ble_readings_tail [readings_ring name, default /ble_sensor_mqtt_pub]
+
+#include <stdio.h>
+#include <unistd.h>
+#include "ble_readings.h"
+
+int main(int argc, char *argv[])
+{
+    const char *name = argc > 1 ? argv[1] : "/ble_sensor_mqtt_pub";
+    const ble_readings_t *ring;
+    const ble_readings_sensor_t *sensor;
+    ble_reading_record_t record;
+    uint32_t next;
+    uint32_t lost = 0;
+    int i;
+
+    for (;;)
+    {
+        while ((ring = ble_readings_open(name)) == NULL)
+        {
+            sleep(1);
+        }
+        next = ble_readings_head(ring);
+        while (!__atomic_load_n(&ring->replaced, __ATOMIC_ACQUIRE))
+        {
+            while (ble_readings_read(ring, &next, &record, &lost))
+            {
+                sensor = &ring->sensors[record.sensor];
+                printf("%u %lld %s %s rssi %d", record.sequence, (long long)record.time, sensor->mac, sensor->name, record.rssi);
+                if (record.fields & READING_TEMPERATURE)
+                {
+                    printf(" tempc %.2f", record.temperature_celsius);
+                }
+                if (record.fields & READING_HUMIDITY)
+                {
+                    printf(" humidity %.2f", record.humidity);
+                }
+                if (record.fields & READING_BATTERY_PCT)
+                {
+                    printf(" battery %d%%", record.battery_pct);
+                }
+                for (i = 0; i < record.value_count; i++)
+                {
+                    printf(" %s %.*f", record.values[i].name, record.values[i].decimals, record.values[i].value);
+                }
+                printf(lost ? " (%u lost)\n" : "\n", lost);
+                lost = 0;
+            }
+            fflush(stdout);
+            usleep(100000);
+        }
+        ble_readings_close(ring);
+    }
+}
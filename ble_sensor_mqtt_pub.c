@@ -11,6 +11,10 @@
 // 4 = Govee H5102
 // 5 = Govee H5075
 // 6 = Govee H5074
+// 7 = BTHome v2
+// 8 = Xiaomi MiBeacon
+// encrypted BTHome and MiBeacon reports are decrypted with the sensor's bindkey
+// more types can be added with decoder plugins, see ble_decoder.h
 //
 // based on work by:
 //  Intel Edison Playground
@@ -29,8 +33,10 @@
 // holds list of BLE sensors to track
 #define CONFIGURATION_FILE "/etc/ble_sensor_mqtt_pub.yaml"
 
-#define MAX_SENSORS 64
+#define MAX_SENSORS 128
 
+// recvmmsg
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -43,7 +49,17 @@
 #include <netdb.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <semaphore.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -51,7 +67,11 @@
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <yaml.h>
+#include <dlfcn.h>
+#include <openssl/evp.h>
 #include "MQTTClient.h"
+#include "ble_decoder.h"
+#include "ble_readings.h"
 
 // logging setup
 // LOG_EMERG
@@ -76,8 +96,40 @@
 int logging_level = LOG_DEBUG;
 
 #define RSYSLOG_ADDRESS "192.168.2.5"
-#define LOGMESSAGESIZE 512
-char log_message[LOGMESSAGESIZE];
+#define LOGMESSAGESIZE 2176 // longest message, room for a whole JSON message and its label
+
+// messages below this level are compiled out, make release builds with LOG_COMPILED_LEVEL=LOG_INFO
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_DEBUG
+#endif
+
+// where a log message goes
+#define LOG_SINK_STDOUT 1
+#define LOG_SINK_SYSLOG 2
+#define LOG_SINK_REMOTE 4
+#define LOG_SINK_ALL (LOG_SINK_STDOUT | LOG_SINK_SYSLOG | LOG_SINK_REMOTE)
+
+void log_write(int level, int sinks, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// console output at logging_level 7, gone entirely (arguments included) when compiled without LOG_DEBUG
+#define log_debug(...)                                                       \
+    do                                                                       \
+    {                                                                        \
+        if (LOG_DEBUG <= LOG_COMPILED_LEVEL && logging_level == LOG_DEBUG)   \
+        {                                                                    \
+            log_write(LOG_DEBUG, LOG_SINK_STDOUT, __VA_ARGS__);              \
+        }                                                                    \
+    } while (0)
+
+// local syslog and the remote syslog server
+#define log_syslog(level, ...)                                               \
+    do                                                                       \
+    {                                                                        \
+        if ((level) <= LOG_COMPILED_LEVEL)                                   \
+        {                                                                    \
+            log_write(level, LOG_SINK_SYSLOG | LOG_SINK_REMOTE, __VA_ARGS__); \
+        }                                                                    \
+    } while (0)
 
 // Paho MQTT setup
 //#define ADDRESS     "tcp://192.168.2.242:1883"
@@ -89,6 +141,27 @@ char z_client_id_mqtt[MQTTCLIENTIDSIZE];
 #define QOS 1
 #define TIMEOUT 10000L
 
+// QoS and retain flag for each class of message, set from the qos_* and retain_* settings
+// a lost state reading is replaced by the next one a few seconds later, so state can go out at QoS 0 without
+// waiting for a PUBACK, while discovery stays QoS 1 and retained. claims between gateways are always QoS 0
+enum
+{
+    MQTT_CLASS_STATE,
+    MQTT_CLASS_DISCOVERY,
+    MQTT_CLASS_STATS,
+    MQTT_CLASS_ALERT,
+    MQTT_CLASS_CLAIM,
+    MQTT_CLASSES
+};
+
+typedef struct
+{
+    int qos;
+    int retain;
+} mqtt_policy_t;
+
+mqtt_policy_t mqtt_policies[MQTT_CLASSES] = {{QOS, 0}, {QOS, 1}, {QOS, 0}, {QOS, 1}, {0, 0}};
+
 // MONITOR THIS AS YOU ADD MORE UNITS!!!!!!!!!!!!!!!!!
 #define MAXIMUM_JSON_MESSAGE 2048
 
@@ -102,6 +175,9 @@ char z_client_id_mqtt[MQTTCLIENTIDSIZE];
 // under the base topic, this sub topic will publish statistics
 // topic for hourly statistics
 const char topic_statistics[] = "$SYS/hour-stats";
+const char topic_census[] = "$SYS/census";
+// claims of the gateways hearing each sensor, followed by the sensor's unique id
+const char topic_claim[] = "$SYS/claim/";
 
 struct hci_request ble_hci_request(uint16_t ocf, int clen, void *status, void *cparam)
 {
@@ -116,19 +192,112 @@ struct hci_request ble_hci_request(uint16_t ocf, int clen, void *status, void *c
     return rq;
 }
 
+// a configured sensor, its names and settings. what the scan loop needs for every report is in sensor_hot_t, the
+// strings are in the string arena
 typedef struct
 {
     int type;
-    char mac[19];
-    char location[64];
-    char name[64];
-    char unique[64];
-    char my_id[64];
-    char make[64];
-    char model[64];
-    int readings_per_hour;
+    const char *mac;
+    const char *location;
+    const char *name;
+    const char *unique;
+    const char *my_id; // unique or mac, depending on publish_type
+    const char *make;  // from the decoder
+    const char *model;
+    int filter_median;       // -1, NAN = not set for this sensor, use the top level setting
+    double filter_temp_min;
+    double filter_temp_max;
+    double filter_temp_rate; // degrees C per minute
+    double filter_hum_rate;  // percent per minute
+    int offline_after;       // seconds without a reading before the sensor is offline, -1 = top level setting
+    const char *bindkey;     // AES key in hex of a sensor that encrypts its reports, empty = none
 } sensor_t;
 
+// per sensor state of the scan loop
+// what the loop reads and updates for every report of a sensor, packed in 64 bytes so each sensor is one cache line.
+// the addresses reports are matched against are a dense array of their own (sensor_mac_keys, see the census)
+typedef struct
+{
+    const ble_decoder_t *decoder;  // from the type, NULL for 99 and unknown types
+    struct sensor_crypto *crypto;  // NULL when the sensor has no bindkey
+    int type;
+    int readings_per_hour;
+    // the last temperature, humidity and battery, for sensors such as MiBeacon that send one per report
+    uint32_t fields;
+    uint32_t time[3]; // when each was last sent
+    int battery_pct;
+    double temperature_celsius;
+    double humidity;
+} sensor_hot_t;
+
+sensor_hot_t sensor_hot[MAX_SENSORS] __attribute__((aligned(64)));
+
+// string arena
+// the names, addresses and ids of the sensors are kept once each in one block, the sensors point into it. most are
+// short and many repeat (the locations), so this takes far less than a fixed array for each string in every sensor.
+// only the part of the arena in use takes memory
+#define STRING_ARENA_SIZE 16384
+
+char string_arena[STRING_ARENA_SIZE];
+int string_arena_used = 0;
+
+// the arena's copy of the string, the same one for equal strings
+const char *string_intern(const char *string)
+{
+    int length = strlen(string);
+    int position;
+
+    for (position = 0; position < string_arena_used; position += strlen(string_arena + position) + 1)
+    {
+        if (strcmp(string_arena + position, string) == 0)
+        {
+            return string_arena + position;
+        }
+    }
+    if (string_arena_used + length + 1 > STRING_ARENA_SIZE)
+    {
+        fprintf(stderr, "The sensor names, addresses and ids are more than %d bytes\n", STRING_ARENA_SIZE);
+        exit(1);
+    }
+    memcpy(string_arena + position, string, length + 1);
+    string_arena_used += length + 1;
+    return string_arena + position;
+}
+
+#define MAX_MQTT_OUTPUTS 4
+
+// an additional MQTT server the readings are also published to, from the mqtt_outputs list
+typedef struct
+{
+    char url[128];
+    char username[64];
+    char password[64];
+    char topic_prefix[128]; // replaces mqtt_base_topic at the start of each topic, empty = the same topics
+    int qos;                // -1 = the qos_* setting of each class of message
+    int retain;             // -1 = the retain_* setting of each class of message
+    int queue;              // messages held while the server is slow or down
+} mqtt_output_config_t;
+
+#define MAX_DECODER_SPECS 16
+#define DECODER_SPEC_FIELDS 5
+
+// a sensor type described in the decoder_specs list, compiled into a program at startup. the fields are
+// temperature, humidity, battery_pct, battery_mv and frame, each an expression such as "u24be@1 sign:23 div:1000 /10"
+typedef struct
+{
+    int type;
+    char make[32];
+    char model[32];
+    char entities[8];  // empty = from the fields given
+    int event_type;    // -1 = any
+    int manufacturer;  // company id of the manufacturer data, -1 = service data is used
+    int service;       // 16 bit uuid of the service data
+    int min_length;    // of the data after the id
+    int max_length;    // 0 = no limit
+    char require[64];  // expression that must not be 0 for the report to match, empty = none
+    char fields[DECODER_SPEC_FIELDS][64];
+} decoder_spec_config_t;
+
 typedef struct
 {
     char mqtt_server_url[128];
@@ -148,6 +317,51 @@ typedef struct
     int auto_conf_battery;
     int auto_conf_voltage;
     int auto_conf_signal;
+    char discovery_state_file[128];
+    int discovery_inflight;
+    int discovery_type;
+    char discovery_prefix[64];
+    char stats_windows[64];
+    char history_directory[128];
+    int history_interval;
+    int history_retention_days;
+    char query_socket[108];
+    char readings_ring[64];
+    int readings_ring_size;
+    int filter_median;
+    double filter_temp_min;
+    double filter_temp_max;
+    double filter_temp_rate;
+    double filter_hum_rate;
+    int qos_state;
+    int retain_state;
+    int qos_discovery;
+    int retain_discovery;
+    int qos_stats;
+    int retain_stats;
+    int qos_alert;
+    int retain_alert;
+    int mqtt_version;
+    int mqtt_state_expiry;
+    int mqtt_queue;
+    int census_top;
+    int trace_entries;
+    int trace_foreign;
+    int hci_batch;
+    int hci_receive_buffer;
+    int scan_watchdog;
+    int scan_watchdog_percent;
+    int mqtt_output_count;
+    mqtt_output_config_t mqtt_outputs[MAX_MQTT_OUTPUTS];
+    char gateway_name[64];
+    int coordination;
+    int claim_interval;
+    int claim_timeout;
+    int claim_hysteresis;
+    int offline_after;
+    char decoder_directory[128];
+    int decoder_spec_count;
+    decoder_spec_config_t decoder_specs[MAX_DECODER_SPECS];
     char syslog_address[64];
     int logging_level;
     sensor_t sensors[MAX_SENSORS];
@@ -168,6 +382,10 @@ void to_data(bool *seq_status, unsigned int *map_seq, config_t *config,
              yaml_parser_t *parser, yaml_event_t *event, FILE *fp);
 void to_data_from_map(char *buf, unsigned int *map_seq, config_t *config,
                       yaml_parser_t *parser, yaml_event_t *event, FILE *fp);
+void to_data_from_output_map(char *buf, config_t *config,
+                             yaml_parser_t *parser, yaml_event_t *event, FILE *fp);
+void to_data_from_decoder_spec_map(char *buf, config_t *config,
+                                   yaml_parser_t *parser, yaml_event_t *event, FILE *fp);
 
 /* Post parsing utilities */
 void print_data(unsigned int sensor_count, config_t *config);
@@ -215,62 +433,271 @@ char advertising_packet_type_desc[9][30] =
         (byte & 0x02 ? '1' : '0'), \
         (byte & 0x01 ? '1' : '0')
 
-// this function sends a log message to a remote syslog server
-// call with:
-//  log level
-//  hostname of logging server
-//  program name that is sending log message
-//  message
+// asynchronous logging
+// log_write formats the message and copies it into a bounded lock free queue (multiple producers, one consumer,
+// each slot has a sequence number telling whether it is free or filled) and posts a semaphore, it never blocks and
+// never does I/O. slots are small, a longer message such as a JSON payload takes several slots in a row, claimed
+// together. a writer thread drains the queue to stdout, syslog and the remote syslog server. when the queue is full
+// the message is dropped and counted, the scan loop is never held up by logging
+#define LOG_QUEUE_SIZE 256 // power of 2
+#define LOG_SLOT_TEXT 244  // a slot is 256 bytes
+#define RSYSLOGPORT 514
 
-void send_remote_syslog_message(int log_level, char *hostname, char *program_name, char *message)
+typedef struct
 {
-    int sockfd, n;
-    int serverlen;
-    int message_length;
-    struct sockaddr_in serveraddr;
-    struct hostent *server;
-#define LOGBUFFERSIZE 1024
-    char syslogbuf[LOGBUFFERSIZE];
-#define RSYSLOGPORT 514
+    atomic_ulong sequence;
+    short level;
+    unsigned char sinks;
+    bool more;                 // the message goes on in the next slot
+    char text[LOG_SLOT_TEXT];  // only the last slot of a message can be shorter, it is then terminated
+} log_slot_t;
+
+log_slot_t log_queue[LOG_QUEUE_SIZE];
+atomic_ulong log_enqueue_position = 0;
+unsigned long log_dequeue_position = 0; // writer thread only
+char log_message[LOGMESSAGESIZE];       // writer thread only, the message being put back together
+int log_message_length = 0;
+atomic_ulong log_dropped = 0;
+atomic_bool log_stopping = false;
+sem_t log_available;
+pthread_t log_writer_thread;
+bool log_writer_running = false;
+
+void log_write(int level, int sinks, const char *format, ...)
+{
+    unsigned long position;
+    unsigned long last;
+    unsigned long sequence;
+    log_slot_t *slot;
+    char message[LOGMESSAGESIZE];
+    va_list args;
+    int length;
+    int slots;
+    int n;
+
+    va_start(args, format);
+    length = vsnprintf(message, LOGMESSAGESIZE, format, args);
+    va_end(args);
+    length = length < 0 ? 0 : length >= LOGMESSAGESIZE ? LOGMESSAGESIZE - 1 : length;
+    slots = length > LOG_SLOT_TEXT ? (length + LOG_SLOT_TEXT - 1) / LOG_SLOT_TEXT : 1;
+
+    // claim the slots, the writer frees them in order so the last one being free means they all are
+    position = atomic_load_explicit(&log_enqueue_position, memory_order_relaxed);
+    for (;;)
+    {
+        last = position + slots - 1;
+        sequence = atomic_load_explicit(&log_queue[last & (LOG_QUEUE_SIZE - 1)].sequence, memory_order_acquire);
+        if (sequence == last)
+        {
+            if (atomic_compare_exchange_weak_explicit(&log_enqueue_position, &position, position + slots,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if ((long)(sequence - last) < 0)
+        {
+            // full
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = atomic_load_explicit(&log_enqueue_position, memory_order_relaxed);
+        }
+    }
 
-    // socket: create the socket
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+    for (n = 0; n < slots; n++)
     {
-        fprintf(stderr, "ERROR opening socket for remote syslog write");
-        exit(1);
+        slot = &log_queue[(position + n) & (LOG_QUEUE_SIZE - 1)];
+        slot->level = level;
+        slot->sinks = sinks;
+        slot->more = n < slots - 1;
+        if (length - n * LOG_SLOT_TEXT < LOG_SLOT_TEXT)
+        {
+            memcpy(slot->text, message + n * LOG_SLOT_TEXT, length - n * LOG_SLOT_TEXT + 1);
+        }
+        else
+        {
+            memcpy(slot->text, message + n * LOG_SLOT_TEXT, LOG_SLOT_TEXT);
+        }
+        atomic_store_explicit(&slot->sequence, position + n + 1, memory_order_release);
     }
+    sem_post(&log_available);
+}
 
-    // gethostbyname: get the server's DNS entry
-    server = gethostbyname(hostname);
+// remote syslog server address, looked up once by the writer thread
+int log_remote_open(struct sockaddr_in *address)
+{
+    struct hostent *server;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR opening socket for remote syslog write\n");
+        return -1;
+    }
+    server = gethostbyname(RSYSLOG_ADDRESS);
     if (server == NULL)
     {
-        fprintf(stderr, "ERROR, no such host as %s for remote syslog write\n", hostname);
-        exit(1);
+        fprintf(stderr, "ERROR, no such host as %s for remote syslog write\n", RSYSLOG_ADDRESS);
+        close(fd);
+        return -1;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    memcpy(&address->sin_addr.s_addr, server->h_addr, server->h_length);
+    address->sin_port = htons(RSYSLOGPORT);
+    return fd;
+}
+
+void log_output(int level, int sinks, char *message, int remote_fd, struct sockaddr_in *remote_address)
+{
+    char buffer[LOGMESSAGESIZE + 64];
+    int length;
+
+    if (sinks & LOG_SINK_STDOUT)
+    {
+        fputs(message, stdout);
     }
+    if (sinks & (LOG_SINK_SYSLOG | LOG_SINK_REMOTE))
+    {
+        // syslog lines don't end in a newline
+        length = strlen(message);
+        if (length > 0 && message[length - 1] == '\n')
+        {
+            message[length - 1] = '\0';
+        }
+    }
+    if (sinks & LOG_SINK_SYSLOG)
+    {
+        syslog(level, "%s v: %d.%d %s", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, message);
+    }
+    if ((sinks & LOG_SINK_REMOTE) && remote_fd >= 0)
+    {
+        length = snprintf(buffer, sizeof(buffer), "<%d>%s %s v: %d.%d %s", LOG_USER + level, PROGRAM_NAME, PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, message);
+        if (sendto(remote_fd, buffer, length < (int)sizeof(buffer) ? length : (int)sizeof(buffer) - 1, 0,
+                   (struct sockaddr *)remote_address, sizeof(*remote_address)) < 0)
+        {
+            fprintf(stderr, "ERROR in sendto for remote syslog write\n");
+        }
+    }
+}
+
+// take everything queued, returns the number of messages written. a message whose later slots are not filled yet
+// is finished at the next call
+int log_drain(int remote_fd, struct sockaddr_in *remote_address)
+{
+    log_slot_t *slot;
+    int length;
+    int count = 0;
 
-    // build the server's Internet address
-    bzero((char *)&serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-          (char *)&serveraddr.sin_addr.s_addr, server->h_length);
-    serveraddr.sin_port = htons(RSYSLOGPORT);
+    for (;;)
+    {
+        slot = &log_queue[log_dequeue_position & (LOG_QUEUE_SIZE - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != log_dequeue_position + 1)
+        {
+            break;
+        }
+        length = strnlen(slot->text, LOG_SLOT_TEXT);
+        memcpy(log_message + log_message_length, slot->text, length);
+        log_message_length += length;
+        if (!slot->more)
+        {
+            log_message[log_message_length] = '\0';
+            log_output(slot->level, slot->sinks, log_message, remote_fd, remote_address);
+            log_message_length = 0;
+            count++;
+        }
+        atomic_store_explicit(&slot->sequence, log_dequeue_position + LOG_QUEUE_SIZE, memory_order_release);
+        log_dequeue_position++;
+    }
+    return count;
+}
 
-    // build the syslog message
-    message_length = snprintf(syslogbuf, LOGBUFFERSIZE, "<%d>%s %s", LOG_USER + log_level, program_name, message);
+void *log_writer(void *arg)
+{
+    struct sockaddr_in remote_address;
+    int remote_fd = log_remote_open(&remote_address);
+    unsigned long dropped_reported = 0;
+    unsigned long dropped;
+    char message[LOGMESSAGESIZE];
+
+    (void)arg;
+    for (;;)
+    {
+        while (sem_wait(&log_available) != 0 && errno == EINTR)
+            ;
+        if (log_drain(remote_fd, &remote_address) > 0)
+        {
+            fflush(stdout);
+        }
 
-    // fprintf(stdout, "%s\n", syslogbuf);
+        dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+        if (dropped != dropped_reported)
+        {
+            snprintf(message, sizeof(message), "%lu log messages dropped, logging could not keep up", dropped - dropped_reported);
+            log_output(LOG_WARNING, LOG_SINK_SYSLOG | LOG_SINK_REMOTE, message, remote_fd, &remote_address);
+            dropped_reported = dropped;
+        }
 
-    // send the message to the server
-    serverlen = sizeof(serveraddr);
-    n = sendto(sockfd, syslogbuf, strlen(syslogbuf), 0, (struct sockaddr *)&serveraddr, serverlen);
-    if (n < 0)
+        if (atomic_load(&log_stopping))
+        {
+            log_drain(remote_fd, &remote_address);
+            fflush(stdout);
+            break;
+        }
+    }
+    if (remote_fd >= 0)
     {
-        fprintf(stderr, "ERROR in sendto for remote syslog write\n");
-        exit(1);
+        close(remote_fd);
     }
+    return NULL;
+}
+
+// at exit, including exit() on errors, write out what is still queued
+void log_shutdown(void)
+{
+    struct sockaddr_in remote_address;
+    int remote_fd;
+
+    atomic_store(&log_stopping, true);
+    if (log_writer_running && !pthread_equal(pthread_self(), log_writer_thread))
+    {
+        sem_post(&log_available);
+        pthread_join(log_writer_thread, NULL);
+        log_writer_running = false;
+    }
+    else if (!log_writer_running)
+    {
+        remote_fd = log_remote_open(&remote_address);
+        log_drain(remote_fd, &remote_address);
+        fflush(stdout);
+        if (remote_fd >= 0)
+        {
+            close(remote_fd);
+        }
+    }
+}
+
+// first thing in main, before anything is logged
+void log_init(void)
+{
+    int n;
 
-    return;
+    for (n = 0; n < LOG_QUEUE_SIZE; n++)
+    {
+        atomic_init(&log_queue[n].sequence, n);
+    }
+    sem_init(&log_available, 0, 0);
+    atexit(log_shutdown);
+    if (pthread_create(&log_writer_thread, NULL, log_writer, NULL) != 0)
+    {
+        fprintf(stderr, "Could not start the logging thread, messages are written at exit\n");
+        return;
+    }
+    log_writer_running = true;
 }
 
 // catch <ctr>-c to exit program
@@ -283,2109 +710,7384 @@ void intHandler(int dummy)
 
 // MQTT async routines
 
-volatile MQTTClient_deliveryToken deliveredtoken;
-
-void delivered(void *context, MQTTClient_deliveryToken dt)
-{
-    // printf("Message with token value %d delivery confirmed\n", dt);
-    deliveredtoken = dt;
-}
+bool claim_receive(const char *topic, const char *payload, int length);
+int claim_subscribe(MQTTClient client);
+bool discovery_receive(const char *topic, const char *payload, int length, int retained);
 
 // MQTT received message handler
 int msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *message)
 {
-    int i;
-    char *payloadptr;
-    fprintf(stdout, "Message arrived\n");
-    fprintf(stdout, "     topic: %s\n", topicName);
-    fprintf(stdout, "     message: ");
-    payloadptr = message->payload;
-    for (i = 0; i < message->payloadlen; i++)
+    if (claim_receive(topicName, message->payload, message->payloadlen) ||
+        discovery_receive(topicName, message->payload, message->payloadlen, message->retained))
     {
-        putc(*payloadptr++, stdout);
+        MQTTClient_freeMessage(&message);
+        MQTTClient_free(topicName);
+        return 1;
     }
-    fprintf(stdout, "\n");
+    log_write(LOG_INFO, LOG_SINK_STDOUT, "Message arrived\n     topic: %s\n     message: %.*s\n", topicName, message->payloadlen, (char *)message->payload);
     MQTTClient_freeMessage(&message);
     MQTTClient_free(topicName);
     return 1;
 }
 
-// MQTT connection to server lost handler
+// MQTT connection to server lost handler, the MQTT output thread connects again
 void connlost(void *context, char *cause)
 {
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d MQTT Server Connection lost", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-    send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_ERR, "%s", log_message);
-    fprintf(stderr, "MQTT Server Connection lost, cause: %s\n", cause);
-    exit(1);
+    (void)context;
+    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT Server Connection lost, cause: %s\n", cause != NULL ? cause : "unknown");
 }
 
-// for reading configuration file
-// read a field from the input line
-char *getfield(char *line, int num)
+// Home Assistant auto configuration (discovery) publishing
+// a hash of every retained .../config message is kept in a small state file, on the next start messages
+// whose topic and hash match what was last delivered to the same broker are skipped. the rest are
+// published without waiting for each PUBACK, up to discovery_inflight messages are outstanding at once. only a
+// PUBACK counts as delivered, with qos_discovery 0 every message is published at every start. every topic is
+// recorded, one without a confirmed delivery with hash 0, which never matches, so it is still known and removed
+// when its sensor goes away. the state file only knows what was sent, not what the broker still holds, so
+// when Home Assistant announces online on [discovery_prefix]/status everything is published again
+
+// one line per message : 16 hex digit hash, space, topic
+#define DISCOVERY_MAX_MESSAGES (MAX_SENSORS * 7 + 1)
+#define DISCOVERY_TOPIC_SIZE 200
+#define DISCOVERY_MAX_INFLIGHT 64
+#define DISCOVERY_DEFAULT_INFLIGHT 16
+
+typedef struct
 {
-    char *tok;
-    for (tok = strtok(line, ",");
-         tok && *tok;
-         tok = strtok(NULL, ",\n"))
+    char topic[DISCOVERY_TOPIC_SIZE];
+    uint64_t hash;  // 0 if the broker may not hold the message
+    bool removing;  // an empty retained message was sent to remove it, dropped from the state once delivered
+} discovery_state_t;
+
+// hashes read from the state file at startup
+discovery_state_t discovery_state_old[DISCOVERY_MAX_MESSAGES];
+int discovery_state_old_count = 0;
+
+// hashes of messages generated this run, written back to the state file once delivered
+discovery_state_t discovery_state_new[DISCOVERY_MAX_MESSAGES];
+int discovery_state_new_count = 0;
+
+// ring of delivery tokens for messages in flight, and the state entry each one belongs to
+MQTTClient_deliveryToken discovery_tokens[DISCOVERY_MAX_INFLIGHT];
+int discovery_token_entry[DISCOVERY_MAX_INFLIGHT];
+int discovery_inflight_head = 0;
+int discovery_inflight_count = 0;
+int discovery_inflight_max = DISCOVERY_DEFAULT_INFLIGHT;
+
+int discovery_published = 0;
+int discovery_skipped = 0;
+
+// the broker address is part of every hash so pointing at a new broker publishes everything again
+uint64_t discovery_hash_seed;
+
+// set from the MQTT client thread when Home Assistant comes online, the primary output thread publishes again
+atomic_bool discovery_republish = false;
+config_t *discovery_config = NULL;
+int discovery_sensor_count = 0;
+
+// 64 bit FNV-1a, continue a running hash over another block of bytes
+uint64_t fnv1a_hash(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    for (n = 0; n < length; n++)
     {
-        if (!--num)
-            return tok;
+        hash ^= p[n];
+        hash *= 0x100000001b3ULL;
     }
-    return NULL;
+    return hash;
 }
 
-// trim leading and trailing white space from a character string
-// https://stackoverflow.com/questions/122616/how-do-i-trim-leading-trailing-whitespace-in-a-standard-way
-char *trim(char *str)
-{
-    int isspace(int);
-    size_t len = 0;
-    char *frontp = str;
-    char *endp = NULL;
+#define FNV1A_HASH_INIT 0xcbf29ce484222325ULL
 
-    if (str == NULL)
+// read hashes of the discovery messages published at the last start, a missing file just means publish everything
+// with all set the hashes are forgotten and every message is published, the topics are still known for removal
+void discovery_begin(config_t *config, bool all)
+{
+    FILE *fp;
+    char line[DISCOVERY_TOPIC_SIZE + 32];
+    unsigned long long hash;
+    char topic[DISCOVERY_TOPIC_SIZE];
+
+    discovery_state_old_count = 0;
+    discovery_state_new_count = 0;
+    discovery_inflight_head = 0;
+    discovery_inflight_count = 0;
+    discovery_published = 0;
+    discovery_skipped = 0;
+    discovery_hash_seed = fnv1a_hash(FNV1A_HASH_INIT, config->mqtt_server_url, strlen(config->mqtt_server_url));
+
+    discovery_inflight_max = config->discovery_inflight;
+    if (discovery_inflight_max <= 0)
     {
-        return NULL;
+        discovery_inflight_max = DISCOVERY_DEFAULT_INFLIGHT;
     }
-    if (str[0] == '\0')
+    if (discovery_inflight_max > DISCOVERY_MAX_INFLIGHT)
     {
-        return str;
+        discovery_inflight_max = DISCOVERY_MAX_INFLIGHT;
     }
 
-    len = strlen(str);
-    endp = str + len;
+    if (config->discovery_state_file[0] == '\0')
+    {
+        return;
+    }
 
-    // Move the front and back pointers to address the first non-whitespace
-    // characters from each end.
-    while (isspace((unsigned char)*frontp))
+    fp = fopen(config->discovery_state_file, "r");
+    if (fp == NULL)
     {
-        ++frontp;
+        if (logging_level > LOG_INFO)
+        {
+            log_write(LOG_INFO, LOG_SINK_STDOUT, "No discovery state file %s, publishing all auto configuration messages\n", config->discovery_state_file);
+        }
+        return;
     }
-    if (endp != frontp)
+
+    while (fgets(line, sizeof(line), fp) != NULL && discovery_state_old_count < DISCOVERY_MAX_MESSAGES)
     {
-        while (isspace((unsigned char)*(--endp)) && endp != frontp)
+        if (sscanf(line, "%16llx %199s", &hash, topic) == 2)
         {
+            strcpy(discovery_state_old[discovery_state_old_count].topic, topic);
+            discovery_state_old[discovery_state_old_count].hash = all ? 0 : hash;
+            discovery_state_old[discovery_state_old_count].removing = false;
+            discovery_state_old_count++;
         }
     }
+    fclose(fp);
+}
 
-    if (frontp != str && endp == frontp)
-        *str = '\0';
-    else if (str + len - 1 != endp)
-        *(endp + 1) = '\0';
+// MQTT 5 connection, set by mqtt_version: 5
+// state messages for each sensor get a topic alias, after the first message only the 2 byte alias is sent instead
+// of the full topic. the sensor name and location go in user properties instead of the JSON body, and state
+// messages can carry an expiry so readings queued during an outage are not delivered long after the fact
+int mqtt_version = MQTTVERSION_3_1_1;
+int mqtt_state_expiry = 0;
+config_t *mqtt_config = NULL;
 
-    // Shift the string so that it starts at str so that if it's dynamically
-    // allocated, we can still free it on the returned pointer.  Note the reuse
-    // of endp to mean the front of the string buffer now.
-    endp = str;
-    if (frontp != str)
+// QoS, retain and MQTT 5 settings for publishing from the configuration
+void mqtt_policy_init(config_t *config)
+{
+    int settings[MQTT_CLASSES][2] = {
+        {config->qos_state, config->retain_state},
+        {config->qos_discovery, config->retain_discovery},
+        {config->qos_stats, config->retain_stats},
+        {config->qos_alert, config->retain_alert},
+        {0, 0}};
+    int c;
+
+    for (c = 0; c < MQTT_CLASSES; c++)
     {
-        while (*frontp)
+        if (settings[c][0] < 0 || settings[c][0] > 2)
         {
-            *endp++ = *frontp++;
+            fprintf(stderr, "Invalid MQTT QoS %d, must be 0, 1 or 2\n", settings[c][0]);
+            exit(1);
         }
-        *endp = '\0';
+        mqtt_policies[c].qos = settings[c][0];
+        mqtt_policies[c].retain = settings[c][1] != 0;
     }
 
-    return str;
+    if (config->mqtt_version != 0 && config->mqtt_version != 3 && config->mqtt_version != 5)
+    {
+        fprintf(stderr, "Invalid mqtt_version %d, must be 3 or 5\n", config->mqtt_version);
+        exit(1);
+    }
+    mqtt_version = config->mqtt_version == 5 ? MQTTVERSION_5 : MQTTVERSION_3_1_1;
+    mqtt_state_expiry = config->mqtt_state_expiry;
+    mqtt_config = config;
 }
 
-int main(int argc, char *argv[])
+// publish with the MQTT 3 or MQTT 5 call, the client rejects calls for the other version
+int mqtt_client_publish(MQTTClient client, const char *topic, MQTTClient_message *message, MQTTClient_deliveryToken *token)
 {
+    MQTTResponse response;
 
-    // startup
-    fprintf(stdout, "%s v%2d.%02d\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-
-    // handle signals, SIGINT
-    struct sigaction act;
-    act.sa_handler = intHandler;
-    sigaction(SIGINT, &act, NULL);
-
-    if (argc != 2)
+    if (mqtt_version != MQTTVERSION_5)
     {
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Start program with a single argument pointing to yaml config file\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Start program with a single argument pointing to yaml config file\n");
-        exit(1);
+        return MQTTClient_publishMessage(client, topic, message, token);
     }
+    response = MQTTClient_publishMessage5(client, topic, message, token);
+    MQTTResponse_free(response);
+    return response.reasonCode;
+}
 
-    config_t config;
-
-    int sensor_count;
-    sensor_count = parser(&config, argv);
+// subscribe with the MQTT 3 or MQTT 5 call
+int mqtt_client_subscribe(MQTTClient client, const char *topic)
+{
+    MQTTResponse response;
+    int rc;
 
-    int x;
-    for (x = 0; x < sensor_count; x++)
+    if (mqtt_version == MQTTVERSION_5)
     {
-        if (config.publish_type)
-        {
-            strcpy(config.sensors[x].my_id, config.sensors[x].unique);
-        }
-        else
-        {
-            strcpy(config.sensors[x].my_id, config.sensors[x].mac);
-        }
-        switch (config.sensors[x].type)
-        {
-        case 1:
-            strcpy(config.sensors[x].make, "Xiaomi");
-            strcpy(config.sensors[x].model, "LYWSD03MMC-ATC");
-            break;
-        case 2:
-            strcpy(config.sensors[x].make, "Govee");
-            strcpy(config.sensors[x].model, "H5052");
-            break;
-        case 3:
-            strcpy(config.sensors[x].make, "Govee");
-            strcpy(config.sensors[x].model, "H5072");
-            break;
-        case 4:
-            strcpy(config.sensors[x].make, "Govee");
-            strcpy(config.sensors[x].model, "H5102");
-            break;
-        case 5:
-            strcpy(config.sensors[x].make, "Govee");
-            strcpy(config.sensors[x].model, "H5075");
-            break;
-        case 6:
-            strcpy(config.sensors[x].make, "Govee");
-            strcpy(config.sensors[x].model, "H5074");
-            break;
-        default:
-            strcpy(config.sensors[x].make, "");
-            strcpy(config.sensors[x].model, "");
-        }
+        response = MQTTClient_subscribe5(client, topic, 0, NULL, NULL);
+        // the granted QoS, or a failure reason code from 0x80 up
+        rc = response.reasonCode >= 0 && response.reasonCode < 0x80 ? MQTTCLIENT_SUCCESS : response.reasonCode;
+        MQTTResponse_free(response);
     }
-    logging_level = config.logging_level;
-
-    if (logging_level > LOG_NOTICE)
+    else
     {
-        print_data(sensor_count, &config);
+        rc = MQTTClient_subscribe(client, topic, 0);
     }
+    if (rc != MQTTCLIENT_SUCCESS)
+    {
+        log_write(LOG_ERR, LOG_SINK_ALL, "Could not subscribe to %s, return code %d\n", topic, rc);
+    }
+    return rc;
+}
 
-    int hci_devs_num;
-    struct hci_dev_info *hci_devs;
+// name and location for a state message body, with MQTT 5 they are sent as user properties instead
+const char *state_identity(config_t *config, int sensor)
+{
+    static char identity[128];
 
-    int ret, status;
+    if (mqtt_version == MQTTVERSION_5)
+    {
+        return "";
+    }
+    snprintf(identity, sizeof(identity), ",\"name\":\"%s\",\"location\":\"%s\"", config->sensors[sensor].name, config->sensors[sensor].location);
+    return identity;
+}
 
-    // bluetooth adapter mac address
-    char bluetooth_adapter_mac[19];
-    // adapter number
-    int bluetooth_adapter_number;
+// wait for the oldest message in flight, a failed delivery clears its hash so it is retried next start. a removal
+// that was delivered is dropped from the state, one that was not is tried again next start
+void discovery_wait_oldest(MQTTClient client)
+{
+    int rc;
+    int entry;
 
-    // get the info about each of the bluetooth adapters in system
-    if (hci_devlist(&hci_devs, &hci_devs_num))
+    rc = MQTTClient_waitForCompletion(client, discovery_tokens[discovery_inflight_head], TIMEOUT);
+    entry = discovery_token_entry[discovery_inflight_head];
+    if (rc != MQTTCLIENT_SUCCESS && discovery_state_new[entry].removing)
     {
-
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Couldn't enumerate HCI devices: %s", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, strerror(errno));
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Couldn't enumerate HCI devices: %s", strerror(errno));
-        exit(1);
+        log_write(LOG_ERR, LOG_SINK_ALL, "Removal of auto configuration message not confirmed by MQTT server, topic %s, return code %d\n", discovery_state_new[entry].topic, rc);
     }
-    else
+    else if (rc != MQTTCLIENT_SUCCESS)
     {
-        fprintf(stdout, "%u Bluetooth adapter(s) in system.\n", hci_devs_num);
+        log_write(LOG_ERR, LOG_SINK_ALL, "Auto configuration message not confirmed by MQTT server, topic %s, return code %d\n", discovery_state_new[entry].topic, rc);
+        discovery_state_new[entry].hash = 0;
     }
+    else if (discovery_state_new[entry].removing)
+    {
+        discovery_state_new[entry].topic[0] = '\0';
+    }
+    discovery_inflight_head = (discovery_inflight_head + 1) % discovery_inflight_max;
+    discovery_inflight_count--;
+}
 
-    // get requested adapter number from command line
-    bluetooth_adapter_number = config.bluetooth_adapter;
-
-    int ble_scan_type; // 0 = passive, 1 = active scan
-
-    ble_scan_type = config.scan_type;
+// publish one retained discovery message unless the broker already holds identical content
+void discovery_publish(MQTTClient client, const char *topic, const char *payload, int payload_length)
+{
+    uint64_t hash;
+    int entry;
+    int n;
+    int rc;
+    MQTTClient_message message = MQTTClient_message_initializer;
+    MQTTClient_deliveryToken token;
 
-    if (ble_scan_type != 1)
+    if (discovery_state_new_count >= DISCOVERY_MAX_MESSAGES || strlen(topic) >= DISCOVERY_TOPIC_SIZE)
     {
-        ble_scan_type = 0;
+        log_write(LOG_ERR, LOG_SINK_ALL, "Too many or too long auto configuration messages, topic %s\n", topic);
+        exit(-1);
     }
 
-    //int ble_scan_interval = 65; // value * 0.625 ms, scan every 41 milliseconds
-    //int ble_scan_window = 750; // value * 0.625 ms, window 469 milliseconds
-    int ble_scan_window = 48;     // value * 0.625 ms, window 30 milliseconds
-    int ble_scan_interval = 1500; // value * 0.625 ms, scan every 975 milliseconds
+    hash = fnv1a_hash(discovery_hash_seed, topic, strlen(topic));
+    hash = fnv1a_hash(hash, payload, payload_length);
 
-    ble_scan_window = config.scan_window;
+    entry = discovery_state_new_count++;
+    strcpy(discovery_state_new[entry].topic, topic);
+    discovery_state_new[entry].hash = hash;
+    discovery_state_new[entry].removing = false;
 
-    if (ble_scan_window == 0)
+    for (n = 0; n < discovery_state_old_count; n++)
     {
-        ble_scan_window = 48;
+        if (discovery_state_old[n].hash != 0 && discovery_state_old[n].hash == hash && strcmp(discovery_state_old[n].topic, topic) == 0)
+        {
+            discovery_skipped++;
+            return;
+        }
     }
 
-    ble_scan_interval = config.scan_interval;
-
-    if (ble_scan_interval == 0)
+    // window full, wait for the oldest PUBACK before sending another
+    if (discovery_inflight_count == discovery_inflight_max)
     {
-        ble_scan_interval = 1500;
+        discovery_wait_oldest(client);
     }
 
-    if (bluetooth_adapter_number < 0 || bluetooth_adapter_number > hci_devs_num - 1)
+    message.payload = (void *)payload;
+    message.payloadlen = payload_length;
+    message.qos = mqtt_policies[MQTT_CLASS_DISCOVERY].qos;
+    message.retained = mqtt_policies[MQTT_CLASS_DISCOVERY].retain;
+    rc = mqtt_client_publish(client, topic, &message, &token);
+    if (rc != MQTTCLIENT_SUCCESS)
     {
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Enter bluetooth adapter number between 0 and %u !!\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, hci_devs_num - 1);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Enter bluetooth adapter number between 0 and %u !!\n", hci_devs_num - 1);
-        exit(1);
+        log_write(LOG_ERR, LOG_SINK_ALL, "Failed to publish auto configuration message, topic %s, return code %d\n", topic, rc);
+        discovery_state_new[entry].hash = 0;
+        return;
     }
+    discovery_published++;
 
-    // get MAC address for adapter selected
-    strcpy(bluetooth_adapter_mac, batostr(&hci_devs[bluetooth_adapter_number].bdaddr));
+    // nothing comes back for QoS 0, so there is nothing to wait for and no proof of delivery. the topic is
+    // recorded without its hash and the message is published again at the next start
+    if (mqtt_policies[MQTT_CLASS_DISCOVERY].qos == 0)
+    {
+        discovery_state_new[entry].hash = 0;
+        return;
+    }
 
-    // log startup of program
-    // strcpy(log_message, "test message *****");
-    setlogmask(LOG_UPTO(LOG_INFO));
-    openlog(PROGRAM_NAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Starting.", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
+    n = (discovery_inflight_head + discovery_inflight_count) % discovery_inflight_max;
+    discovery_tokens[n] = token;
+    discovery_token_entry[n] = entry;
+    discovery_inflight_count++;
+}
 
-    // maximum number of sensors
-    // #define MAXIMUM_UNITS 40
-    // number of devices read from configuration file
-    int mac_total;
+// drain the messages still in flight and write the new state file
+void discovery_end(MQTTClient client, config_t *config)
+{
+    FILE *fp;
+    char temp_file[sizeof(config->discovery_state_file) + 8];
+    MQTTClient_message message = MQTTClient_message_initializer;
+    int generated = discovery_state_new_count;
+    int entry;
+    int n;
+    int m;
+    int rc;
 
-    int sensor_data_start;
+    // topics published at the last start but not this time, e.g. a removed sensor or a switch between entity
+    // and device based discovery, an empty retained message makes Home Assistant delete the old entities
+    for (n = 0; n < discovery_state_old_count; n++)
+    {
+        for (m = 0; m < generated; m++)
+        {
+            if (strcmp(discovery_state_old[n].topic, discovery_state_new[m].topic) == 0)
+            {
+                break;
+            }
+        }
+        if (m < generated || discovery_state_new_count >= DISCOVERY_MAX_MESSAGES)
+        {
+            continue;
+        }
 
-    // total number of devices read from configuration file
-    mac_total = sensor_count;
+        // kept in the new state until the removal is delivered
+        entry = discovery_state_new_count++;
+        strcpy(discovery_state_new[entry].topic, discovery_state_old[n].topic);
+        discovery_state_new[entry].hash = 0;
+        discovery_state_new[entry].removing = true;
 
-    fprintf(stdout, "Total devices in configuration file : %d\n", mac_total);
+        if (discovery_inflight_count == discovery_inflight_max)
+        {
+            discovery_wait_oldest(client);
+        }
+        // always retained, only a retained empty message clears the retained configuration on the server
+        message.payload = "";
+        message.payloadlen = 0;
+        message.qos = QOS;
+        message.retained = 1;
+        rc = mqtt_client_publish(client, discovery_state_old[n].topic, &message, &discovery_tokens[(discovery_inflight_head + discovery_inflight_count) % discovery_inflight_max]);
+        if (rc != MQTTCLIENT_SUCCESS)
+        {
+            log_write(LOG_ERR, LOG_SINK_ALL, "Failed to remove auto configuration message, topic %s, return code %d\n", discovery_state_old[n].topic, rc);
+            continue;
+        }
+        if (logging_level > LOG_INFO)
+        {
+            log_write(LOG_INFO, LOG_SINK_STDOUT, "  Removing: %s\n", discovery_state_old[n].topic);
+        }
+        discovery_token_entry[(discovery_inflight_head + discovery_inflight_count) % discovery_inflight_max] = entry;
+        discovery_inflight_count++;
+    }
 
-    // // create the MQTT topic from the base topic string and the MAC address of sensor
-    // int topic_length;
-    // char topic_buffer[200];
-    // int topic_buffer_size = 200;
+    while (discovery_inflight_count > 0)
+    {
+        discovery_wait_oldest(client);
+    }
 
-    // initialize MQTT
-    MQTTClient client;
-    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-    MQTTClient_message pubmsg = MQTTClient_message_initializer;
-    MQTTClient_deliveryToken token;
-    int rc;
+    if (config->discovery_state_file[0] == '\0')
+    {
+        return;
+    }
 
-    // set MQTT client ID to program name plus bluetooth mac address, to allow multiple instances on one machine
-    snprintf(z_client_id_mqtt, MQTTCLIENTIDSIZE, "%s-%s", PROGRAM_NAME, bluetooth_adapter_mac);
-    fprintf(stdout, "MQTT client name : %s\n", z_client_id_mqtt);
-    MQTTClient_create(&client, config.mqtt_server_url, z_client_id_mqtt, MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    //     MQTTClient_create(&client, ADDRESS, CLIENTID, MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    conn_opts.keepAliveInterval = 20;
-    conn_opts.cleansession = 1;
-    conn_opts.username = config.mqtt_username;
-    conn_opts.password = config.mqtt_password;
-    MQTTClient_setCallbacks(client, NULL, connlost, msgarrvd, delivered);
-    if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)
-    {
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d failed to connect to MQTT server", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Failed to connect to MQTT server, return code %d\n", rc);
-        exit(1);
+    // write to a temporary file and rename so a crash never leaves a truncated state file
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", config->discovery_state_file);
+    fp = fopen(temp_file, "w");
+    if (fp == NULL)
+    {
+        log_write(LOG_ERR, LOG_SINK_ALL, "Could not write discovery state file %s: %s\n", temp_file, strerror(errno));
+        return;
+    }
+    for (n = 0; n < discovery_state_new_count; n++)
+    {
+        if (discovery_state_new[n].topic[0] != '\0')
+        {
+            fprintf(fp, "%016llx %s\n", (unsigned long long)discovery_state_new[n].hash, discovery_state_new[n].topic);
+        }
     }
+    if (fclose(fp) != 0 || rename(temp_file, config->discovery_state_file) != 0)
+    {
+        log_write(LOG_ERR, LOG_SINK_ALL, "Could not write discovery state file %s: %s\n", config->discovery_state_file, strerror(errno));
+        unlink(temp_file);
+    }
+}
 
-    // Get HCI device.
+// device based auto configuration
+// instead of one .../config message per entity, each repeating the full "dev" block, Home Assistant accepts a
+// single message per device under [discovery_prefix]/device/[id]/config with all entities listed in "cmps"
+#define DISCOVERY_DEVICE_MESSAGE 4096
 
-    const int bluetooth_device = hci_open_dev(hci_get_route(&hci_devs[bluetooth_adapter_number].bdaddr));
+typedef struct
+{
+    char suffix;         // appended to the sensor name and unique id, same as the entity based messages
+    const char *dev_cla; // Home Assistant device class
+    const char *unit;    // unit of measurement
+    const char *field;   // field of the JSON state message
+} discovery_component_t;
 
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Bluetooth Adapter : %u has MAC address : %s\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, bluetooth_adapter_number, bluetooth_adapter_mac);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
-    fprintf(stdout, "Bluetooth Adapter : %u has MAC address : %s\n", bluetooth_adapter_number, bluetooth_adapter_mac);
+const discovery_component_t discovery_components[] =
+    {
+        {'F', "temperature", "°F", "tempf"},
+        {'T', "temperature", "°C", "tempc"},
+        {'H', "humidity", "%", "humidity"},
+        {'B', "battery", "%", "batterypct"},
+        {'V', "voltage", "mV", "batterymv"},
+        {'S', "signal_strength", "dBm", "rssi"}};
+
+// does the sensor's type have this entity, and is it switched on by the auto_conf_* settings
+int discovery_component_enabled(config_t *config, int sensor, char suffix)
+{
+    const ble_decoder_t *decoder = sensor_hot[sensor].decoder;
 
-    if (bluetooth_device < 0)
+    // the entities the sensor type has
+    if (decoder == NULL || strchr(decoder->entities, suffix) == NULL)
     {
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d failed to open HCI device", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Failed to open HCI device, return code %d\n", bluetooth_device);
-        exit(1);
+        return 0;
     }
+    switch (suffix)
+    {
+    case 'F':
+        return config->auto_conf_tempf;
+    case 'T':
+        return config->auto_conf_tempc;
+    case 'H':
+        return config->auto_conf_hum;
+    case 'B':
+        return config->auto_conf_battery;
+    case 'V':
+        return config->auto_conf_voltage;
+    case 'S':
+        return config->auto_conf_signal;
+    }
+    return 0;
+}
 
-    // Set BLE scan parameters
-
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Advertising scan type (0=passive, 1=active): %u\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, ble_scan_type);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
-    fprintf(stdout, "Advertising scan type (0=passive, 1=active): %u\n", ble_scan_type);
+// availability topic and expiry added to each entity when the sensor has offline_after set, empty otherwise
+// Home Assistant shows the entity as unavailable on "offline", or when no state arrived for expire_after seconds
+void discovery_availability(config_t *config, int sensor, char *buffer, int size)
+{
+    int offline_after = config->sensors[sensor].offline_after;
 
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Advertising scan window : %u %.1f ms\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, ble_scan_window, ble_scan_window * 0.625);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
-    fprintf(stdout, "Advertising scan window   : %4u, %4.1f ms\n", ble_scan_window, ble_scan_window * 0.625);
+    if (offline_after > 0)
+    {
+        snprintf(buffer, size, ",\"avty_t\":\"~/availability\",\"exp_aft\":%d", offline_after);
+    }
+    else
+    {
+        buffer[0] = '\0';
+    }
+}
 
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Advertising scan interval : %u %.1f ms\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, ble_scan_interval, ble_scan_interval * 0.625);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
-    fprintf(stdout, "Advertising scan interval : %4u, %4.1f ms\n", ble_scan_interval, ble_scan_interval * 0.625);
+// build the device based discovery message for one sensor, returns the length snprintf style,
+// a value >= size means the message did not fit
+int discovery_device_payload(config_t *config, int sensor, char *buffer, int size)
+{
+    sensor_t *s = &config->sensors[sensor];
+    char availability[100];
+    int length;
+    int first = 1;
+    size_t n;
 
-    le_set_scan_parameters_cp scan_params_cp;
-    memset(&scan_params_cp, 0, sizeof(scan_params_cp));
-    // BLE PASSIVE OR ACTIVE SCAN ***************************************************************************************
-    scan_params_cp.type = ble_scan_type; // 0x00 for passive scan, 0x01 for active scan (to get scan response packets)
-    scan_params_cp.interval = htobs(ble_scan_interval);
-    scan_params_cp.window = htobs(ble_scan_window);
-    //     scan_params_cp.interval         = htobs(0x0010);
-    //     scan_params_cp.window           = htobs(0x0010);
-    scan_params_cp.own_bdaddr_type = 0x00; // Public Device Address (default).
-    scan_params_cp.filter = 0x00;          // Accept all.
+    discovery_availability(config, sensor, availability, sizeof(availability));
 
-    struct hci_request scan_params_rq = ble_hci_request(OCF_LE_SET_SCAN_PARAMETERS, LE_SET_SCAN_PARAMETERS_CP_SIZE, &status, &scan_params_cp);
+    length = snprintf(buffer, size,
+                      "{\"~\":\"%s%s\",\"stat_t\":\"~/state\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"},\"o\":{\"name\":\"%s\",\"sw\":\"%d.%d\"},\"cmps\":{",
+                      config->mqtt_base_topic, s->my_id,
+                      s->name, s->my_id, s->location, s->mac, s->make, s->model,
+                      PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
 
-    ret = hci_send_req(bluetooth_device, &scan_params_rq, 1000);
-    if (ret < 0)
+    for (n = 0; n < sizeof(discovery_components) / sizeof(discovery_components[0]); n++)
     {
-        hci_close_dev(bluetooth_device);
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Failed to set scan parameters data", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Failed to set scan parameters data, you must run this program as ROOT, return code %d\n", ret);
-        exit(1);
-    }
+        const discovery_component_t *c = &discovery_components[n];
 
-    // Set BLE events report mask.
-
-    le_set_event_mask_cp event_mask_cp;
-    memset(&event_mask_cp, 0, sizeof(le_set_event_mask_cp));
-    int i = 0;
-    for (i = 0; i < 8; i++)
-        event_mask_cp.mask[i] = 0xFF;
+        if (!discovery_component_enabled(config, sensor, c->suffix) || length >= size)
+        {
+            continue;
+        }
+        length += snprintf(buffer + length, size - length,
+                           "%s\"%s-%c\":{\"p\":\"sensor\",\"dev_cla\":\"%s\",\"name\":\"%s-%c\",\"uniq_id\":\"%s-%c\",\"unit_of_meas\":\"%s\",\"val_tpl\":\"{{value_json.%s}}\"%s}",
+                           first ? "" : ",",
+                           s->my_id, c->suffix, c->dev_cla, s->name, c->suffix, s->my_id, c->suffix,
+                           c->unit, c->field, availability);
+        first = 0;
+    }
 
-    struct hci_request set_mask_rq = ble_hci_request(OCF_LE_SET_EVENT_MASK, LE_SET_EVENT_MASK_CP_SIZE, &status, &event_mask_cp);
-    ret = hci_send_req(bluetooth_device, &set_mask_rq, 1000);
-    if (ret < 0)
+    if (length < size)
     {
-        hci_close_dev(bluetooth_device);
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Failed to set event mask", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Failed to set event mask, return code %d\n", ret);
-        exit(1);
+        length += snprintf(buffer + length, size - length, "}}");
     }
+    return length;
+}
 
-    // Enable scanning.
-
-    le_set_scan_enable_cp scan_cp;
-    memset(&scan_cp, 0, sizeof(scan_cp));
-    scan_cp.enable = 0x01;     // Enable flag.
-    scan_cp.filter_dup = 0x00; // Filtering disabled.
-
-    struct hci_request enable_adv_rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
+// subscribe to Home Assistant's status, on the primary connection each time it connects
+int discovery_subscribe(MQTTClient client)
+{
+    char topic[sizeof(discovery_config->discovery_prefix) + 8];
 
-    ret = hci_send_req(bluetooth_device, &enable_adv_rq, 1000);
-    if (ret < 0)
+    if (discovery_config == NULL)
     {
-        hci_close_dev(bluetooth_device);
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Failed to enable scan", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Failed to enable scan, return code %d\n", ret);
-        exit(1);
+        return MQTTCLIENT_SUCCESS;
     }
+    snprintf(topic, sizeof(topic), "%s/status", discovery_config->discovery_prefix);
+    return mqtt_client_subscribe(client, topic);
+}
 
-    // Get Results.
+// called from the MQTT client thread, true if the message was Home Assistant's status. a restarted Home Assistant,
+// or one whose broker lost its retained messages, announces online and gets every message again. a retained
+// status is left alone, it only repeats what was true when the messages were published at startup
+bool discovery_receive(const char *topic, const char *payload, int length, int retained)
+{
+    int prefix_length;
 
-    struct hci_filter nf;
-    hci_filter_clear(&nf);
-    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
-    ret = setsockopt(bluetooth_device, SOL_HCI, HCI_FILTER, &nf, sizeof(nf));
-    if (ret < 0)
+    if (discovery_config == NULL)
     {
-        hci_close_dev(bluetooth_device);
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Could not set socket options", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stderr, "Could not set socket options, return code %d\n", ret);
-        exit(1);
+        return false;
     }
+    prefix_length = strlen(discovery_config->discovery_prefix);
+    if (strncmp(topic, discovery_config->discovery_prefix, prefix_length) != 0 || strcmp(topic + prefix_length, "/status") != 0)
+    {
+        return false;
+    }
+    if (!retained && length == 6 && memcmp(payload, "online", 6) == 0)
+    {
+        log_write(LOG_INFO, LOG_SINK_SYSLOG | LOG_SINK_REMOTE, "Home Assistant online, publishing auto configuration again\n");
+        atomic_store(&discovery_republish, true);
+    }
+    return true;
+}
 
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Scanning....", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
-    //     fprintf(stdout, "%s v%2d.%02d\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-    fprintf(stdout, "Scanning....\n");
-    fflush(stdout);
-
-    // bluetooth advertising packet buffer
-    uint8_t ble_adv_buf[HCI_MAX_EVENT_SIZE];
-    evt_le_meta_event *meta_event;
-    le_advertising_info *adv_info;
-    int bluetooth_adv_packet_length;
-
-    // create the MQTT topic from the base topic string and the MAC address of sensor
+// publish the Home Assistant auto configuration messages for the hourly stats and every sensor
+// with all set unchanged messages are published too
+void auto_configure(MQTTClient client, config_t *config, int sensor_count, bool all)
+{
+    int x;
+    int payload_length;
+    char payload_buffer[MAXIMUM_JSON_MESSAGE];
     int topic_length;
     char topic_buffer[200];
     int topic_buffer_size = 200;
+    // device based auto configuration messages are larger than a state message
+    char discovery_buffer[DISCOVERY_DEVICE_MESSAGE];
+    char availability_buffer[100];
 
-    // MQTT payload buffer
-    int payload_length;
-    char payload_buffer[MAXIMUM_JSON_MESSAGE];
+    if (logging_level > LOG_INFO)
+    {
+        log_write(LOG_INFO, LOG_SINK_STDOUT, "=========\nBegining auto configuration of devices\n");
+    }
 
-    // int payload_buff_size = 300;
+    discovery_begin(config, all);
 
-    // holds current time of current advertising packet that is received
-    time_t rawtime = time(NULL);
-    struct tm tm = *gmtime(&rawtime);
-    struct tm *time_packet_received;
+    if (config->auto_conf_stats)
+    {
 
-    // get the current hour, keep track every time we roll over to a new hour
-    int hour_current;
-    int hour_last;
+        payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                  "{\"~\":\"%s$SYS/hour-stats\",\"name\":\"BLE Temperature Reading Hourly Stats\",\"uniq_id\":\"ble-tmp-hourly-stats\",\"stat_t\":\"~\",\"unit_of_meas\":\"Pkts\",\"val_tpl\":\"{{value_json.total_adv_packets}}\"}",
+                                  config->mqtt_base_topic);
 
-    time_t gmt_time_now;
-    struct tm tnp = *gmtime(&gmt_time_now);
+        if (payload_length >= MAXIMUM_JSON_MESSAGE)
+        // if (payload_length >= payload_buff_size)
+        {
+            log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+            exit(-1);
+        }
 
-    time(&gmt_time_now);
-    tnp = *gmtime(&gmt_time_now);
-    hour_current = tnp.tm_hour;
+        // // create the MQTT topic from the base topic string and the MAC address of sensor
+        // int topic_length;
+        // char topic_buffer[200];
+        // int topic_buffer_size = 200;
 
-    if (hour_current == 0)
-    {
-        hour_last = 23;
-    }
-    else
-    {
-        hour_last = hour_current - 1;
-    }
+        topic_length = snprintf(topic_buffer, topic_buffer_size, "%shourly-stats/config", config->mqtt_base_topic);
 
-    fprintf(stdout, "current hour (GMT) = %d\n", hour_current);
-    fprintf(stdout, "last    hour (GMT) = %d\n", hour_last);
+        // queue the message, skipped if unchanged since last start
+        discovery_publish(client, topic_buffer, payload_buffer, payload_length);
+    }
 
-    if (config.auto_configure)
+    for (x = 0; x < sensor_count; x++)
     {
         if (logging_level > LOG_INFO)
         {
-            fprintf(stdout, "=========\n");
-            fprintf(stdout, "Begining auto configuration of devices\n");
+            log_write(LOG_INFO, LOG_SINK_STDOUT, "  Configuring: %s\n", config->sensors[x].my_id);
         }
 
-        if (config.auto_conf_stats)
+        if (sensor_hot[x].decoder != NULL && config->discovery_type == 1)
         {
+            // single device based message listing every entity of this sensor
+            payload_length = discovery_device_payload(config, x, discovery_buffer, DISCOVERY_DEVICE_MESSAGE);
 
-            payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                      "{\"~\":\"%s$SYS/hour-stats\",\"name\":\"BLE Temperature Reading Hourly Stats\",\"uniq_id\":\"ble-tmp-hourly-stats\",\"stat_t\":\"~\",\"unit_of_meas\":\"Pkts\",\"val_tpl\":\"{{value_json.total_adv_packets}}\"}",
-                                      config.mqtt_base_topic);
-
-            if (payload_length >= MAXIMUM_JSON_MESSAGE)
-            // if (payload_length >= payload_buff_size)
+            if (payload_length >= DISCOVERY_DEVICE_MESSAGE)
             {
-                fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
+                log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
                 exit(-1);
             }
 
-            // // create the MQTT topic from the base topic string and the MAC address of sensor
-            // int topic_length;
-            // char topic_buffer[200];
-            // int topic_buffer_size = 200;
-
-            topic_length = snprintf(topic_buffer, topic_buffer_size, "%shourly-stats/config", config.mqtt_base_topic);
-
-            // publish the message and wait for success
-            pubmsg.payload = payload_buffer;
-            pubmsg.payloadlen = payload_length;
-            pubmsg.qos = QOS;
-            pubmsg.retained = 1;
-            deliveredtoken = 0;
-            MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
+            topic_length = snprintf(topic_buffer, topic_buffer_size, "%s/device/%s/config", config->discovery_prefix, config->sensors[x].my_id);
 
-            // wait for messqge to be delivered to server
-            // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-            while (deliveredtoken != token)
-                ;
+            // queue the message, skipped if unchanged since last start
+            discovery_publish(client, topic_buffer, discovery_buffer, payload_length);
         }
-
-        for (x = 0; x < sensor_count; x++)
+        else if (sensor_hot[x].decoder != NULL)
         {
-            if (logging_level > LOG_INFO)
-            {
-                fprintf(stdout, "  Configuring: %s\n", config.sensors[x].my_id);
-            }
+            discovery_availability(config, x, availability_buffer, sizeof(availability_buffer));
 
-            if (config.sensors[x].type != 99)
+            // configure temp F sensor
+            if (discovery_component_enabled(config, x, 'F'))
             {
-                // configure temp F sensor
-                if (config.auto_conf_tempf)
+                payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                          "{\"~\":\"%s%s\",\"dev_cla\":\"temperature\",\"name\":\"%s-F\",\"uniq_id\":\"%s-F\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"°F\",\"val_tpl\":\"{{value_json.tempf}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}%s  }",
+                                          config->mqtt_base_topic,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].location,
+                                          config->sensors[x].mac,
+                                          config->sensors[x].make,
+                                          config->sensors[x].model,
+                                          availability_buffer);
+
+                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                // if (payload_length >= payload_buff_size)
                 {
-                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                              "{\"~\":\"%s%s\",\"dev_cla\":\"temperature\",\"name\":\"%s-F\",\"uniq_id\":\"%s-F\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"°F\",\"val_tpl\":\"{{value_json.tempf}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}  }",
-                                              config.mqtt_base_topic,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].location,
-                                              config.sensors[x].mac,
-                                              config.sensors[x].make,
-                                              config.sensors[x].model);
-
-                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                    // if (payload_length >= payload_buff_size)
-                    {
-                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                        exit(-1);
-                    }
-
-                    // // create the MQTT topic from the base topic string and the MAC address of sensor
+                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                    exit(-1);
+                }
 
-                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sF/config", config.mqtt_base_topic, config.sensors[x].my_id);
+                // // create the MQTT topic from the base topic string and the MAC address of sensor
 
-                    // publish the message and wait for success
-                    pubmsg.payload = payload_buffer;
-                    pubmsg.payloadlen = payload_length;
-                    pubmsg.qos = QOS;
-                    pubmsg.retained = 1;
-                    deliveredtoken = 0;
-                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sF/config", config->mqtt_base_topic, config->sensors[x].my_id);
 
-                    // wait for messqge to be delivered to server
-                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                    while (deliveredtoken != token)
-                        ;
-                }
+                // queue the message, skipped if unchanged since last start
+                discovery_publish(client, topic_buffer, payload_buffer, payload_length);
+            }
 
-                // configure temp C sensor
-                if (config.auto_conf_tempc)
+            // configure temp C sensor
+            if (discovery_component_enabled(config, x, 'T'))
+            {
+                payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                          "{\"~\":\"%s%s\",\"dev_cla\":\"temperature\",\"name\":\"%s-T\",\"uniq_id\":\"%s-T\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"°C\",\"val_tpl\":\"{{value_json.tempc}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}%s  }",
+                                          config->mqtt_base_topic,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].location,
+                                          config->sensors[x].mac,
+                                          config->sensors[x].make,
+                                          config->sensors[x].model,
+                                          availability_buffer);
+
+                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                // if (payload_length >= payload_buff_size)
                 {
-                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                              "{\"~\":\"%s%s\",\"dev_cla\":\"temperature\",\"name\":\"%s-T\",\"uniq_id\":\"%s-T\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"°C\",\"val_tpl\":\"{{value_json.tempc}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}  }",
-                                              config.mqtt_base_topic,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].location,
-                                              config.sensors[x].mac,
-                                              config.sensors[x].make,
-                                              config.sensors[x].model);
-
-                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                    // if (payload_length >= payload_buff_size)
-                    {
-                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                        exit(-1);
-                    }
-
-                    // // create the MQTT topic from the base topic string and the MAC address of sensor
+                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                    exit(-1);
+                }
 
-                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sT/config", config.mqtt_base_topic, config.sensors[x].my_id);
+                // // create the MQTT topic from the base topic string and the MAC address of sensor
 
-                    // publish the message and wait for success
-                    pubmsg.payload = payload_buffer;
-                    pubmsg.payloadlen = payload_length;
-                    pubmsg.qos = QOS;
-                    pubmsg.retained = 1;
-                    deliveredtoken = 0;
-                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sT/config", config->mqtt_base_topic, config->sensors[x].my_id);
 
-                    // wait for messqge to be delivered to server
-                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                    while (deliveredtoken != token)
-                        ;
-                }
+                // queue the message, skipped if unchanged since last start
+                discovery_publish(client, topic_buffer, payload_buffer, payload_length);
+            }
 
-                // configure hum sensor
-                if (config.auto_conf_hum)
+            // configure hum sensor
+            if (discovery_component_enabled(config, x, 'H'))
+            {
+                payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                          "{\"~\":\"%s%s\",\"dev_cla\":\"humidity\",\"name\":\"%s-H\",\"uniq_id\":\"%s-H\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"%%\",\"val_tpl\":\"{{value_json.humidity}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}%s  }",
+                                          config->mqtt_base_topic,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].location,
+                                          config->sensors[x].mac,
+                                          config->sensors[x].make,
+                                          config->sensors[x].model,
+                                          availability_buffer);
+
+                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                // if (payload_length >= payload_buff_size)
                 {
-                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                              "{\"~\":\"%s%s\",\"dev_cla\":\"humidity\",\"name\":\"%s-H\",\"uniq_id\":\"%s-H\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"%%\",\"val_tpl\":\"{{value_json.humidity}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}  }",
-                                              config.mqtt_base_topic,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].location,
-                                              config.sensors[x].mac,
-                                              config.sensors[x].make,
-                                              config.sensors[x].model);
-
-                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                    // if (payload_length >= payload_buff_size)
-                    {
-                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                        exit(-1);
-                    }
-
-                    // // create the MQTT topic from the base topic string and the MAC address of sensor
+                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                    exit(-1);
+                }
 
-                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sH/config", config.mqtt_base_topic, config.sensors[x].my_id);
+                // // create the MQTT topic from the base topic string and the MAC address of sensor
 
-                    // publish the message and wait for success
-                    pubmsg.payload = payload_buffer;
-                    pubmsg.payloadlen = payload_length;
-                    pubmsg.qos = QOS;
-                    pubmsg.retained = 1;
-                    deliveredtoken = 0;
-                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sH/config", config->mqtt_base_topic, config->sensors[x].my_id);
 
-                    // wait for messqge to be delivered to server
-                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                    while (deliveredtoken != token)
-                        ;
-                }
+                // queue the message, skipped if unchanged since last start
+                discovery_publish(client, topic_buffer, payload_buffer, payload_length);
+            }
 
-                // configure battery sensor
-                if (config.auto_conf_battery)
+            // configure battery sensor
+            if (discovery_component_enabled(config, x, 'B'))
+            {
+                payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                          "{\"~\":\"%s%s\",\"dev_cla\":\"battery\",\"name\":\"%s-B\",\"uniq_id\":\"%s-B\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"%%\",\"val_tpl\":\"{{value_json.batterypct}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}%s  }",
+                                          config->mqtt_base_topic,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].location,
+                                          config->sensors[x].mac,
+                                          config->sensors[x].make,
+                                          config->sensors[x].model,
+                                          availability_buffer);
+
+                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                // if (payload_length >= payload_buff_size)
                 {
-                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                              "{\"~\":\"%s%s\",\"dev_cla\":\"battery\",\"name\":\"%s-B\",\"uniq_id\":\"%s-B\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"%%\",\"val_tpl\":\"{{value_json.batterypct}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}  }",
-                                              config.mqtt_base_topic,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].location,
-                                              config.sensors[x].mac,
-                                              config.sensors[x].make,
-                                              config.sensors[x].model);
-
-                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                    // if (payload_length >= payload_buff_size)
-                    {
-                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                        exit(-1);
-                    }
+                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                    exit(-1);
+                }
 
-                    // // create the MQTT topic from the base topic string and the MAC address of sensor
+                // // create the MQTT topic from the base topic string and the MAC address of sensor
 
-                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sB/config", config.mqtt_base_topic, config.sensors[x].my_id);
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sB/config", config->mqtt_base_topic, config->sensors[x].my_id);
 
-                    // publish the message and wait for success
-                    pubmsg.payload = payload_buffer;
-                    pubmsg.payloadlen = payload_length;
-                    pubmsg.qos = QOS;
-                    pubmsg.retained = 1;
-                    deliveredtoken = 0;
-                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
+                // queue the message, skipped if unchanged since last start
+                discovery_publish(client, topic_buffer, payload_buffer, payload_length);
+            }
 
-                    // wait for messqge to be delivered to server
-                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                    while (deliveredtoken != token)
-                        ;
+            // configure voltage sensor, only for the sensor types that report it
+            if (discovery_component_enabled(config, x, 'V'))
+            {
+                payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                          "{\"~\":\"%s%s\",\"dev_cla\":\"voltage\",\"name\":\"%s-V\",\"uniq_id\":\"%s-V\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"mV\",\"val_tpl\":\"{{value_json.batterymv}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}%s  }",
+                                          config->mqtt_base_topic,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].location,
+                                          config->sensors[x].mac,
+                                          config->sensors[x].make,
+                                          config->sensors[x].model,
+                                          availability_buffer);
+
+                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                // if (payload_length >= payload_buff_size)
+                {
+                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                    exit(-1);
                 }
 
-                // configure voltage sensor only an option for sensor type 1
-                if (config.auto_conf_voltage && config.sensors[x].type == 1)
-                {
-                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                              "{\"~\":\"%s%s\",\"dev_cla\":\"voltage\",\"name\":\"%s-V\",\"uniq_id\":\"%s-V\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"mV\",\"val_tpl\":\"{{value_json.batterymv}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}  }",
-                                              config.mqtt_base_topic,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].location,
-                                              config.sensors[x].mac,
-                                              config.sensors[x].make,
-                                              config.sensors[x].model);
-
-                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                    // if (payload_length >= payload_buff_size)
-                    {
-                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                        exit(-1);
-                    }
+                // // create the MQTT topic from the base topic string and the MAC address of sensor
+                // int topic_length;
+                // char topic_buffer[200];
+                // int topic_buffer_size = 200;
 
-                    // // create the MQTT topic from the base topic string and the MAC address of sensor
-                    // int topic_length;
-                    // char topic_buffer[200];
-                    // int topic_buffer_size = 200;
-
-                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sV/config", config.mqtt_base_topic, config.sensors[x].my_id);
-
-                    // publish the message and wait for success
-                    pubmsg.payload = payload_buffer;
-                    pubmsg.payloadlen = payload_length;
-                    pubmsg.qos = QOS;
-                    pubmsg.retained = 1;
-                    deliveredtoken = 0;
-                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                    // wait for messqge to be delivered to server
-                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                    while (deliveredtoken != token)
-                        ;
-                }
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sV/config", config->mqtt_base_topic, config->sensors[x].my_id);
 
-                // configure signal sensor
-                if (config.auto_conf_signal)
-                {
-                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                              "{\"~\":\"%s%s\",\"dev_cla\":\"signal_strength\",\"name\":\"%s-S\",\"uniq_id\":\"%s-S\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"dBm\",\"val_tpl\":\"{{value_json.rssi}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}  }",
-                                              config.mqtt_base_topic,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].name,
-                                              config.sensors[x].my_id,
-                                              config.sensors[x].location,
-                                              config.sensors[x].mac,
-                                              config.sensors[x].make,
-                                              config.sensors[x].model);
-
-                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                    // if (payload_length >= payload_buff_size)
-                    {
-                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                        exit(-1);
-                    }
+                // queue the message, skipped if unchanged since last start
+                discovery_publish(client, topic_buffer, payload_buffer, payload_length);
+            }
 
-                    // // create the MQTT topic from the base topic string and the MAC address of sensor
-                    // int topic_length;
-                    // char topic_buffer[200];
-                    // int topic_buffer_size = 200;
-
-                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sS/config", config.mqtt_base_topic, config.sensors[x].my_id);
-
-                    // publish the message and wait for success
-                    pubmsg.payload = payload_buffer;
-                    pubmsg.payloadlen = payload_length;
-                    pubmsg.qos = QOS;
-                    pubmsg.retained = 1;
-                    deliveredtoken = 0;
-                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                    // wait for messqge to be delivered to server
-                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                    while (deliveredtoken != token)
-                        ;
+            // configure signal sensor
+            if (discovery_component_enabled(config, x, 'S'))
+            {
+                payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                          "{\"~\":\"%s%s\",\"dev_cla\":\"signal_strength\",\"name\":\"%s-S\",\"uniq_id\":\"%s-S\",\"stat_t\":\"~/state\",\"unit_of_meas\":\"dBm\",\"val_tpl\":\"{{value_json.rssi}}\",\"dev\":{\"name\":\"%s\",\"ids\":\"%s\",\"sa\":\"%s\",\"cns\":[[\"mac\", \"%s\"]],\"mf\":\"%s\",\"mdl\":\"%s\"}%s  }",
+                                          config->mqtt_base_topic,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].name,
+                                          config->sensors[x].my_id,
+                                          config->sensors[x].location,
+                                          config->sensors[x].mac,
+                                          config->sensors[x].make,
+                                          config->sensors[x].model,
+                                          availability_buffer);
+
+                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                // if (payload_length >= payload_buff_size)
+                {
+                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                    exit(-1);
                 }
+
+                // // create the MQTT topic from the base topic string and the MAC address of sensor
+                // int topic_length;
+                // char topic_buffer[200];
+                // int topic_buffer_size = 200;
+
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%sS/config", config->mqtt_base_topic, config->sensors[x].my_id);
+
+                // queue the message, skipped if unchanged since last start
+                discovery_publish(client, topic_buffer, payload_buffer, payload_length);
             }
         }
-        if (logging_level > LOG_INFO)
-        {
-            fprintf(stdout, " Auto configuration complete\n");
-        }
-        fflush(stdout);
     }
+    // wait for the remaining messages in flight and record what the broker now holds
+    discovery_end(client, config);
 
-    // loop until SIGINT received
-    while (keep_running)
+    if (logging_level > LOG_INFO)
     {
+        log_write(LOG_INFO, LOG_SINK_STDOUT, " Auto configuration complete, %d published, %d unchanged\n", discovery_published, discovery_skipped);
+    }
+}
 
-        // check if we have rolled over to a new hour, if so send report of advertising packets receive in last hour
-        time(&gmt_time_now);
-        tnp = *gmtime(&gmt_time_now);
+// startup timing
+// milliseconds from program start to each step, logged once the first reading has been published so the
+// restart to first publish time can be tracked
+enum
+{
+    STARTUP_CONFIG,          // configuration file read
+    STARTUP_SCANNING,        // bluetooth adapter set up and scanning
+    STARTUP_MQTT_CONNECTED,  // connected to MQTT server
+    STARTUP_AUTO_CONFIGURED, // auto configuration messages published
+    STARTUP_FIRST_READING,   // first sensor reading decoded
+    STARTUP_FIRST_PUBLISH,   // first sensor reading published
+    STARTUP_STEPS
+};
+
+struct timespec startup_begin;
+double startup_ms[STARTUP_STEPS];
+
+// record the time a startup step was reached, each step is only written by one thread
+void startup_mark(int step)
+{
+    struct timespec now;
 
-        if (hour_current != tnp.tm_hour)
-        {
-            hour_current = tnp.tm_hour;
-            // check if new day
-            if (hour_current == 0)
-            {
-                hour_last = 23;
-            }
-            else
-            {
-                hour_last = hour_current - 1;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_ms[step] = (now.tv_sec - startup_begin.tv_sec) * 1000.0 + (now.tv_nsec - startup_begin.tv_nsec) / 1000000.0;
+}
 
-            // don't publish right at top of hour, wait a few seconds
-            sleep(10);
+// MQTT startup
+// connecting to the MQTT server and publishing the auto configuration messages runs in its own thread while the
+// main thread sets up the bluetooth adapter and starts scanning, the same thread then publishes what is queued
 
-            fprintf(stdout, "*********** =========\n");
-            fprintf(stdout, "HOUR ROLLOVER\n");
-            fprintf(stdout, "current hour (GMT) = %d\n", hour_current);
-            fprintf(stdout, "last    hour (GMT) = %d\n", hour_last);
+typedef struct
+{
+    config_t *config;
+    int sensor_count;
+} mqtt_startup_t;
+
+// set once the client is connected and auto configuration is done, until then readings wait in the queue
+atomic_bool mqtt_ready = false;
+
+// cross gateway coordination
+// with coordination: 1, gateways that hear the same sensors agree on one of them to publish each sensor. every
+// gateway that hears a sensor publishes a claim (its smoothed RSSI, and whether it is publishing the sensor) to
+// [base topic]$SYS/claim/[unique] at most every claim_interval seconds, and subscribes to everyone's claims. a
+// publishing gateway stops when another publishing gateway has a better claim (RSSI, then name), or any gateway
+// beats it by more than claim_hysteresis dB. a gateway that is not publishing starts when no fresh claim says
+// someone is, or when it beats every publisher by more than claim_hysteresis. claims older than claim_timeout are
+// ignored, so when the publisher stops hearing a sensor (or stops altogether) another gateway takes over
+#define CLAIM_MAX_GATEWAYS 4
+#define CLAIM_NAME_SIZE (MQTTCLIENTIDSIZE)
 
-            time(&gmt_time_now);
-            tnp = *gmtime(&gmt_time_now);
+typedef struct
+{
+    char name[CLAIM_NAME_SIZE];
+    int rssi;
+    bool publishing;
+    time_t seen;
+} claim_gateway_t;
 
-            // create JSON string with timestamp, count and location for each known device
-            payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                      "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",",
-                                      tnp.tm_year + 1900, tnp.tm_mon + 1, tnp.tm_mday, tnp.tm_hour, tnp.tm_min, tnp.tm_sec);
+typedef struct
+{
+    double rssi;         // smoothed RSSI heard here
+    bool heard;          // rssi has a value
+    bool publishing;     // this gateway publishes the sensor
+    bool changed;        // publishing changed since the last claim
+    time_t claimed;      // last claim published
+    int claimed_rssi;    // RSSI in that claim, what the other gateways compare with
+    claim_gateway_t others[CLAIM_MAX_GATEWAYS];
+} claim_t;
+
+claim_t claims[MAX_SENSORS];
+pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+config_t *claim_config = NULL;
+int claim_sensor_count = 0;
+char claim_prefix[200];
+
+void claim_init(config_t *config, int sensor_count)
+{
+    if (!config->coordination)
+    {
+        return;
+    }
+    if (config->claim_interval < 1 || config->claim_timeout <= config->claim_interval)
+    {
+        fprintf(stderr, "claim_timeout must be longer than claim_interval, and claim_interval at least 1 second\n");
+        exit(1);
+    }
+    claim_config = config;
+    claim_sensor_count = sensor_count;
+    memset(claims, 0, sizeof(claims));
+    snprintf(claim_prefix, sizeof(claim_prefix), "%s%s", config->mqtt_base_topic, topic_claim);
+}
 
-            int count_string_length;
-            char count_string_buffer[MAXIMUM_JSON_MESSAGE] = "";
-            int count_string_size = MAXIMUM_JSON_MESSAGE;
+// subscribe to the claims, on the primary connection each time it connects
+int claim_subscribe(MQTTClient client)
+{
+    char topic[256];
 
-            // this builds a string contains the readings for each device concatenated together
-            int total_advertising_packets = 0;
-            int n;
-            for (n = 0; n <= mac_total - 1; n++)
-            {
-                count_string_length = snprintf(count_string_buffer, count_string_size, "\"%s\":{\"count\":%d, \"location\":\"%s\"},", config.sensors[n].mac, config.sensors[n].readings_per_hour, config.sensors[n].location);
-                strcat(payload_buffer, count_string_buffer);
-                // if ( n < mac_total - 1 )
-                //     strcat(payload_buffer, ",");
+    if (claim_config == NULL)
+    {
+        return MQTTCLIENT_SUCCESS;
+    }
+    snprintf(topic, sizeof(topic), "%s#", claim_prefix);
+    return mqtt_client_subscribe(client, topic);
+}
 
-                fprintf(stderr, "Location : %s packets received in last hour : %d %s\n", config.sensors[n].mac, config.sensors[n].readings_per_hour, config.sensors[n].location);
-                total_advertising_packets = total_advertising_packets + config.sensors[n].readings_per_hour;
-                config.sensors[n].readings_per_hour = 0;
-            }
+// a reading was heard here
+void claim_heard(int sensor, int rssi)
+{
+    claim_t *c = &claims[sensor];
 
-            // append the total of all advertising packets for all sensors of this type in last hour
-            count_string_length = snprintf(count_string_buffer, count_string_size, "\"total_adv_packets\":%d}", total_advertising_packets);
-            strcat(payload_buffer, count_string_buffer);
+    if (claim_config == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&claim_lock);
+    c->rssi = c->heard ? c->rssi * 0.75 + rssi * 0.25 : rssi;
+    c->heard = true;
+    pthread_mutex_unlock(&claim_lock);
+}
 
-            // get length of MQTT payload after concatinating all the individual string together
-            payload_length = strlen(payload_buffer);
+// a beats b: higher RSSI, then the lower name
+bool claim_beats(int rssi_a, const char *name_a, int rssi_b, const char *name_b)
+{
+    return rssi_a > rssi_b || (rssi_a == rssi_b && strcmp(name_a, name_b) < 0);
+}
 
-            fprintf(stdout, "payload_buffer JSON : %s\n", payload_buffer);
+// called from the MQTT client thread, true if the message was a claim
+bool claim_receive(const char *topic, const char *payload, int length)
+{
+    char buffer[256];
+    char name[CLAIM_NAME_SIZE];
+    const char *p;
+    claim_t *c;
+    claim_gateway_t *g;
+    claim_gateway_t *slot = NULL;
+    int prefix_length = strlen(claim_prefix);
+    int rssi;
+    int publishing;
+    int sensor;
+    int n;
+    time_t now = time(NULL);
+
+    if (claim_config == NULL || strncmp(topic, claim_prefix, prefix_length) != 0)
+    {
+        return false;
+    }
+    for (sensor = 0; sensor < claim_sensor_count; sensor++)
+    {
+        if (strcmp(topic + prefix_length, claim_config->sensors[sensor].unique) == 0)
+        {
+            break;
+        }
+    }
+    if (sensor == claim_sensor_count || length >= (int)sizeof(buffer))
+    {
+        return true;
+    }
 
-            if (payload_length >= MAXIMUM_JSON_MESSAGE)
-            {
-                fprintf(stderr, "MQTT payload too long: %d\n", payload_length);
-                snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d MQTT payload too long: %d\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR, payload_length);
-                send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-                syslog(LOG_ERR, "%s", log_message);
-                exit(1);
-            }
+    // {"gateway":"...","rssi":-67,"publishing":1}
+    memcpy(buffer, payload, length);
+    buffer[length] = '\0';
+    p = strstr(buffer, "\"gateway\":\"");
+    if (p == NULL || sscanf(p + 11, "%127[^\"]", name) != 1 ||
+        (p = strstr(buffer, "\"rssi\":")) == NULL || sscanf(p + 7, "%d", &rssi) != 1 ||
+        (p = strstr(buffer, "\"publishing\":")) == NULL || sscanf(p + 13, "%d", &publishing) != 1)
+    {
+        log_debug("Ignoring claim on %s : %s\n", topic, buffer);
+        return true;
+    }
+    if (strcmp(name, z_client_id_mqtt) == 0)
+    {
+        return true;
+    }
 
-            // publish it to a statistics topic under the root topic
-            topic_length = snprintf(topic_buffer, topic_buffer_size,
-                                    "%s%s",
-                                    config.mqtt_base_topic, topic_statistics);
+    // the gateway's slot, else a free or stale one, else the weakest
+    pthread_mutex_lock(&claim_lock);
+    c = &claims[sensor];
+    for (n = 0; n < CLAIM_MAX_GATEWAYS; n++)
+    {
+        g = &c->others[n];
+        if (strcmp(g->name, name) == 0)
+        {
+            slot = g;
+            break;
+        }
+        if (slot == NULL || (slot->name[0] != '\0' && (g->name[0] == '\0' || now - g->seen > claim_config->claim_timeout || g->rssi < slot->rssi)))
+        {
+            slot = g;
+        }
+    }
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->rssi = rssi;
+    slot->publishing = publishing != 0;
+    slot->seen = now;
+    pthread_mutex_unlock(&claim_lock);
+    return true;
+}
 
-            // publish the message and wait for success
-            pubmsg.payload = payload_buffer;
-            pubmsg.payloadlen = payload_length;
-            pubmsg.qos = QOS;
-            pubmsg.retained = 0;
-            deliveredtoken = 0;
-            MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
+bool mqtt_primary_publish(int message_class, const char *topic, const char *payload, int payload_length);
 
-            // wait for messqge to be delivered to server
-            // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-            while (deliveredtoken != token)
-                ;
-        }
+// decide whether this gateway publishes the sensor now, queue its claim when due
+bool claim_decide(int sensor, time_t now)
+{
+    claim_t *c = &claims[sensor];
+    claim_gateway_t *g;
+    char topic[256];
+    char payload[256];
+    int length = 0;
+    bool publishing;
+    bool publisher_seen = false;
+    bool beats_publishers = true;
+    int hysteresis = claim_config->claim_hysteresis;
+    int n;
+
+    pthread_mutex_lock(&claim_lock);
+    if (!c->heard)
+    {
+        pthread_mutex_unlock(&claim_lock);
+        return true;
+    }
+    if (c->claimed == 0)
+    {
+        c->claimed_rssi = lround(c->rssi);
+    }
 
-        // get the bluetooth packet
-        bluetooth_adv_packet_length = read(bluetooth_device, ble_adv_buf, sizeof(ble_adv_buf));
-        // apparently there can be multiple advertisement packets with the packet received
-        if (bluetooth_adv_packet_length >= HCI_EVENT_HDR_SIZE)
+    publishing = c->publishing;
+    for (n = 0; n < CLAIM_MAX_GATEWAYS; n++)
+    {
+        g = &c->others[n];
+        if (g->name[0] == '\0' || now - g->seen > claim_config->claim_timeout)
         {
-            meta_event = (evt_le_meta_event *)(ble_adv_buf + HCI_EVENT_HDR_SIZE + 1);
-            if (meta_event->subevent == EVT_LE_ADVERTISING_REPORT)
+            continue;
+        }
+        if (c->publishing)
+        {
+            if ((g->publishing && claim_beats(g->rssi, g->name, c->claimed_rssi, z_client_id_mqtt)) ||
+                g->rssi > c->claimed_rssi + hysteresis)
+            {
+                publishing = false;
+            }
+        }
+        else if (g->publishing)
+        {
+            publisher_seen = true;
+            if (c->claimed_rssi <= g->rssi + hysteresis)
             {
+                beats_publishers = false;
+            }
+        }
+    }
+    if (!c->publishing)
+    {
+        publishing = !publisher_seen || beats_publishers;
+    }
+    if (publishing != c->publishing)
+    {
+        c->publishing = publishing;
+        c->changed = true;
+        log_syslog(LOG_INFO, "%s sensor %s", publishing ? "Publishing" : "Another gateway publishes", claim_config->sensors[sensor].unique);
+    }
 
-                uint8_t reports_count = meta_event->data[0];
-                void *offset = meta_event->data + 1;
-                while (reports_count--)
-                {
-                    // this is the advertising specific data within the packet
-                    adv_info = (le_advertising_info *)offset;
+    // claim now and then, and straight away when taking over or handing over. the claim is built under the lock
+    // and handed to the primary output after it, the MQTT callback thread takes the lock for incoming claims
+    if (atomic_load(&mqtt_ready) && (c->changed || now - c->claimed >= claim_config->claim_interval))
+    {
+        c->claimed = now;
+        c->claimed_rssi = lround(c->rssi);
+        c->changed = false;
+        snprintf(topic, sizeof(topic), "%s%s", claim_prefix, claim_config->sensors[sensor].unique);
+        length = snprintf(payload, sizeof(payload), "{\"gateway\":\"%s\",\"rssi\":%d,\"publishing\":%d}",
+                          z_client_id_mqtt, c->claimed_rssi, c->publishing);
+    }
+    pthread_mutex_unlock(&claim_lock);
 
-                    // get the MAC address of the device that sent the advertising packet
-                    char addr[18];
-                    ba2str(&(adv_info->bdaddr), addr);
+    if (length > 0)
+    {
+        mqtt_primary_publish(MQTT_CLASS_CLAIM, topic, payload, length);
+    }
+    return publishing;
+}
 
-                    // check the MAC address of the BLE device and see if it is in out list of deies to monitor
+// number of sensors this gateway publishes, for the hourly statistics
+int claim_publishing_count(void)
+{
+    int count = 0;
+    int n;
 
-                    int mac_match = 0;
-                    int mac_index;
-                    int i_match;
+    pthread_mutex_lock(&claim_lock);
+    for (n = 0; n < claim_sensor_count; n++)
+    {
+        count += claims[n].heard && claims[n].publishing;
+    }
+    pthread_mutex_unlock(&claim_lock);
+    return count;
+}
 
-                    for (i_match = 0; i_match < mac_total; ++i_match)
-                    {
-                        if (strcmp(addr, config.sensors[i_match].mac) == 0)
-                        {
-                            mac_match = 1;
-                            // keep a pointer to the mac address we matched
-                            mac_index = i_match;
-                        }
-                    }
+// another gateway has a fresh claim that it publishes the sensor, false without coordination
+bool claim_published_elsewhere(int sensor, time_t now)
+{
+    claim_gateway_t *g;
+    bool elsewhere = false;
+    int n;
 
-                    // found the mac address in our list we are interested in, so decipher it's data
-                    // if (1 == 1)
-                    if (mac_match == 1)
-                    {
+    if (claim_config == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&claim_lock);
+    for (n = 0; n < CLAIM_MAX_GATEWAYS; n++)
+    {
+        g = &claims[sensor].others[n];
+        if (g->name[0] != '\0' && g->publishing && now - g->seen <= claim_config->claim_timeout)
+        {
+            elsewhere = true;
+        }
+    }
+    pthread_mutex_unlock(&claim_lock);
+    return elsewhere;
+}
 
-                        // different processing based on the device type, each type has different formats of advertising packets
+// timer wheel
+// deadlines in whole seconds on a hierarchical wheel of 3 levels of 256 slots, 1 s, 256 s and 65536 s apart. an
+// entry goes in the lowest level whose slot covers its deadline, and when the wheel passes the start of a higher
+// level slot its entries are spread over the level below. scheduling, cancelling and expiring are each O(1), and
+// a tick only looks at the one slot that is due, however many entries there are
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+#define WHEEL_SPAN (1U << (WHEEL_BITS * WHEEL_LEVELS)) // deadlines further ahead are cut to this
 
-                        // 1 = Xiaomi LYWSD03MMC-ATC
-                        if (config.sensors[mac_index].type == 1)
-                        {
-                            int advertising_packet_type; // type of advertising packet
-                            //printf("=========\n");
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+typedef struct
+{
+    int next; // entries in the same slot, -1 ends the list
+    int prev;
+    int level; // -1 = not scheduled
+    int slot;
+    uint32_t due; // wheel seconds
+} wheel_entry_t;
+
+wheel_entry_t wheel_entries[MAX_SENSORS];
+int wheel_heads[WHEEL_LEVELS][WHEEL_SLOTS];
+uint32_t wheel_now = 0; // seconds since wheel_start, every slot up to here has been expired
+struct timespec wheel_start;
+
+void wheel_init(void)
+{
+    int n;
 
-                            // printf ( "Current local time and date: %s", asctime (timeinfo) );
+    memset(wheel_heads, -1, sizeof(wheel_heads));
+    for (n = 0; n < MAX_SENSORS; n++)
+    {
+        wheel_entries[n].level = -1;
+    }
+    wheel_now = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wheel_start);
+}
 
-                            // printf("mac address =  %s  location = %s ", addr, config.sensors[mac_index].location);
+// seconds since wheel_init on the monotonic clock, so setting the time doesn't fire or hold back timers
+uint32_t wheel_clock(void)
+{
+    struct timespec now;
 
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
-                            // printf("advertising_packet_type = %03d\n", advertising_packet_type);
-                            // length of packet and subpacket
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - wheel_start.tv_sec;
+}
 
-                            // printf("full packet length      = %3d %02X\n", bluetooth_adv_packet_length, bluetooth_adv_packet_length);
-                            // printf("sub packet length       = %3d %02X\n", adv_info->length, adv_info->length);
+void wheel_unlink(int e)
+{
+    wheel_entry_t *w = &wheel_entries[e];
 
-                            // printf("rssi         = %03d %02X\n", (int8_t)adv_info->data[adv_info->length], adv_info->data[adv_info->length]);
+    if (w->level < 0)
+    {
+        return;
+    }
+    if (w->prev >= 0)
+    {
+        wheel_entries[w->prev].next = w->next;
+    }
+    else
+    {
+        wheel_heads[w->level][w->slot] = w->next;
+    }
+    if (w->next >= 0)
+    {
+        wheel_entries[w->next].prev = w->prev;
+    }
+    w->level = -1;
+}
 
-                            // handle the specific data for each advertising packet type
-                            // The Advertising and Scan Response data is sent in advertising events. The
-                            // Advertising Data is placed in the AdvData field of ADV_IND,
-                            // ADV_NONCONN_IND, and ADV_SCAN_IND packets. The Scan Response
-                            // data is sent in the ScanRspData field of SCAN_RSP packets.
-                            // https://www.libelium.com/forum/libelium_files/bt4_core_spec_adv_data_reference.pdf
+// file the entry in the lowest level where its deadline and now only differ in that level's bits
+void wheel_link(int e)
+{
+    wheel_entry_t *w = &wheel_entries[e];
+    int level = 0;
 
-                            if (advertising_packet_type == 0)
-                            {
+    while (level < WHEEL_LEVELS - 1 && (w->due >> (WHEEL_BITS * (level + 1))) != (wheel_now >> (WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    w->level = level;
+    w->slot = (w->due >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    w->prev = -1;
+    w->next = wheel_heads[level][w->slot];
+    if (w->next >= 0)
+    {
+        wheel_entries[w->next].prev = e;
+    }
+    wheel_heads[level][w->slot] = e;
+}
 
-                                int ad_length; // length of ADV_IND packet type
-                                int ad_type;   // attribute of ADV_IND packet type
+// (re)schedule an entry for the wheel second due, at the earliest the next one
+void wheel_schedule(int e, uint32_t due)
+{
+    wheel_unlink(e);
+    if (due <= wheel_now)
+    {
+        due = wheel_now + 1;
+    }
+    if (due - wheel_now >= WHEEL_SPAN)
+    {
+        due = wheel_now + WHEEL_SPAN - 1;
+    }
+    wheel_entries[e].due = due;
+    wheel_link(e);
+}
 
-                                int8_t rssi_int = adv_info->data[adv_info->length];
+// spread the entries of a higher level slot over the levels below
+void wheel_cascade(int level, int slot)
+{
+    int e = wheel_heads[level][slot];
+    int next;
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "=========\n");
-                                    fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                    fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                    fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                }
+    wheel_heads[level][slot] = -1;
+    while (e >= 0)
+    {
+        next = wheel_entries[e].next;
+        wheel_link(e);
+        e = next;
+    }
+}
 
-                                // length of packet and subpacket
+// move the wheel on to now, calling expired for every entry that came due, which may schedule it again
+void wheel_advance(uint32_t now, void (*expired)(int e, void *context), void *context)
+{
+    int e;
+    int next;
+    int level;
 
-                                //printf("full packet length      = %3d %02X\n", bluetooth_adv_packet_length, bluetooth_adv_packet_length);
-                                //printf("sub packet length       = %3d %02X\n", adv_info->length, adv_info->length);
+    while (wheel_now != now)
+    {
+        wheel_now++;
+        // the start of a level 1 slot, and of a level 2 slot when level 1 wraps around
+        for (level = 1; level < WHEEL_LEVELS && (wheel_now & ((1U << (WHEEL_BITS * level)) - 1)) == 0; level++)
+        {
+        }
+        while (--level > 0)
+        {
+            wheel_cascade(level, (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+        e = wheel_heads[0][wheel_now & WHEEL_MASK];
+        while (e >= 0)
+        {
+            next = wheel_entries[e].next;
+            wheel_unlink(e);
+            expired(e, context);
+            e = next;
+        }
+    }
+}
 
-                                ad_length = (unsigned int)adv_info->data[0];
-                                //printf("ADV_IND AD Data Length  = %3d %02X\n", ad_length, ad_length);
-                                ad_type = (unsigned int)adv_info->data[1];
-                                //printf("ADV_IND AD Type         = %3d %02X\n", ad_type, ad_type);
+// sensor availability
+// a sensor that has not been heard for offline_after seconds (flat battery, moved out of range) is published as
+// "offline" to [base topic][id]/availability, and as "online" again just before its next reading. each reading
+// moves the sensor's deadline on the timer wheel, so the cost per reading and per second stays the same with any
+// number of sensors. sensors never heard since the start go offline after offline_after too. with coordination a
+// gateway leaves the sensor alone while another gateway claims to publish it
+enum
+{
+    AVAILABILITY_UNKNOWN,
+    AVAILABILITY_ONLINE,
+    AVAILABILITY_OFFLINE
+};
 
-                                int16_t temperature_int;
-                                double temperature_celsius;
-                                double temperature_fahrenheit;
-                                int16_t humidity_int;
-                                double humidity;
-                                uint8_t battery_pct_int;
-                                uint16_t battery_mv_int;
-                                uint8_t frame_int;
+int availability_state[MAX_SENSORS];
+char availability_topics[MAX_SENSORS][200];
+config_t *availability_config = NULL;
+int availability_sensor_count = 0;
 
-                                // check for pvvx firmware custom format
-                                if (bluetooth_adv_packet_length == 34)
-                                {
-                                    if (logging_level == LOG_DEBUG)
-                                    {
-                                        fprintf(stdout, "Parsing as PVVX Firmware\n");
-                                    }
+void mqtt_publish_message(int message_class, int sensor, const char *topic, char *payload, int payload_length);
 
-                                    temperature_int = (adv_info->data[10]) | (adv_info->data[11] << 8);
-                                    temperature_celsius = (double)temperature_int / 100.0;
+// after the sensor ids are set, the per sensor setting falls back to the top level one
+void availability_init(config_t *config, int sensor_count)
+{
+    sensor_t *sensor;
+    uint32_t now;
+    int n;
 
-                                    temperature_fahrenheit = temperature_celsius * 9.0 / 5.0 + 32.0;
+    wheel_init();
+    now = wheel_clock();
+    for (n = 0; n < sensor_count; n++)
+    {
+        sensor = &config->sensors[n];
+        if (sensor->offline_after < 0)
+        {
+            sensor->offline_after = config->offline_after;
+        }
+        availability_state[n] = AVAILABILITY_UNKNOWN;
+        snprintf(availability_topics[n], sizeof(availability_topics[n]), "%s%s/availability", config->mqtt_base_topic, sensor->my_id);
+        if (sensor->offline_after > 0 && sensor_hot[n].decoder != NULL)
+        {
+            availability_config = config;
+            wheel_schedule(n, now + sensor->offline_after);
+        }
+    }
+    availability_sensor_count = sensor_count;
+}
 
-                                    humidity_int = (adv_info->data[12]) | (adv_info->data[13] << 8);
-                                    humidity = (double)humidity_int / 100.0;
+void availability_publish(int sensor, int state)
+{
+    char payload[8];
+    int length;
 
-                                    battery_pct_int = adv_info->data[16];
+    availability_state[sensor] = state;
+    length = snprintf(payload, sizeof(payload), "%s", state == AVAILABILITY_ONLINE ? "online" : "offline");
+    mqtt_publish_message(MQTT_CLASS_ALERT, sensor, availability_topics[sensor], payload, length);
+}
 
-                                    battery_mv_int = (adv_info->data[14]) | (adv_info->data[15] << 8);
+// a reading of the sensor is about to be published
+void availability_seen(int sensor)
+{
+    int offline_after;
 
-                                    frame_int = adv_info->data[17];
-                                }
-                                else
-                                {
-                                    if (logging_level == LOG_DEBUG)
-                                    {
-                                        fprintf(stdout, "Parsing as ATC Firmware\n");
-                                    }
+    if (availability_config == NULL || (offline_after = availability_config->sensors[sensor].offline_after) <= 0)
+    {
+        return;
+    }
+    wheel_schedule(sensor, wheel_clock() + offline_after);
+    if (availability_state[sensor] != AVAILABILITY_ONLINE)
+    {
+        availability_publish(sensor, AVAILABILITY_ONLINE);
+    }
+}
 
-                                    temperature_int = (adv_info->data[10] << 8) | adv_info->data[11];
-                                    temperature_celsius = (double)temperature_int / 10.0;
+void availability_expired(int sensor, void *context)
+{
+    (void)context;
 
-                                    temperature_fahrenheit = temperature_celsius * 9.0 / 5.0 + 32.0;
+    if (claim_published_elsewhere(sensor, time(NULL)))
+    {
+        // announced again if this gateway takes the sensor over
+        availability_state[sensor] = AVAILABILITY_UNKNOWN;
+        return;
+    }
+    if (availability_state[sensor] != AVAILABILITY_OFFLINE)
+    {
+        log_syslog(LOG_NOTICE, "Sensor %s %s not heard for %d seconds, offline", availability_config->sensors[sensor].mac,
+                   availability_config->sensors[sensor].location, availability_config->sensors[sensor].offline_after);
+        availability_publish(sensor, AVAILABILITY_OFFLINE);
+    }
+}
 
-                                    humidity_int = adv_info->data[12];
-                                    humidity = (double)humidity_int;
+// from the main loop, publishes the sensors that have gone quiet
+void availability_check(void)
+{
+    uint32_t now;
 
-                                    battery_pct_int = adv_info->data[13];
+    if (availability_config == NULL)
+    {
+        return;
+    }
+    now = wheel_clock();
+    if (now != wheel_now)
+    {
+        wheel_advance(now, availability_expired, NULL);
+    }
+}
 
-                                    battery_mv_int = (adv_info->data[14] << 8) | adv_info->data[15];
+// number of sensors offline now, for the hourly statistics
+int availability_offline_count(void)
+{
+    int count = 0;
+    int n;
 
-                                    frame_int = adv_info->data[16];
-                                }
+    for (n = 0; n < availability_sensor_count; n++)
+    {
+        count += availability_state[n] == AVAILABILITY_OFFLINE;
+    }
+    return count;
+}
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "temp c       =  %.1f\n", temperature_celsius);
-                                    fprintf(stdout, "temp f       =  %.1f\n", temperature_fahrenheit);
-                                    fprintf(stdout, "humidity pct =  %.1f\n", humidity);
-                                    fprintf(stdout, "battery pct  = %3d\n", battery_pct_int);
-                                    fprintf(stdout, "battery mv   =  %4d\n", battery_mv_int);
-                                    fprintf(stdout, "frame        =   %3d\n", frame_int);
-                                }
-                                // count the number of advertising packets we get from each unit
+// readings queued and dropped before the MQTT server was ready, for the startup timing
+// counted by the scan loop, read by the thread of mqtt_server_url
+atomic_int pending_held = 0;
+atomic_int pending_dropped = 0;
 
-                                config.sensors[mac_index].readings_per_hour = config.sensors[mac_index].readings_per_hour + 1;
+void startup_report(void);
 
-                                if (config.publish_type == 1)
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d,\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F,\"humidity\":%#.1F,\"batterypct\":%i,\"batterymv\":%i,\"frame\":%i,\"name\":\"%s\",\"location\":\"%s\",\"type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_pct_int, battery_mv_int, frame_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
-                                else
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d,\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F,\"humidity\":%.0F,\"battery-pct\":%i,\"battery-mv\":%i,\"frame\":%i,\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_pct_int, battery_mv_int, frame_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
+// MQTT 5 properties of a state message: topic alias, expiry, and the sensor name and location
+// alias_maximum and alias_sent are the aliases of the connection the message goes out on
+// returns the topic to send, empty once the server knows the alias. the caller marks the alias sent once the
+// message has been handed to the client, see mqtt_alias_sent
+const char *mqtt_state_properties(MQTTProperties *properties, int sensor, const char *topic, int alias_maximum, bool *alias_sent)
+{
+    MQTTProperty property;
+    sensor_t *s = &mqtt_config->sensors[sensor];
 
-                                if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                                // if (payload_length >= payload_buff_size)
-                                {
-                                    fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                                    exit(-1);
-                                }
+    if (mqtt_state_expiry > 0)
+    {
+        property.identifier = MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL;
+        property.value.integer4 = mqtt_state_expiry;
+        MQTTProperties_add(properties, &property);
+    }
 
-                                // publish the message and wait for success
-                                pubmsg.payload = payload_buffer;
-                                pubmsg.payloadlen = payload_length;
-                                pubmsg.qos = QOS;
-                                pubmsg.retained = 0;
-                                deliveredtoken = 0;
-                                MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                                // wait for messqge to be delivered to server
-                                // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                                while (deliveredtoken != token)
-                                    ;
-                            }
+    property.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+    property.value.data.data = "name";
+    property.value.data.len = 4;
+    property.value.value.data = (char *)s->name;
+    property.value.value.len = strlen(s->name);
+    MQTTProperties_add(properties, &property);
+    property.value.data.data = "location";
+    property.value.data.len = 8;
+    property.value.value.data = (char *)s->location;
+    property.value.value.len = strlen(s->location);
+    MQTTProperties_add(properties, &property);
+
+    // one alias per sensor, alias 0 is not allowed
+    if (sensor < alias_maximum)
+    {
+        property.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+        property.value.integer2 = sensor + 1;
+        MQTTProperties_add(properties, &property);
+        if (alias_sent[sensor])
+        {
+            return "";
+        }
+    }
+    return topic;
+}
 
-                            if (advertising_packet_type == 4)
-                            {
-                            }
-                            fflush(stdout);
-                        }
-                        // end device type 1
+// after a state message went out with its full topic the server knows the alias, the next ones can leave it out
+void mqtt_alias_sent(int sensor, int alias_maximum, bool *alias_sent)
+{
+    if (sensor >= 0 && sensor < alias_maximum)
+    {
+        alias_sent[sensor] = true;
+    }
+}
 
-                        // 2 = Govee H5052
-                        if (config.sensors[mac_index].type == 2)
-                        {
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+// MQTT outputs
+// mqtt_server_url and each server in mqtt_outputs get their own client, connection thread and bounded queue. the
+// scan loop only copies the message into the queue of each output (one producer, one consumer) and posts its
+// semaphore, it never waits for a server. a server that is slow or down fills its own queue, further messages for
+// it are dropped and counted, the others carry on. a lost connection is retried every few seconds, up to a minute
+// apart. a message the server keeps refusing is tried MQTT_OUTPUT_SEND_TRIES times and then dropped, so it does not
+// hold up the ones behind it. up to MQTT_OUTPUT_INFLIGHT messages are sent before the oldest is acknowledged, a
+// message stays in the queue until it is, and whatever was in flight when the connection was lost is sent again
+// after the reconnect. the thread of mqtt_server_url is the MQTT startup thread, it also subscribes to the claims
+// and publishes the auto configuration, which only go to that server
+#define MQTT_OUTPUT_RETRY_MAX 60
+#define MQTT_OUTPUT_SEND_TRIES 3
+#define MQTT_OUTPUT_INFLIGHT 16
 
-                            int advertising_packet_type; // type of advertising packet
-
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
-
-                            if (advertising_packet_type == 0)
-                            {
-                            }
+typedef struct
+{
+    char topic[200];
+    char payload[MAXIMUM_JSON_MESSAGE];
+    int payload_length;
+    int message_class;
+    int sensor;
+} output_message_t;
 
-                            // sensor data is broadcast in type 4 advertising message by the H5052
-                            if (advertising_packet_type == 4)
-                            {
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
+typedef struct
+{
+    mqtt_output_config_t *config;
+    char client_id[MQTTCLIENTIDSIZE + 8];
+    MQTTClient client;
+    pthread_t thread;
+    output_message_t *queue;
+    atomic_ulong head; // written by the scan loop
+    atomic_ulong tail; // written by the output thread
+    sem_t available;
+    atomic_bool connected;
+    atomic_uint sent;
+    atomic_uint dropped;
+    int alias_maximum;
+    bool alias_sent[MAX_SENSORS];
+} mqtt_output_t;
+
+mqtt_output_config_t mqtt_primary_config;
+mqtt_output_t mqtt_primary; // mqtt_server_url
+mqtt_output_t mqtt_outputs[MAX_MQTT_OUTPUTS];
+int mqtt_output_count = 0;
+char *mqtt_output_base_topic;
+
+// connect, or reconnect after the connection was lost, topic aliases start over with each connection
+int mqtt_output_connect(mqtt_output_t *output)
+{
+    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTClient_connectOptions conn_opts5 = MQTTClient_connectOptions_initializer5;
+    MQTTResponse response;
+    int rc;
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "=========\n");
-                                    fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                    fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                    fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                }
+    if (mqtt_version == MQTTVERSION_5)
+    {
+        conn_opts5.keepAliveInterval = 20;
+        conn_opts5.cleanstart = 1;
+        conn_opts5.username = output->config->username[0] ? output->config->username : NULL;
+        conn_opts5.password = output->config->password[0] ? output->config->password : NULL;
+        response = MQTTClient_connect5(output->client, &conn_opts5, NULL, NULL);
+        rc = response.reasonCode;
+        output->alias_maximum = 0;
+        if (rc == MQTTCLIENT_SUCCESS && response.properties != NULL &&
+            MQTTProperties_hasProperty(response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM))
+        {
+            output->alias_maximum = MQTTProperties_getNumericValue(response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+        }
+        MQTTResponse_free(response);
+    }
+    else
+    {
+        conn_opts.keepAliveInterval = 20;
+        conn_opts.cleansession = 1;
+        conn_opts.username = output->config->username[0] ? output->config->username : NULL;
+        conn_opts.password = output->config->password[0] ? output->config->password : NULL;
+        rc = MQTTClient_connect(output->client, &conn_opts);
+    }
+    memset(output->alias_sent, 0, sizeof(output->alias_sent));
 
-                                //                                 fprintf(stdout, "=========\n");
-                                //                                 fprintf(stdout, "Current local time and date: %s", asctime (time_packet_received) );
-                                //                                 fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].location);
-                                //
-                                //                                 fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
+    // the claim and Home Assistant status subscriptions went with the old session
+    if (rc == MQTTCLIENT_SUCCESS && output == &mqtt_primary &&
+        ((rc = claim_subscribe(output->client)) != MQTTCLIENT_SUCCESS || (rc = discovery_subscribe(output->client)) != MQTTCLIENT_SUCCESS))
+    {
+        MQTTClient_disconnect(output->client, 0);
+    }
+    return rc;
+}
 
-                                sensor_data_start = 5;
+// publish one queued message with the output's QoS and retain flag, or those of its class, without waiting for the
+// server. token is what to wait for, 0 for QoS 0 where nothing comes back
+int mqtt_output_send(mqtt_output_t *output, output_message_t *m, MQTTClient_deliveryToken *token)
+{
+    MQTTClient_message pubmsg = MQTTClient_message_initializer;
+    MQTTProperties properties = MQTTProperties_initializer;
+    char topic[256];
+    const char *send_topic = m->topic;
+    int length = strlen(mqtt_output_base_topic);
+    int rc;
 
-                                // get the lsb msb byte pairs for temperature and humidity and convert them to an integer value (in 100's)
-                                // temperature is a signed 16 bit integer to allow for temperatures below and above 0 degrees celsius
-                                signed short int temperature_int = adv_info->data[sensor_data_start + 0] | adv_info->data[sensor_data_start + 1] << 8;
-                                int humidity_int = adv_info->data[sensor_data_start + 2] | adv_info->data[sensor_data_start + 3] << 8;
+    if (output->config->topic_prefix[0] != '\0' && strncmp(m->topic, mqtt_output_base_topic, length) == 0)
+    {
+        snprintf(topic, sizeof(topic), "%s%s", output->config->topic_prefix, m->topic + length);
+        send_topic = topic;
+    }
 
-                                // convert the integer * 100 value for temperature and humidity to degrees fahrenheit and celsius (for homekit) and humidity percentage
+    pubmsg.payload = m->payload;
+    pubmsg.payloadlen = m->payload_length;
+    pubmsg.qos = output->config->qos >= 0 ? output->config->qos : mqtt_policies[m->message_class].qos;
+    pubmsg.retained = output->config->retain >= 0 ? output->config->retain : mqtt_policies[m->message_class].retain;
+    if (mqtt_version == MQTTVERSION_5 && m->message_class == MQTT_CLASS_STATE && m->sensor >= 0)
+    {
+        send_topic = mqtt_state_properties(&properties, m->sensor, send_topic, output->alias_maximum, output->alias_sent);
+        pubmsg.properties = properties;
+    }
+    rc = mqtt_client_publish(output->client, send_topic, &pubmsg, token);
+    MQTTProperties_free(&properties);
+    if (rc == MQTTCLIENT_SUCCESS && mqtt_version == MQTTVERSION_5 && m->message_class == MQTT_CLASS_STATE)
+    {
+        mqtt_alias_sent(m->sensor, output->alias_maximum, output->alias_sent);
+    }
+    if (pubmsg.qos == 0)
+    {
+        *token = 0;
+    }
+    return rc;
+}
 
-                                double temperature_fahrenheit;
-                                double temperature_celsius;
-                                temperature_fahrenheit = (temperature_int / 100.0) * 9.0 / 5.0 + 32.0;
-                                temperature_celsius = (temperature_int / 100.0);
+// connect, false after waiting the growing retry time if the server could not be reached
+bool mqtt_output_reconnect(mqtt_output_t *output, int *retry)
+{
+    int rc;
+    int n;
 
-                                double humidity = humidity_int / 100.0;
+    rc = mqtt_output_connect(output);
+    if (rc != MQTTCLIENT_SUCCESS)
+    {
+        *retry = *retry == 0 ? 5 : (*retry * 2 > MQTT_OUTPUT_RETRY_MAX ? MQTT_OUTPUT_RETRY_MAX : *retry * 2);
+        log_write(LOG_ERR, LOG_SINK_ALL, "Could not connect to MQTT server %s, return code %d, retrying in %d seconds\n", output->config->url, rc, *retry);
+        for (n = 0; n < *retry && keep_running; n++)
+        {
+            sleep(1);
+        }
+        return false;
+    }
+    *retry = 0;
+    atomic_store(&output->connected, true);
+    log_write(LOG_INFO, LOG_SINK_SYSLOG | LOG_SINK_REMOTE, "Connected to MQTT server %s\n", output->config->url);
+    return true;
+}
 
-                                // get battery level percentage
-                                int battery_precentage_int = (signed char)adv_info->data[sensor_data_start + 4];
+void *mqtt_output_thread(void *arg)
+{
+    static bool first_publish = true;
+    mqtt_output_t *output = arg;
+    output_message_t *m;
+    unsigned long tail = atomic_load(&output->tail);
+    MQTTClient_deliveryToken tokens[MQTT_OUTPUT_INFLIGHT]; // of the messages in flight, by queue position
+    int inflight = 0;                                      // messages from the tail on sent and not acknowledged
+    int retry = 0;
+    int tries = 0;
+    struct timespec wait;
+    int rc;
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "temp c       =  %.1f\n", temperature_celsius);
-                                    fprintf(stdout, "temp f       =  %.1f\n", temperature_fahrenheit);
-                                    fprintf(stdout, "humidity pct =  %.1f\n", humidity);
-                                    fprintf(stdout, "battery pct  = %3d\n", battery_precentage_int);
-                                }
+    for (;;)
+    {
+        // at shutdown what is still queued is sent while the server takes it
+        if (!keep_running && (!atomic_load(&output->connected) || tail == atomic_load_explicit(&output->head, memory_order_acquire)))
+        {
+            break;
+        }
 
-                                // count the number of advertising packets we get from each unit
+        if (!atomic_load(&output->connected))
+        {
+            // what was in flight went with the connection, it is sent again from the tail
+            inflight = 0;
+            mqtt_output_reconnect(output, &retry);
+            continue;
+        }
 
-                                config.sensors[mac_index].readings_per_hour = config.sensors[mac_index].readings_per_hour + 1;
+        if (output == &mqtt_primary && keep_running && atomic_exchange(&discovery_republish, false))
+        {
+            auto_configure(output->client, discovery_config, discovery_sensor_count, true);
+            continue;
+        }
 
-                                if (config.publish_type == 1)
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d,\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F,\"humidity\":%#.1F,\"batterypct\":%i,\"name\":\"%s\",\"location\":\"%s\",\"type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
-                                else
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d,\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F,\"humidity\":%#.1F,\"battery-pct\":%i,\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
+        // send the next message while the window has room
+        if (inflight < MQTT_OUTPUT_INFLIGHT && tail + inflight != atomic_load_explicit(&output->head, memory_order_acquire))
+        {
+            m = &output->queue[(tail + inflight) % output->config->queue];
+            rc = mqtt_output_send(output, m, &tokens[(tail + inflight) % MQTT_OUTPUT_INFLIGHT]);
+            if (rc == MQTTCLIENT_SUCCESS)
+            {
+                // the semaphore only wakes the thread, keep its count near the messages not sent yet
+                sem_trywait(&output->available);
+                inflight++;
+                continue;
+            }
+            log_write(LOG_ERR, LOG_SINK_ALL, "Publish to MQTT server %s failed, topic %s, return code %d\n", output->config->url, m->topic, rc);
+            if (!MQTTClient_isConnected(output->client))
+            {
+                atomic_store(&output->connected, false);
+                continue;
+            }
+            // the messages before it are finished first, then it is tried again from the tail
+            if (inflight == 0)
+            {
+                if (++tries < MQTT_OUTPUT_SEND_TRIES && keep_running)
+                {
+                    sleep(1);
+                    continue;
+                }
+                log_write(LOG_ERR, LOG_SINK_ALL, "Dropped message for MQTT server %s after %d tries, topic %s\n", output->config->url, tries, m->topic);
+                atomic_fetch_add_explicit(&output->dropped, 1, memory_order_relaxed);
+                tries = 0;
+                tail++;
+                atomic_store_explicit(&output->tail, tail, memory_order_release);
+                continue;
+            }
+        }
+        else if (inflight == 0)
+        {
+            // the client only talks to the server from inside its calls, keep the connection alive while idle
+            clock_gettime(CLOCK_REALTIME, &wait);
+            wait.tv_sec += 1;
+            if (sem_timedwait(&output->available, &wait) != 0)
+            {
+                MQTTClient_yield();
+                if (!MQTTClient_isConnected(output->client))
+                {
+                    atomic_store(&output->connected, false);
+                }
+            }
+            continue;
+        }
 
-                                if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                                // if (payload_length >= payload_buff_size)
-                                {
-                                    fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                                    exit(-1);
-                                }
+        // wait for the oldest message in flight, it leaves the queue once the server has it
+        m = &output->queue[tail % output->config->queue];
+        rc = MQTTCLIENT_SUCCESS;
+        if (tokens[tail % MQTT_OUTPUT_INFLIGHT] != 0)
+        {
+            rc = MQTTClient_waitForCompletion(output->client, tokens[tail % MQTT_OUTPUT_INFLIGHT], TIMEOUT);
+        }
+        if (rc != MQTTCLIENT_SUCCESS)
+        {
+            log_write(LOG_ERR, LOG_SINK_ALL, "Publish to MQTT server %s not confirmed, topic %s, return code %d\n", output->config->url, m->topic, rc);
+            // it and the messages after it are sent again
+            inflight = 0;
+            if (!MQTTClient_isConnected(output->client))
+            {
+                atomic_store(&output->connected, false);
+                continue;
+            }
+            if (++tries < MQTT_OUTPUT_SEND_TRIES && keep_running)
+            {
+                sleep(1);
+                continue;
+            }
+            log_write(LOG_ERR, LOG_SINK_ALL, "Dropped message for MQTT server %s after %d tries, topic %s\n", output->config->url, tries, m->topic);
+            atomic_fetch_add_explicit(&output->dropped, 1, memory_order_relaxed);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&output->sent, 1, memory_order_relaxed);
+            if (output == &mqtt_primary && first_publish && m->message_class == MQTT_CLASS_STATE)
+            {
+                first_publish = false;
+                startup_mark(STARTUP_FIRST_PUBLISH);
+                startup_report();
+            }
+            inflight--;
+        }
+        tries = 0;
+        tail++;
+        atomic_store_explicit(&output->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
 
-                                // publish the message and wait for success
-                                pubmsg.payload = payload_buffer;
-                                pubmsg.payloadlen = payload_length;
-                                pubmsg.qos = QOS;
-                                pubmsg.retained = 0;
-                                deliveredtoken = 0;
-                                MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                                // wait for messqge to be delivered to server
-                                // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                                while (deliveredtoken != token)
-                                    ;
-                            }
+// set up the queue and client of an output
+void mqtt_output_init(mqtt_output_t *output, mqtt_output_config_t *config, const char *client_id)
+{
+    MQTTClient_createOptions create_opts = MQTTClient_createOptions_initializer;
 
-                            fflush(stdout);
-                        }
-                        //end device type 2
+    output->config = config;
+    if (config->qos > 2)
+    {
+        fprintf(stderr, "Invalid MQTT QoS %d for %s, must be 0, 1 or 2\n", config->qos, config->url);
+        exit(1);
+    }
+    output->queue = malloc(config->queue * sizeof(output_message_t));
+    if (output->queue == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate the queue for MQTT server %s\n", config->url);
+        exit(1);
+    }
+    atomic_init(&output->head, 0);
+    atomic_init(&output->tail, 0);
+    atomic_init(&output->connected, false);
+    atomic_init(&output->sent, 0);
+    atomic_init(&output->dropped, 0);
+    sem_init(&output->available, 0, 0);
+
+    snprintf(output->client_id, sizeof(output->client_id), "%s", client_id);
+    if (mqtt_version == MQTTVERSION_5)
+    {
+        create_opts.MQTTVersion = MQTTVERSION_5;
+        MQTTClient_createWithOptions(&output->client, config->url, output->client_id, MQTTCLIENT_PERSISTENCE_NONE, NULL, &create_opts);
+    }
+    else
+    {
+        MQTTClient_create(&output->client, config->url, output->client_id, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+    }
+}
 
-                        // device type 3 = Govee H5072
-                        if (config.sensors[mac_index].type == 3)
-                        {
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+// create the clients and start a thread for each of mqtt_outputs, after z_client_id_mqtt is set. the client of
+// mqtt_server_url is only created here, mqtt_startup runs its thread
+void mqtt_outputs_start(config_t *config)
+{
+    mqtt_output_t *output;
+    char client_id[MQTTCLIENTIDSIZE + 8];
+    int n;
+
+    mqtt_output_base_topic = config->mqtt_base_topic;
+
+    snprintf(mqtt_primary_config.url, sizeof(mqtt_primary_config.url), "%s", config->mqtt_server_url);
+    snprintf(mqtt_primary_config.username, sizeof(mqtt_primary_config.username), "%s", config->mqtt_username);
+    snprintf(mqtt_primary_config.password, sizeof(mqtt_primary_config.password), "%s", config->mqtt_password);
+    mqtt_primary_config.topic_prefix[0] = '\0';
+    mqtt_primary_config.qos = -1;
+    mqtt_primary_config.retain = -1;
+    mqtt_primary_config.queue = config->mqtt_queue;
+    if (mqtt_primary_config.queue < 1)
+    {
+        fprintf(stderr, "mqtt_queue must be at least 1\n");
+        exit(1);
+    }
+    mqtt_output_init(&mqtt_primary, &mqtt_primary_config, z_client_id_mqtt);
+    // the claims of the other gateways come in on this connection
+    MQTTClient_setCallbacks(mqtt_primary.client, NULL, connlost, msgarrvd, NULL);
 
-                            int advertising_packet_type; // type of advertising packet
+    for (n = 0; n < config->mqtt_output_count; n++)
+    {
+        output = &mqtt_outputs[n];
+        if (config->mqtt_outputs[n].url[0] == '\0' || config->mqtt_outputs[n].queue < 1)
+        {
+            fprintf(stderr, "mqtt_outputs entry %d needs a url and a queue of at least 1\n", n + 1);
+            exit(1);
+        }
+        // a client id of its own, the outputs may be on the same server as mqtt_server_url
+        snprintf(client_id, sizeof(client_id), "%s-%d", z_client_id_mqtt, n + 1);
+        mqtt_output_init(output, &config->mqtt_outputs[n], client_id);
 
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
+        if (pthread_create(&output->thread, NULL, mqtt_output_thread, output) != 0)
+        {
+            log_write(LOG_ERR, LOG_SINK_ALL, "Could not start the thread for MQTT server %s: %s\n", output->config->url, strerror(errno));
+            exit(1);
+        }
+        mqtt_output_count++;
+        log_write(LOG_INFO, LOG_SINK_STDOUT, "MQTT output %d : %s, client %s\n", n + 1, output->config->url, output->client_id);
+    }
+}
 
-                            // sensor data is broadcast in type 0 advertising message by the H5072
-                            if (advertising_packet_type == 0)
-                            {
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
+// connect to mqtt_server_url, publish the auto configuration, then publish what is queued like the other outputs
+void *mqtt_startup(void *arg)
+{
+    mqtt_startup_t *startup = arg;
+    int retry = 0;
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "=========\n");
-                                    fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                    fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                    fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                }
+    if (startup->config->auto_configure)
+    {
+        discovery_config = startup->config;
+        discovery_sensor_count = startup->sensor_count;
+    }
 
-                                //                                 fprintf(stdout, "=========\n");
-                                //                                 fprintf(stdout, "Current local time and date: %s", asctime (time_packet_received) );
-                                //                                 fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                //
-                                //                                 fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
+    // readings wait in the queue until the server can be reached
+    while (!mqtt_output_reconnect(&mqtt_primary, &retry))
+    {
+        if (!keep_running)
+        {
+            return NULL;
+        }
+    }
+    startup_mark(STARTUP_MQTT_CONNECTED);
 
-                                sensor_data_start = 26;
+    if (startup->config->auto_configure)
+    {
+        auto_configure(mqtt_primary.client, startup->config, startup->sensor_count, false);
+    }
+    startup_mark(STARTUP_AUTO_CONFIGURED);
 
-                                int below_32;
-                                int msb;
+    atomic_store(&mqtt_ready, true);
+    return mqtt_output_thread(&mqtt_primary);
+}
 
-                                if ((adv_info->data[sensor_data_start + 0] & (1 << 7)) != 0)
-                                {
-                                    below_32 = 1;
-                                    msb = adv_info->data[sensor_data_start + 0];
-                                    msb &= ~(1UL << 7);
-                                }
-                                else
-                                {
-                                    below_32 = 0;
-                                    msb = adv_info->data[sensor_data_start + 0];
-                                }
+// queue a copy of the message for one output, false if it was dropped because the queue is full
+bool mqtt_output_queue(mqtt_output_t *output, int message_class, int sensor, const char *topic, const char *payload, int payload_length)
+{
+    output_message_t *m;
+    unsigned long head;
 
-                                unsigned int sensor_data = adv_info->data[sensor_data_start + 2] | adv_info->data[sensor_data_start + 1] << 8 | msb << 16;
+    head = atomic_load_explicit(&output->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&output->tail, memory_order_acquire) >= (unsigned long)output->config->queue)
+    {
+        atomic_fetch_add_explicit(&output->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    m = &output->queue[head % output->config->queue];
+    snprintf(m->topic, sizeof(m->topic), "%s", topic);
+    memcpy(m->payload, payload, payload_length);
+    m->payload_length = payload_length;
+    m->message_class = message_class;
+    m->sensor = sensor;
+    atomic_store_explicit(&output->head, head + 1, memory_order_release);
+    sem_post(&output->available);
+    return true;
+}
 
-                                signed int temperature_int = sensor_data / 10000;
+// queue a message for mqtt_server_url only
+bool mqtt_primary_publish(int message_class, const char *topic, const char *payload, int payload_length)
+{
+    return mqtt_output_queue(&mqtt_primary, message_class, -1, topic, payload, payload_length);
+}
 
-                                // this crap code works for values below 0 degrees C but seems to bottomout about 12.2 degrees F, display shows values lower
-                                // but not very accurate. Manual says range is 14 degrees F to 140 degrees F
-                                // Humidity seems accurate thru range however
-                                if (below_32 == 1)
-                                {
-                                    temperature_int = temperature_int * -1;
-                                }
+// queue a copy of the message for each of mqtt_outputs
+void mqtt_outputs_publish(int message_class, int sensor, const char *topic, char *payload, int payload_length)
+{
+    int n;
 
-                                unsigned int humidity_int = (sensor_data % 1000) / 10;
+    for (n = 0; n < mqtt_output_count; n++)
+    {
+        mqtt_output_queue(&mqtt_outputs[n], message_class, sensor, topic, payload, payload_length);
+    }
+}
 
-                                int32_t answer;
-                                answer = (((int32_t)((int8_t)adv_info->data[sensor_data_start + 0])) << 16) + (((int32_t)adv_info->data[sensor_data_start + 1]) << 8) + adv_info->data[sensor_data_start + 2];
+// per output counts for the hourly statistics, and start counting again
+// returns the number of messages dropped by mqtt_server_url and all outputs
+int mqtt_outputs_report(void)
+{
+    mqtt_output_t *output;
+    unsigned int sent;
+    unsigned int dropped;
+    int total = 0;
+    int n;
 
-                                // convert the integer * 100 value for temperature and humidity to degrees fahrenheit and celsius (for homekit) and humidity percentage
+    for (n = -1; n < mqtt_output_count; n++)
+    {
+        output = n < 0 ? &mqtt_primary : &mqtt_outputs[n];
+        sent = atomic_exchange(&output->sent, 0);
+        dropped = atomic_exchange(&output->dropped, 0);
+        log_write(LOG_INFO, LOG_SINK_ALL, "MQTT output %s : %s, %u sent, %u dropped in last hour, %lu queued\n", output->config->url,
+                  atomic_load(&output->connected) ? "connected" : "not connected", sent, dropped,
+                  atomic_load(&output->head) - atomic_load(&output->tail));
+        total += dropped;
+    }
+    return total;
+}
 
-                                double temperature_fahrenheit;
-                                double temperature_celsius;
-                                temperature_fahrenheit = temperature_int * 9.0 / 5.0 + 32.0;
-                                temperature_celsius = temperature_int;
+void startup_report(void)
+{
+    log_write(LOG_INFO, LOG_SINK_ALL,
+              "Startup ms: config %.1f, scanning %.1f, mqtt connected %.1f, auto configured %.1f, first reading %.1f, first publish %.1f, readings held %d, dropped %d\n",
+              startup_ms[STARTUP_CONFIG], startup_ms[STARTUP_SCANNING], startup_ms[STARTUP_MQTT_CONNECTED], startup_ms[STARTUP_AUTO_CONFIGURED],
+              startup_ms[STARTUP_FIRST_READING], startup_ms[STARTUP_FIRST_PUBLISH], atomic_load(&pending_held), atomic_load(&pending_dropped));
+}
 
-                                double humidity = humidity_int;
+// publish a message to mqtt_server_url and the other outputs, the scan loop only queues it
+void mqtt_publish_message(int message_class, int sensor, const char *topic, char *payload, int payload_length)
+{
+    bool ready = atomic_load(&mqtt_ready);
 
-                                // get battery level percentage
-                                int battery_precentage_int = (signed char)adv_info->data[sensor_data_start + 3];
+    // with coordination only the gateway elected for the sensor publishes its readings
+    if (claim_config != NULL && message_class == MQTT_CLASS_STATE && sensor >= 0 && !claim_decide(sensor, time(NULL)))
+    {
+        return;
+    }
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "temp c       =  %.1f\n", temperature_celsius);
-                                    fprintf(stdout, "temp f       =  %.1f\n", temperature_fahrenheit);
-                                    fprintf(stdout, "humidity pct =  %.1f\n", humidity);
-                                    fprintf(stdout, "battery pct  = %3d\n", battery_precentage_int);
-                                }
+    // "online" goes out first when the sensor was offline or not announced yet
+    if (message_class == MQTT_CLASS_STATE && sensor >= 0)
+    {
+        availability_seen(sensor);
+    }
 
-                                // count the number of advertising packets we get from each unit
+    // readings decoded before the MQTT server is ready wait in its queue
+    if (mqtt_output_queue(&mqtt_primary, message_class, sensor, topic, payload, payload_length))
+    {
+        if (!ready)
+        {
+            atomic_fetch_add_explicit(&pending_held, 1, memory_order_relaxed);
+        }
+    }
+    else if (!ready)
+    {
+        atomic_fetch_add_explicit(&pending_dropped, 1, memory_order_relaxed);
+    }
+    mqtt_outputs_publish(message_class, sensor, topic, payload, payload_length);
+}
 
-                                config.sensors[mac_index].readings_per_hour = config.sensors[mac_index].readings_per_hour + 1;
+// HCI input
+// events are read from the HCI socket in batches with recvmmsg, the first event blocks and the rest of the batch is
+// whatever the kernel already has queued, so a busy radio costs one system call per batch instead of one per event.
+// the controller's event count is compared with the events read each hour, the difference is what the socket
+// dropped when its receive buffer was full. a read that fails for any other reason than the timeout means the
+// adapter is gone, the error is kept for the scan watchdog
+#define HCI_BATCH_MAX 64
+
+struct mmsghdr hci_msgs[HCI_BATCH_MAX];
+struct iovec hci_iov[HCI_BATCH_MAX];
+uint8_t hci_bufs[HCI_BATCH_MAX][HCI_MAX_EVENT_SIZE];
+int hci_batch_size;
+int hci_batch_count = 0; // events in the current batch
+int hci_batch_next = 0;  // next one to hand out
+int hci_dev_id;
+uint32_t hci_events_total = 0; // never reset, for the scan watchdog
+int hci_input_error = 0;       // errno of the read that failed, 0 while the socket is fine
+
+// since the last report
+uint32_t hci_reads = 0;
+uint32_t hci_events = 0;
+uint32_t hci_dev_evt_rx;
+uint32_t hci_dev_err_rx;
+
+void hci_input_init(int device, int dev_id, config_t *config)
+{
+    struct hci_dev_info di;
+    int size;
+    socklen_t len = sizeof(size);
+    struct timeval timeout = {1, 0};
+    int i;
 
-                                if (config.publish_type == 1)
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d,\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F,\"humidity\":%#.1F,\"batterypct\":%i,\"name\":\"%s\",\"location\":\"%s\",\"type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
-                                else
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d,\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F,\"humidity\":%#.1F,\"battery-pct\":%i,\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
+    hci_batch_size = config->hci_batch;
+    if (hci_batch_size < 1)
+    {
+        hci_batch_size = 1;
+    }
+    if (hci_batch_size > HCI_BATCH_MAX)
+    {
+        hci_batch_size = HCI_BATCH_MAX;
+    }
+    for (i = 0; i < hci_batch_size; i++)
+    {
+        hci_iov[i].iov_base = hci_bufs[i];
+        hci_iov[i].iov_len = HCI_MAX_EVENT_SIZE;
+        memset(&hci_msgs[i], 0, sizeof(hci_msgs[i]));
+        hci_msgs[i].msg_hdr.msg_iov = &hci_iov[i];
+        hci_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-                                if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                                // if (payload_length >= payload_buff_size)
-                                {
-                                    fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                                    exit(-1);
-                                }
+    // room for bursts while the main loop is publishing, SO_RCVBUFFORCE goes past rmem_max when running as root
+    if (config->hci_receive_buffer > 0)
+    {
+        size = config->hci_receive_buffer;
+        if (setsockopt(device, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+            setsockopt(device, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        {
+            log_write(LOG_WARNING, LOG_SINK_ALL, "Could not set the HCI socket receive buffer to %d bytes: %s\n", size, strerror(errno));
+        }
+    }
+    // wake up at least once a second when nothing is heard, so the timers of the main loop still run
+    if (setsockopt(device, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+    {
+        log_write(LOG_WARNING, LOG_SINK_ALL, "Could not set the HCI socket receive timeout: %s\n", strerror(errno));
+    }
+    if (getsockopt(device, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+    {
+        log_write(LOG_INFO, LOG_SINK_STDOUT, "HCI receive buffer %d bytes, batches of up to %d events\n", size, hci_batch_size);
+    }
 
-                                // publish the message and wait for success
-                                pubmsg.payload = payload_buffer;
-                                pubmsg.payloadlen = payload_length;
-                                pubmsg.qos = QOS;
-                                pubmsg.retained = 0;
-                                deliveredtoken = 0;
-                                MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                                // wait for messqge to be delivered to server
-                                // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                                while (deliveredtoken != token)
-                                    ;
-                            }
+    // called again when the scan watchdog opens the adapter again
+    hci_batch_count = 0;
+    hci_batch_next = 0;
+    hci_input_error = 0;
 
-                            if (advertising_packet_type == 4)
-                            {
-                            }
-                            fflush(stdout);
-                        }
-                        // end device type 3
+    hci_dev_id = dev_id;
+    memset(&di, 0, sizeof(di));
+    hci_devinfo(hci_dev_id, &di);
+    hci_dev_evt_rx = di.stat.evt_rx;
+    hci_dev_err_rx = di.stat.err_rx;
+}
 
-                        // device type 4 = Govee H5102
-                        if (config.sensors[mac_index].type == 4)
-                        {
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+// the next HCI event, reading a new batch when the last one is used up
+// returns the length and points event at it, or -1 if the read failed or was interrupted
+int hci_input_next(int device, uint8_t **event)
+{
+    int count;
 
-                            int advertising_packet_type; // type of advertising packet
+    if (hci_batch_next >= hci_batch_count)
+    {
+        hci_batch_next = 0;
+        hci_batch_count = 0;
+        count = recvmmsg(device, hci_msgs, hci_batch_size, MSG_WAITFORONE, NULL);
+        if (count < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                hci_input_error = errno;
+            }
+            return -1;
+        }
+        // the socket of an adapter that was unplugged fails once with EPIPE, then reads empty messages, an HCI
+        // event is never empty
+        if (hci_msgs[0].msg_len == 0)
+        {
+            hci_input_error = EPIPE;
+            return -1;
+        }
+        hci_batch_count = count;
+        hci_reads++;
+        hci_events += count;
+        hci_events_total += count;
+    }
+    *event = hci_bufs[hci_batch_next];
+    return hci_msgs[hci_batch_next++].msg_len;
+}
 
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
+// add the read counters to the hourly statistics, and start counting again
+int hci_input_report(char *buffer, int size)
+{
+    struct hci_dev_info di;
+    uint32_t controller_events = 0;
+    uint32_t errors = 0;
+    uint32_t missed = 0;
+    int length;
+
+    memset(&di, 0, sizeof(di));
+    if (hci_devinfo(hci_dev_id, &di) == 0)
+    {
+        controller_events = di.stat.evt_rx - hci_dev_evt_rx;
+        errors = di.stat.err_rx - hci_dev_err_rx;
+        hci_dev_evt_rx = di.stat.evt_rx;
+        hci_dev_err_rx = di.stat.err_rx;
+    }
+    // the controller count includes the odd command response, so this is an upper bound
+    if (controller_events > hci_events)
+    {
+        missed = controller_events - hci_events;
+    }
 
-                            // sensor data is broadcast in type 0 advertising message by the H5072
-                            if (advertising_packet_type == 0)
-                            {
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
+    log_write(LOG_INFO, LOG_SINK_STDOUT, "HCI events read : %u in %u reads, %u missed, %u receive errors\n", hci_events, hci_reads, missed, errors);
+    length = snprintf(buffer, size, ", \"hci_events\":%u, \"hci_reads\":%u, \"hci_missed\":%u, \"hci_errors\":%u", hci_events, hci_reads, missed, errors);
+    hci_reads = 0;
+    hci_events = 0;
+    return length;
+}
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "=========\n");
-                                    fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                    fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                    fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                }
+// scan watchdog
+// some controllers stop sending advertising reports without any error, the reads just time out from then on. the
+// events read from the adapter are counted over periods of scan_watchdog seconds, and the rate of normal periods is
+// learned. a period with nothing at all where at least SCAN_STALL_EXPECTED events were expected, or with fewer than
+// scan_watchdog_percent of the events expected, is a stall. the first recovery is to turn scanning off and on again,
+// if the adapter stays quiet it is taken down and up and opened again, with the periods doubling while it stays
+// quiet. an adapter that was unplugged is looked for by its address every SCAN_REOPEN_SECONDS until it is back.
+// the MQTT session and everything in memory are kept throughout
+#define SCAN_STALL_EXPECTED 10
+#define SCAN_BASELINE_PERIODS 16
+#define SCAN_RECOVER_MAX 3600
+#define SCAN_REOPEN_SECONDS 5
+// milliseconds to wait for the adapter to answer a command, shorter while recovering as a stalled controller often
+// does not answer at all and the scan loop waits meanwhile
+#define SCAN_HCI_TIMEOUT 1000
+#define SCAN_RECOVER_TIMEOUT 200
+#define SCAN_LOG_SINKS (LOG_SINK_STDOUT | LOG_SINK_SYSLOG | LOG_SINK_REMOTE)
+
+config_t *scan_config;
+int scan_watchdog_period;
+int scan_watchdog_percent;
+le_set_scan_parameters_cp scan_parameters;
+bdaddr_t scan_bdaddr;
+int scan_dev_id;
+bool scan_lost = false;      // the adapter is gone or could not be set up again, it is looked for every few seconds
+int scan_failures = 0;       // stalls in a row
+time_t scan_period_start;
+uint32_t scan_period_events; // hci_events_total at the start of the period
+double scan_baseline = 0;    // events per second of normal periods, 0 until the first one
+time_t scan_next_try;
+time_t scan_last_check = 0;
+
+// since startup
+uint32_t scan_stalls = 0;
+uint32_t scan_restarts = 0;
+uint32_t scan_resets = 0;
+uint32_t scan_reopens = 0;
+
+// set the scan parameters, the event mask and the filter and turn scanning on, waiting up to timeout milliseconds
+// for each command. returns NULL, or what failed
+const char *scan_start(int device, const le_set_scan_parameters_cp *parameters, int timeout)
+{
+    le_set_scan_parameters_cp scan_params_cp = *parameters;
+    le_set_event_mask_cp event_mask_cp;
+    le_set_scan_enable_cp scan_cp;
+    struct hci_request rq;
+    struct hci_filter nf;
+    uint8_t status;
 
-                                //                                 fprintf(stdout, "=========\n");
-                                //                                 fprintf(stdout, "Current local time and date: %s", asctime (time_packet_received) );
-                                //                                 fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                //
-                                //                                 fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
+    rq = ble_hci_request(OCF_LE_SET_SCAN_PARAMETERS, LE_SET_SCAN_PARAMETERS_CP_SIZE, &status, &scan_params_cp);
+    if (hci_send_req(device, &rq, timeout) < 0)
+    {
+        return "Failed to set scan parameters data";
+    }
 
-                                sensor_data_start = 27;
+    memset(&event_mask_cp, 0xff, sizeof(event_mask_cp));
+    rq = ble_hci_request(OCF_LE_SET_EVENT_MASK, LE_SET_EVENT_MASK_CP_SIZE, &status, &event_mask_cp);
+    if (hci_send_req(device, &rq, timeout) < 0)
+    {
+        return "Failed to set event mask";
+    }
 
-                                int below_32;
-                                int msb;
+    memset(&scan_cp, 0, sizeof(scan_cp));
+    scan_cp.enable = 0x01;     // Enable flag.
+    scan_cp.filter_dup = 0x00; // Filtering disabled.
+    rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
+    if (hci_send_req(device, &rq, timeout) < 0)
+    {
+        return "Failed to enable scan";
+    }
 
-                                if ((adv_info->data[sensor_data_start + 0] & (1 << 7)) != 0)
-                                {
-                                    below_32 = 1;
-                                    msb = adv_info->data[sensor_data_start + 0];
-                                    msb &= ~(1UL << 7);
-                                }
-                                else
-                                {
-                                    below_32 = 0;
-                                    msb = adv_info->data[sensor_data_start + 0];
-                                }
-
-                                unsigned int sensor_data = adv_info->data[sensor_data_start + 2] | adv_info->data[sensor_data_start + 1] << 8 | msb << 16;
-
-                                signed int temperature_int = sensor_data / 10000;
+    hci_filter_clear(&nf);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+    if (setsockopt(device, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
+    {
+        return "Could not set socket options";
+    }
+    return NULL;
+}
 
-                                // this crap code works for values below 0 degrees C but seems to bottomout about 12.2 degrees F, display shows values lower
-                                // but not very accurate. Manual says range is 14 degrees F to 140 degrees F
-                                // Humidity seems accurate thru range however
-                                if (below_32 == 1)
-                                {
-                                    temperature_int = temperature_int * -1;
-                                }
+// turn scanning off, false if the adapter did not answer within timeout milliseconds
+bool scan_stop(int device, int timeout)
+{
+    le_set_scan_enable_cp scan_cp;
+    struct hci_request rq;
+    uint8_t status;
 
-                                unsigned int humidity_int = (sensor_data % 1000) / 10;
+    memset(&scan_cp, 0, sizeof(scan_cp));
+    scan_cp.enable = 0x00; // Disable flag.
+    rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
+    return hci_send_req(device, &rq, timeout) >= 0;
+}
 
-                                int32_t answer;
-                                answer = (((int32_t)((int8_t)adv_info->data[sensor_data_start + 0])) << 16) + (((int32_t)adv_info->data[sensor_data_start + 1]) << 8) + adv_info->data[sensor_data_start + 2];
+// the device id of the adapter with the address being scanned, it can change when the adapter is plugged in again
+// returns -1 if it is not there
+int scan_find_adapter(void)
+{
+    struct hci_dev_info di;
+    int dev_id;
 
-                                // convert the integer * 100 value for temperature and humidity to degrees fahrenheit and celsius (for homekit) and humidity percentage
+    for (dev_id = 0; dev_id < HCI_MAX_DEV; dev_id++)
+    {
+        memset(&di, 0, sizeof(di));
+        if (hci_devinfo(dev_id, &di) == 0 && bacmp(&di.bdaddr, &scan_bdaddr) == 0)
+        {
+            return dev_id;
+        }
+    }
+    return -1;
+}
 
-                                double temperature_fahrenheit;
-                                double temperature_celsius;
-                                temperature_fahrenheit = temperature_int * 9.0 / 5.0 + 32.0;
-                                temperature_celsius = temperature_int;
+// bring the adapter up, taking it down first when reset, open it and start scanning
+// returns the HCI socket, or -1
+int scan_reopen(int dev_id, bool reset, config_t *config)
+{
+    const char *failed;
+    int ctl;
+    int device;
 
-                                double humidity = humidity_int;
-                                // get battery level percentage
-                                int battery_precentage_int = (signed char)adv_info->data[sensor_data_start + 3];
+    ctl = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (ctl < 0)
+    {
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: could not open HCI control socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (reset && ioctl(ctl, HCIDEVDOWN, dev_id) < 0)
+    {
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: could not take hci%d down: %s\n", dev_id, strerror(errno));
+    }
+    if (ioctl(ctl, HCIDEVUP, dev_id) < 0 && errno != EALREADY)
+    {
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: could not bring hci%d up: %s\n", dev_id, strerror(errno));
+        close(ctl);
+        return -1;
+    }
+    close(ctl);
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "temp c       =  %.1f\n", temperature_celsius);
-                                    fprintf(stdout, "temp f       =  %.1f\n", temperature_fahrenheit);
-                                    fprintf(stdout, "humidity pct =  %.1f\n", humidity);
-                                    fprintf(stdout, "battery pct  = %3d\n", battery_precentage_int);
-                                }
+    device = hci_open_dev(dev_id);
+    if (device < 0)
+    {
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: could not open hci%d: %s\n", dev_id, strerror(errno));
+        return -1;
+    }
+    if ((failed = scan_start(device, &scan_parameters, SCAN_RECOVER_TIMEOUT)) != NULL)
+    {
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: hci%d: %s\n", dev_id, failed);
+        hci_close_dev(device);
+        return -1;
+    }
+    hci_input_init(device, dev_id, config);
+    return device;
+}
 
-                                // count the number of advertising packets we get from each unit
+void scan_period_next(time_t now)
+{
+    scan_period_start = now;
+    scan_period_events = hci_events_total;
+}
 
-                                config.sensors[mac_index].readings_per_hour = config.sensors[mac_index].readings_per_hour + 1;
+void scan_watchdog_init(config_t *config, int dev_id, const bdaddr_t *bdaddr, const le_set_scan_parameters_cp *parameters, time_t now)
+{
+    scan_config = config;
+    scan_watchdog_period = config->scan_watchdog;
+    scan_watchdog_percent = config->scan_watchdog_percent;
+    scan_parameters = *parameters;
+    bacpy(&scan_bdaddr, bdaddr);
+    scan_dev_id = dev_id;
+    scan_period_next(now);
+}
 
-                                if (config.publish_type == 1)
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d,\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F,\"humidity\":%#.1F,\"batterypct\":%i,\"name\":\"%s\",\"location\":\"%s\",\"type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
-                                else
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d,\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F,\"humidity\":%#.1F,\"battery-pct\":%i,\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
+// the length of the current period, doubling while the adapter keeps stalling
+int scan_period_length(void)
+{
+    int length = scan_watchdog_period;
+    int shift = scan_failures > 1 ? scan_failures - 1 : 0;
 
-                                if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                                // if (payload_length >= payload_buff_size)
-                                {
-                                    fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                                    exit(-1);
-                                }
+    if (shift > 6)
+    {
+        shift = 6;
+    }
+    length <<= shift;
+    return length > SCAN_RECOVER_MAX && scan_failures > 0 ? SCAN_RECOVER_MAX : length;
+}
 
-                                // publish the message and wait for success
-                                pubmsg.payload = payload_buffer;
-                                pubmsg.payloadlen = payload_length;
-                                pubmsg.qos = QOS;
-                                pubmsg.retained = 0;
-                                deliveredtoken = 0;
-                                MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                                // wait for messqge to be delivered to server
-                                // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                                while (deliveredtoken != token)
-                                    ;
-                            }
+// check the adapter, at most once a second, and recover it when it has stalled or gone
+// device is the HCI socket, replaced when the adapter is opened again and -1 while it is lost
+void scan_watchdog_check(int *device, time_t now)
+{
+    const char *failed;
+    uint32_t events;
+    double expected;
+    int length;
+    int dev_id;
 
-                            if (advertising_packet_type == 4)
-                            {
-                            }
-                            fflush(stdout);
-                        }
-                        // end device type 4
+    if (now == scan_last_check)
+    {
+        return;
+    }
+    scan_last_check = now;
 
-                        // device type 5 = Govee H5075
-                        if (config.sensors[mac_index].type == 5)
-                        {
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+    // the read failed, the adapter was unplugged or taken down under us
+    if (*device >= 0 && hci_input_error != 0)
+    {
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: hci%d read failed: %s, looking for the adapter again\n", scan_dev_id, strerror(hci_input_error));
+        hci_close_dev(*device);
+        *device = -1;
+        scan_lost = true;
+        scan_next_try = now;
+    }
 
-                            int advertising_packet_type; // type of advertising packet
+    if (scan_lost)
+    {
+        if (now < scan_next_try)
+        {
+            return;
+        }
+        scan_next_try = now + SCAN_REOPEN_SECONDS;
+        if ((dev_id = scan_find_adapter()) < 0 || (*device = scan_reopen(dev_id, false, scan_config)) < 0)
+        {
+            return;
+        }
+        scan_dev_id = dev_id;
+        scan_reopens++;
+        scan_lost = false;
+        scan_failures = 0;
+        scan_period_next(now);
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: scanning again on hci%d\n", scan_dev_id);
+        return;
+    }
 
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
+    length = scan_period_length();
+    if (scan_watchdog_period <= 0 || now - scan_period_start < length)
+    {
+        return;
+    }
 
-                            // sensor data is broadcast in type 0 advertising message by the H5072
-                            if (advertising_packet_type == 0)
-                            {
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
+    events = hci_events_total - scan_period_events;
+    expected = scan_baseline * (now - scan_period_start);
+    if (!((events == 0 && expected >= SCAN_STALL_EXPECTED) ||
+          (scan_watchdog_percent > 0 && expected >= SCAN_STALL_EXPECTED && events * 100.0 < expected * scan_watchdog_percent)))
+    {
+        // a normal period, stalls are counted again from here
+        if (scan_failures > 0)
+        {
+            log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: hci%d recovered, %u events in %ld seconds\n", scan_dev_id, events, (long)(now - scan_period_start));
+        }
+        if (scan_baseline == 0)
+        {
+            scan_baseline = (double)events / (now - scan_period_start);
+        }
+        else
+        {
+            scan_baseline += ((double)events / (now - scan_period_start) - scan_baseline) / SCAN_BASELINE_PERIODS;
+        }
+        scan_failures = 0;
+        scan_period_next(now);
+        return;
+    }
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "=========\n");
-                                    fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                    fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                    fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                }
+    scan_stalls++;
+    scan_failures++;
+    log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: hci%d stalled, %u events in %ld seconds, %.0f expected\n", scan_dev_id, events, (long)(now - scan_period_start), expected);
 
-                                //                                 fprintf(stdout, "=========\n");
-                                //                                 fprintf(stdout, "Current local time and date: %s", asctime (time_packet_received) );
-                                //                                 fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                //
-                                //                                 fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
+    // turn scanning off and on first, that is enough when the controller only dropped its scan
+    if (scan_failures == 1)
+    {
+        scan_stop(*device, SCAN_RECOVER_TIMEOUT);
+        if ((failed = scan_start(*device, &scan_parameters, SCAN_RECOVER_TIMEOUT)) == NULL)
+        {
+            scan_restarts++;
+            scan_period_next(now);
+            log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: scanning restarted on hci%d\n", scan_dev_id);
+            return;
+        }
+        log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: hci%d: %s\n", scan_dev_id, failed);
+        scan_failures++;
+    }
 
-                                sensor_data_start = 26;
+    // then take the adapter down and up again
+    hci_close_dev(*device);
+    *device = scan_reopen(scan_dev_id, true, scan_config);
+    if (*device < 0)
+    {
+        scan_lost = true;
+        scan_next_try = now + SCAN_REOPEN_SECONDS;
+        return;
+    }
+    scan_resets++;
+    scan_period_next(now);
+    log_write(LOG_WARNING, SCAN_LOG_SINKS, "scan watchdog: hci%d reset\n", scan_dev_id);
+}
 
-                                int below_32;
-                                int msb;
+// add the recoveries since startup to the hourly statistics, when the watchdog is on or has had something to do
+int scan_watchdog_report(char *buffer, int size)
+{
+    if (scan_watchdog_period <= 0 && scan_stalls == 0 && scan_reopens == 0)
+    {
+        buffer[0] = 0;
+        return 0;
+    }
+    return snprintf(buffer, size, ", \"scan_stalls\":%u, \"scan_restarts\":%u, \"adapter_resets\":%u, \"adapter_reopens\":%u",
+                    scan_stalls, scan_restarts, scan_resets, scan_reopens);
+}
 
-                                if ((adv_info->data[sensor_data_start + 0] & (1 << 7)) != 0)
-                                {
-                                    below_32 = 1;
-                                    msb = adv_info->data[sensor_data_start + 0];
-                                    msb &= ~(1UL << 7);
-                                }
-                                else
-                                {
-                                    below_32 = 0;
-                                    msb = adv_info->data[sensor_data_start + 0];
-                                }
+// advertising report parser
+// each report in an LE advertising report event is checked against the end of the event once, then its AD
+// structures (length, type, data) are walked once and the manufacturer data (by company id) and service data (by
+// 16 bit uuid) are kept as views into the HCI buffer, without copying. decoders read only through these views, so
+// a short or malformed packet can't make them read past the end of the buffer. ad_report_t and the functions that
+// look up the views are in ble_decoder.h, decoder plugins use them too
 
-                                unsigned int sensor_data = adv_info->data[sensor_data_start + 2] | adv_info->data[sensor_data_start + 1] << 8 | msb << 16;
+// parse the report at info, end is one past the last byte of the HCI event
+// returns a pointer to the next report, or NULL if this one does not fit in the event
+const uint8_t *ad_parse(const le_advertising_info *info, const uint8_t *end, ad_report_t *report)
+{
+    const uint8_t *p;
+    const uint8_t *data_end;
+    int length;
+    int type;
 
-                                double temperature_double = sensor_data / 1000 / 10.0;
+    // header, data and the rssi byte after the data
+    if ((const uint8_t *)info + LE_ADVERTISING_INFO_SIZE > end || info->data + info->length + 1 > end)
+    {
+        return NULL;
+    }
+    report->event_type = info->evt_type;
+    report->rssi = (int8_t)info->data[info->length];
+    report->malformed = false;
+    report->manufacturer_count = 0;
+    report->service_count = 0;
+
+    p = info->data;
+    data_end = info->data + info->length;
+    while (p < data_end && p[0] != 0)
+    {
+        length = p[0];
+        if (p + 1 + length > data_end)
+        {
+            report->malformed = true;
+            break;
+        }
+        type = p[1];
 
-                                // this crap code works for values below 0 degrees C but seems to bottomout about 12.2 degrees F, display shows values lower
-                                // but not very accurate. Manual says range is 14 degrees F to 140 degrees F
-                                // Humidity seems accurate thru range however
-                                if (below_32 == 1)
-                                {
-                                    temperature_double =  temperature_double * -1;
-                                }
+        // manufacturer data and 16 bit uuid service data start with the 2 byte id, little endian
+        if (type == 0xff && length >= 3 && report->manufacturer_count < AD_MAX_VIEWS)
+        {
+            report->manufacturer[report->manufacturer_count].id = p[2] | p[3] << 8;
+            report->manufacturer[report->manufacturer_count].data = p + 4;
+            report->manufacturer[report->manufacturer_count].length = length - 3;
+            report->manufacturer_count++;
+        }
+        else if (type == 0x16 && length >= 3 && report->service_count < AD_MAX_VIEWS)
+        {
+            report->service[report->service_count].id = p[2] | p[3] << 8;
+            report->service[report->service_count].data = p + 4;
+            report->service[report->service_count].length = length - 3;
+            report->service_count++;
+        }
+        p += 1 + length;
+    }
+    return info->data + info->length + 1;
+}
 
-                                double humidity_int = (sensor_data % 1000) / 10.0;
+// decoders
+// each sensor type has a decoder (ble_decoder.h), the built in ones below and those loaded from the shared objects
+// in decoder_directory. each sensor's decoder is found from its type once at startup and kept in sensor_hot, the
+// scan loop calls it through that pointer without looking anything up
+#define MAX_DECODERS 32
 
-                                int32_t answer;
-                                answer = (((int32_t)((int8_t)adv_info->data[sensor_data_start + 0])) << 16) + (((int32_t)adv_info->data[sensor_data_start + 1]) << 8) + adv_info->data[sensor_data_start + 2];
+const ble_decoder_t *decoders[MAX_DECODERS];
+int decoder_count = 0;
 
-                                // convert the values for temperature and humidity to degrees fahrenheit and celsius (for homekit) and humidity percentage
+// 1 = Xiaomi LYWSD03MMC with ATC or pvvx firmware, environmental sensing service data in ADV_IND, the mac address
+// then the readings, 13 bytes for the ATC format, 15 for the pvvx custom format
+bool atc_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
 
-                                double temperature_fahrenheit;
-                                double temperature_celsius;
-                                temperature_fahrenheit = temperature_double * 9.0 / 5.0 + 32.0;
-                                temperature_celsius = temperature_double;
+    (void)decoder;
+    return report->event_type == 0 && ad_service_data(report, 0x181A, &length) != NULL && length >= 13;
+}
 
-                                double humidity = humidity_int;
-                                // get battery level percentage
-                                int battery_precentage_int = (signed char)adv_info->data[sensor_data_start + 3];
+bool atc_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    int length;
+    const uint8_t *data = ad_service_data(report, 0x181A, &length);
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "temp c       =  %.1f\n", temperature_celsius);
-                                    fprintf(stdout, "temp f       =  %.1f\n", temperature_fahrenheit);
-                                    fprintf(stdout, "humidity pct =  %.1f\n", humidity);
-                                    fprintf(stdout, "battery pct  = %3d\n", battery_precentage_int);
-                                }
+    (void)decoder;
+    reading->fields = READING_TEMPERATURE | READING_HUMIDITY | READING_BATTERY_PCT | READING_BATTERY_MV | READING_FRAME;
+    if (length >= 15)
+    {
+        log_debug("Parsing as PVVX Firmware\n");
+        reading->temperature_celsius = (int16_t)(data[6] | data[7] << 8) / 100.0;
+        reading->humidity = (int16_t)(data[8] | data[9] << 8) / 100.0;
+        reading->battery_mv = data[10] | data[11] << 8;
+        reading->battery_pct = data[12];
+        reading->frame = data[13];
+    }
+    else
+    {
+        log_debug("Parsing as ATC Firmware\n");
+        reading->temperature_celsius = (int16_t)(data[6] << 8 | data[7]) / 10.0;
+        reading->humidity = data[8];
+        reading->battery_pct = data[9];
+        reading->battery_mv = data[10] << 8 | data[11];
+        reading->frame = data[12];
+    }
+    return true;
+}
 
-                                // count the number of advertising packets we get from each unit
+// 2 = Govee H5052 and 6 = Govee H5074, manufacturer data 0xEC88 in SCAN_RSP, little endian signed temperature and
+// humidity in hundredths, then the battery percent
+bool govee_h5052_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
 
-                                config.sensors[mac_index].readings_per_hour = config.sensors[mac_index].readings_per_hour + 1;
+    (void)decoder;
+    return report->event_type == 4 && ad_manufacturer_data(report, 0xEC88, &length) != NULL && length >= 6;
+}
 
-                                if (config.publish_type == 1)
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d,\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F,\"humidity\":%#.1F,\"batterypct\":%i,\"name\":\"%s\",\"location\":\"%s\",\"type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
-                                else
-                                {
-                                    payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d,\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F,\"humidity\":%#.1F,\"battery-pct\":%i,\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}",
-                                                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                              addr, rssi_int, temperature_fahrenheit,
-                                                              temperature_celsius,
-                                                              humidity, battery_precentage_int,
-                                                              config.sensors[mac_index].name,
-                                                              config.sensors[mac_index].location,
-                                                              config.sensors[mac_index].type);
-                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                }
+bool govee_h5074_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
 
-                                if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                                // if (payload_length >= payload_buff_size)
-                                {
-                                    fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                                    exit(-1);
-                                }
+    (void)decoder;
+    return report->event_type == 4 && ad_manufacturer_data(report, 0xEC88, &length) != NULL && length == 7;
+}
 
-                                // publish the message and wait for success
-                                pubmsg.payload = payload_buffer;
-                                pubmsg.payloadlen = payload_length;
-                                pubmsg.qos = QOS;
-                                pubmsg.retained = 0;
-                                deliveredtoken = 0;
-                                MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                                // wait for messqge to be delivered to server
-                                // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                                while (deliveredtoken != token)
-                                    ;
-                            }
+bool govee_h5052_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    int length;
+    const uint8_t *data = ad_manufacturer_data(report, 0xEC88, &length);
+
+    (void)decoder;
+    reading->fields = READING_TEMPERATURE | READING_HUMIDITY | READING_BATTERY_PCT;
+    reading->temperature_celsius = (int16_t)(data[1] | data[2] << 8) / 100.0;
+    reading->humidity = (data[3] | data[4] << 8) / 100.0;
+    reading->battery_pct = (signed char)data[5];
+    return true;
+}
 
-                            if (advertising_packet_type == 4)
-                            {
-                            }
-                            fflush(stdout);
-                        }
-                        // end device type 5
+// Govee temperature and humidity packed in 3 big endian bytes as temperature * 10000 + humidity * 10, with the top
+// bit set below 0 C, then the battery percent
+void govee_packed(const uint8_t *data, unsigned int *packed, bool *below_zero, reading_t *reading)
+{
+    *below_zero = (data[0] & 0x80) != 0;
+    *packed = data[2] | data[1] << 8 | (data[0] & 0x7f) << 16;
+    reading->fields = READING_TEMPERATURE | READING_HUMIDITY | READING_BATTERY_PCT;
+    reading->battery_pct = (signed char)data[3];
+}
 
-                        // device type 6 = Govee H5074
-                        if (config.sensors[mac_index].type == 6)
-                        {
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+// 3 = Govee H5072 and 5 = Govee H5075, manufacturer data 0xEC88 in ADV_IND after 1 byte
+// 4 = Govee H5102, manufacturer data 0x0001 in ADV_IND after 2 bytes
+bool govee_h5072_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
 
-                            int advertising_packet_type; // type of advertising packet
+    (void)decoder;
+    return report->event_type == 0 && ad_manufacturer_data(report, 0xEC88, &length) != NULL && length >= 5;
+}
 
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
+bool govee_h5102_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
 
-                            // sensor data is broadcast in type 0 advertising message by the H5072
-                            if (advertising_packet_type == 0)
-                            {
-                            }
+    (void)decoder;
+    return report->event_type == 0 && ad_manufacturer_data(report, 0x0001, &length) != NULL && length >= 6;
+}
 
-                            if (advertising_packet_type == 4)
-                            {
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
+// H5072 and H5102 round to whole degrees and percent
+// this crap code works for values below 0 degrees C but seems to bottomout about 12.2 degrees F, display shows values lower
+// but not very accurate. Manual says range is 14 degrees F to 140 degrees F
+// Humidity seems accurate thru range however
+void govee_whole(const uint8_t *data, reading_t *reading)
+{
+    unsigned int packed;
+    bool below_zero;
+    int temperature_int;
+
+    govee_packed(data, &packed, &below_zero, reading);
+    temperature_int = packed / 10000;
+    reading->temperature_celsius = below_zero ? -temperature_int : temperature_int;
+    reading->humidity = (packed % 1000) / 10;
+}
 
-                                // this device sends sensor data only on this type of scan response advertising packet
+bool govee_h5072_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    int length;
 
-                                if ((int8_t)adv_info->data[0] == 0x0a)
-                                {
+    (void)decoder;
+    govee_whole(ad_manufacturer_data(report, 0xEC88, &length) + 1, reading);
+    return true;
+}
 
-                                    if (logging_level == LOG_DEBUG)
-                                    {
-                                        fprintf(stdout, "=========\n");
-                                        fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                        fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                        fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                        fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                    }
-
-                                    //                                     fprintf(stdout, "=========\n");
-                                    //                                     fprintf(stdout, "Current local time and date: %s", asctime (time_packet_received) );
-                                    //                                     fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    //
-                                    //                                     fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-
-                                    sensor_data_start = 5;
-
-                                    // get the lsb msb byte pairs for temperature and humidity and convert them to an integer value (in 100's)
-                                    // temperature is a signed 16 bit integer to allow for temperatures below and above 0 degrees celsius
-                                    signed short int temperature_int = adv_info->data[sensor_data_start + 0] | adv_info->data[sensor_data_start + 1] << 8;
-                                    int humidity_int = adv_info->data[sensor_data_start + 2] | adv_info->data[sensor_data_start + 3] << 8;
-
-                                    // convert the integer * 100 value for temperature and humidity to degrees fahrenheit and celsius (for homekit) and humidity percentage
-
-                                    double temperature_fahrenheit;
-                                    double temperature_celsius;
-                                    temperature_fahrenheit = (temperature_int / 100.0) * 9.0 / 5.0 + 32.0;
-                                    temperature_celsius = (temperature_int / 100.0);
-
-                                    double humidity = humidity_int / 100.0;
-
-                                    // get battery level percentage
-                                    int battery_precentage_int = (signed char)adv_info->data[sensor_data_start + 4];
-
-                                    if (logging_level == LOG_DEBUG)
-                                    {
-                                        fprintf(stdout, "temp c       =  %.1f\n", temperature_celsius);
-                                        fprintf(stdout, "temp f       =  %.1f\n", temperature_fahrenheit);
-                                        fprintf(stdout, "humidity pct =  %.1f\n", humidity);
-                                        fprintf(stdout, "battery pct  = %3d\n", battery_precentage_int);
-                                    }
-
-                                    // count the number of advertising packets we get from each unit
-
-                                    config.sensors[mac_index].readings_per_hour = config.sensors[mac_index].readings_per_hour + 1;
-
-                                    if (config.publish_type == 1)
-                                    {
-                                        payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                                  "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d,\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F,\"humidity\":%#.1F,\"batterypct\":%i,\"name\":\"%s\",\"location\":\"%s\",\"type\":\"%d\"}",
-                                                                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                                  addr, rssi_int, temperature_fahrenheit,
-                                                                  temperature_celsius,
-                                                                  humidity, battery_precentage_int,
-                                                                  config.sensors[mac_index].name,
-                                                                  config.sensors[mac_index].location,
-                                                                  config.sensors[mac_index].type);
-                                        topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                    }
-                                    else
-                                    {
-                                        payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
-                                                                  "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d,\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F,\"humidity\":%#.1F,\"battery-pct\":%i,\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}",
-                                                                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                                                                  addr, rssi_int, temperature_fahrenheit,
-                                                                  temperature_celsius,
-                                                                  humidity, battery_precentage_int,
-                                                                  config.sensors[mac_index].name,
-                                                                  config.sensors[mac_index].location,
-                                                                  config.sensors[mac_index].type);
-                                        topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
-                                    }
-
-                                    if (payload_length >= MAXIMUM_JSON_MESSAGE)
-                                    // if (payload_length >= payload_buff_size)
-                                    {
-                                        fprintf(stderr, "MQTT payload too long, %d\n", payload_length);
-                                        exit(-1);
-                                    }
-
-                                    // publish the message and wait for success
-                                    pubmsg.payload = payload_buffer;
-                                    pubmsg.payloadlen = payload_length;
-                                    pubmsg.qos = QOS;
-                                    pubmsg.retained = 0;
-                                    deliveredtoken = 0;
-                                    MQTTClient_publishMessage(client, topic_buffer, &pubmsg, &token);
-
-                                    // wait for messqge to be delivered to server
-                                    // printf("Waiting for publication of %s\n" "on topic %s for client with ClientID: %s\n", payload_buffer, topic_buffer, z_client_id_mqtt);
-                                    while (deliveredtoken != token)
-                                        ;
-                                }
-                            }
-                            fflush(stdout);
-                        }
-                        // end device type 6
+bool govee_h5102_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    int length;
 
-                        // device type 99 = decoding
-                        if (config.sensors[mac_index].type == 99)
-                        {
-                            //get the time that we received the scan response packet
-                            time(&rawtime);
-                            tm = *gmtime(&rawtime);
-                            time_packet_received = localtime(&rawtime);
+    (void)decoder;
+    govee_whole(ad_manufacturer_data(report, 0x0001, &length) + 2, reading);
+    return true;
+}
 
-                            int advertising_packet_type; // type of advertising packet
+// H5075 keeps the tenths
+bool govee_h5075_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    int length;
+    unsigned int packed;
+    bool below_zero;
+
+    (void)decoder;
+    govee_packed(ad_manufacturer_data(report, 0xEC88, &length) + 1, &packed, &below_zero, reading);
+    reading->temperature_celsius = packed / 1000 / 10.0;
+    if (below_zero)
+    {
+        reading->temperature_celsius = -reading->temperature_celsius;
+    }
+    reading->humidity = (packed % 1000) / 10.0;
+    return true;
+}
 
-                            advertising_packet_type = (unsigned int)ble_adv_buf[5];
+// 7 = BTHome v2 (pvvx firmware in BTHome mode, Shelly BLU and others), service data 0xFCD2: a device information
+// byte, then objects of a 1 byte id and a little endian value whose length and scale are fixed by the id. the
+// objects are read in one pass, each id looked up in a table indexed by the id. an id not in the table ends the
+// report, the length of its value is not known
+#define BTHOME_VARIABLE 0xff // a length byte follows the id
 
-                            if (advertising_packet_type == 0)
-                            {
-                                // counter for printing
-                                int n;
+enum
+{
+    BTHOME_SKIP,
+    BTHOME_VALUE,
+    BTHOME_TEMPERATURE,
+    BTHOME_HUMIDITY,
+    BTHOME_BATTERY,
+    BTHOME_VOLTAGE,
+    BTHOME_FRAME,
+    BTHOME_DIMMER
+};
 
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
+typedef struct
+{
+    uint8_t length; // of the value, 0 = id not known
+    bool is_signed;
+    uint8_t target;
+    uint8_t decimals;
+    double factor;
+    const char *name;
+} bthome_object_t;
+
+const bthome_object_t bthome_objects[256] = {
+    [0x00] = {1, false, BTHOME_FRAME, 0, 1, "packet"},
+    [0x01] = {1, false, BTHOME_BATTERY, 0, 1, "battery"},
+    [0x02] = {2, true, BTHOME_TEMPERATURE, 2, 0.01, "temperature"},
+    [0x03] = {2, false, BTHOME_HUMIDITY, 2, 0.01, "humidity"},
+    [0x04] = {3, false, BTHOME_VALUE, 2, 0.01, "pressure"},
+    [0x05] = {3, false, BTHOME_VALUE, 2, 0.01, "illuminance"},
+    [0x06] = {2, false, BTHOME_VALUE, 2, 0.01, "mass"},
+    [0x07] = {2, false, BTHOME_VALUE, 2, 0.01, "masslb"},
+    [0x08] = {2, true, BTHOME_VALUE, 2, 0.01, "dewpoint"},
+    [0x09] = {1, false, BTHOME_VALUE, 0, 1, "count"},
+    [0x0A] = {3, false, BTHOME_VALUE, 3, 0.001, "energy"},
+    [0x0B] = {3, false, BTHOME_VALUE, 2, 0.01, "power"},
+    [0x0C] = {2, false, BTHOME_VOLTAGE, 3, 0.001, "voltage"},
+    [0x0D] = {2, false, BTHOME_VALUE, 0, 1, "pm25"},
+    [0x0E] = {2, false, BTHOME_VALUE, 0, 1, "pm10"},
+    [0x0F] = {1, false, BTHOME_VALUE, 0, 1, "generic"},
+    [0x10] = {1, false, BTHOME_VALUE, 0, 1, "poweron"},
+    [0x11] = {1, false, BTHOME_VALUE, 0, 1, "opening"},
+    [0x12] = {2, false, BTHOME_VALUE, 0, 1, "co2"},
+    [0x13] = {2, false, BTHOME_VALUE, 0, 1, "tvoc"},
+    [0x14] = {2, false, BTHOME_VALUE, 2, 0.01, "moisture"},
+    [0x15] = {1, false, BTHOME_VALUE, 0, 1, "batterylow"},
+    [0x16] = {1, false, BTHOME_VALUE, 0, 1, "batterycharging"},
+    [0x17] = {1, false, BTHOME_VALUE, 0, 1, "co"},
+    [0x18] = {1, false, BTHOME_VALUE, 0, 1, "cold"},
+    [0x19] = {1, false, BTHOME_VALUE, 0, 1, "connectivity"},
+    [0x1A] = {1, false, BTHOME_VALUE, 0, 1, "door"},
+    [0x1B] = {1, false, BTHOME_VALUE, 0, 1, "garagedoor"},
+    [0x1C] = {1, false, BTHOME_VALUE, 0, 1, "gas"},
+    [0x1D] = {1, false, BTHOME_VALUE, 0, 1, "heat"},
+    [0x1E] = {1, false, BTHOME_VALUE, 0, 1, "light"},
+    [0x1F] = {1, false, BTHOME_VALUE, 0, 1, "lock"},
+    [0x20] = {1, false, BTHOME_VALUE, 0, 1, "wet"},
+    [0x21] = {1, false, BTHOME_VALUE, 0, 1, "motion"},
+    [0x22] = {1, false, BTHOME_VALUE, 0, 1, "moving"},
+    [0x23] = {1, false, BTHOME_VALUE, 0, 1, "occupancy"},
+    [0x24] = {1, false, BTHOME_VALUE, 0, 1, "plug"},
+    [0x25] = {1, false, BTHOME_VALUE, 0, 1, "presence"},
+    [0x26] = {1, false, BTHOME_VALUE, 0, 1, "problem"},
+    [0x27] = {1, false, BTHOME_VALUE, 0, 1, "running"},
+    [0x28] = {1, false, BTHOME_VALUE, 0, 1, "safety"},
+    [0x29] = {1, false, BTHOME_VALUE, 0, 1, "smoke"},
+    [0x2A] = {1, false, BTHOME_VALUE, 0, 1, "sound"},
+    [0x2B] = {1, false, BTHOME_VALUE, 0, 1, "tamper"},
+    [0x2C] = {1, false, BTHOME_VALUE, 0, 1, "vibration"},
+    [0x2D] = {1, false, BTHOME_VALUE, 0, 1, "window"},
+    [0x2E] = {1, false, BTHOME_HUMIDITY, 0, 1, "humidity"},
+    [0x2F] = {1, false, BTHOME_VALUE, 0, 1, "moisture"},
+    [0x3A] = {1, false, BTHOME_VALUE, 0, 1, "button"},
+    [0x3C] = {2, false, BTHOME_DIMMER, 0, 1, "dimmer"},
+    [0x3D] = {2, false, BTHOME_VALUE, 0, 1, "count"},
+    [0x3E] = {4, false, BTHOME_VALUE, 0, 1, "count"},
+    [0x3F] = {2, true, BTHOME_VALUE, 1, 0.1, "rotation"},
+    [0x40] = {2, false, BTHOME_VALUE, 0, 1, "distancemm"},
+    [0x41] = {2, false, BTHOME_VALUE, 1, 0.1, "distance"},
+    [0x42] = {3, false, BTHOME_VALUE, 3, 0.001, "duration"},
+    [0x43] = {2, false, BTHOME_VALUE, 3, 0.001, "current"},
+    [0x44] = {2, false, BTHOME_VALUE, 2, 0.01, "speed"},
+    [0x45] = {2, true, BTHOME_TEMPERATURE, 1, 0.1, "temperature"},
+    [0x46] = {1, false, BTHOME_VALUE, 1, 0.1, "uvindex"},
+    [0x47] = {2, false, BTHOME_VALUE, 1, 0.1, "volume"},
+    [0x48] = {2, false, BTHOME_VALUE, 0, 1, "volumeml"},
+    [0x49] = {2, false, BTHOME_VALUE, 3, 0.001, "flowrate"},
+    [0x4A] = {2, false, BTHOME_VALUE, 1, 0.1, "voltage"},
+    [0x4B] = {3, false, BTHOME_VALUE, 3, 0.001, "gas"},
+    [0x4C] = {4, false, BTHOME_VALUE, 3, 0.001, "gas"},
+    [0x4D] = {4, false, BTHOME_VALUE, 3, 0.001, "energy"},
+    [0x4E] = {4, false, BTHOME_VALUE, 3, 0.001, "volume"},
+    [0x4F] = {4, false, BTHOME_VALUE, 3, 0.001, "water"},
+    [0x50] = {4, false, BTHOME_VALUE, 0, 1, "timestamp"},
+    [0x51] = {2, false, BTHOME_VALUE, 3, 0.001, "acceleration"},
+    [0x52] = {2, false, BTHOME_VALUE, 3, 0.001, "gyroscope"},
+    [0x53] = {BTHOME_VARIABLE, false, BTHOME_SKIP, 0, 1, "text"},
+    [0x54] = {BTHOME_VARIABLE, false, BTHOME_SKIP, 0, 1, "raw"},
+    [0x55] = {4, false, BTHOME_VALUE, 3, 0.001, "volumestorage"},
+    [0x56] = {2, false, BTHOME_VALUE, 0, 1, "conductivity"},
+    [0x57] = {1, true, BTHOME_TEMPERATURE, 0, 1, "temperature"},
+    [0x58] = {1, true, BTHOME_TEMPERATURE, 2, 0.35, "temperature"},
+    [0x59] = {1, true, BTHOME_VALUE, 0, 1, "count"},
+    [0x5A] = {2, true, BTHOME_VALUE, 0, 1, "count"},
+    [0x5B] = {4, true, BTHOME_VALUE, 0, 1, "count"},
+    [0x5C] = {4, true, BTHOME_VALUE, 2, 0.01, "power"},
+    [0x5D] = {2, true, BTHOME_VALUE, 3, 0.001, "current"},
+    [0x5E] = {2, false, BTHOME_VALUE, 2, 0.01, "direction"},
+    [0x5F] = {2, false, BTHOME_VALUE, 1, 0.1, "precipitation"},
+    [0x60] = {1, false, BTHOME_VALUE, 0, 1, "channel"},
+    [0x61] = {2, false, BTHOME_VALUE, 0, 1, "rotationalspeed"},
+    [0xF0] = {2, false, BTHOME_SKIP, 0, 1, "devicetype"},
+    [0xF1] = {4, false, BTHOME_SKIP, 0, 1, "firmware"},
+    [0xF2] = {3, false, BTHOME_SKIP, 0, 1, "firmware"}};
+
+// version 2 in bits 5 to 7 of the device information, not encrypted
+bool bthome_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
+    const uint8_t *data = ad_service_data(report, 0xFCD2, &length);
 
-                                if (logging_level == LOG_DEBUG)
-                                {
-                                    fprintf(stdout, "=========\n");
-                                    fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                    fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                    fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                    // print whole packet
-                                    printf("==>0 0 0 0 0 0 0 0 0 0 1 1 1 1 1 1 1 1 1 1 2 2 2 2 2 2 2 2 2 2 3 3 3 3 3 3 3 3 3 3 4 4 4 4 4 4 4 4 4 4 5 5 5 5 5 5 5 5 5 5 6 \n");
-                                    printf("==>0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 \n");
-                                    printf("==>                            0 0 0 0 0 0 0 0 0 0 1 1 1 1 1 1 1 1 1 1 2\n");
-                                    printf("==>                            0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 \n");
-                                    printf("==>");
-                                    for (n = 0; n < bluetooth_adv_packet_length; n++)
-                                        printf("%02X", (unsigned char)ble_adv_buf[n]);
-                                    printf("\n");
-                                    printf("==>__________ad________________________mmmmmmmmmmmmtttthhbbzbzbccrr\n");
-                                    fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                                }
+    (void)decoder;
+    return data != NULL && length >= 1 && (data[0] & 0xe1) == 0x40;
+}
 
-                                //                                 fprintf(stdout, "=========\n");
-                                //                                 fprintf(stdout, "Current local time and date: %s", asctime (time_packet_received) );
-                                //                                 fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                //
-                                //                                 fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                            }
+// the objects of the report after the device information byte into the reading
+bool bthome_objects_decode(const uint8_t *data, int length, reading_t *reading)
+{
+    const bthome_object_t *object;
+    reading_value_t *value;
+    int64_t raw;
+    int position;
+    int size;
+    int i;
 
-                            if (advertising_packet_type == 4)
-                            {
-                                // counter for printing
-                                int n;
-
-                                // get rssi
-                                int rssi_int = (signed char)(int8_t)adv_info->data[adv_info->length];
-
-                                fprintf(stdout, "=========\n");
-                                fprintf(stdout, "Current local time and date: %s", asctime(time_packet_received));
-                                fprintf(stdout, "mac address =  %s  location = %s device type = %d ", addr, config.sensors[mac_index].location, config.sensors[mac_index].type);
-                                fprintf(stdout, "advertising_packet_type = %03d\n", advertising_packet_type);
-                                // print whole packet
-                                printf("==>0 0 0 0 0 0 0 0 0 0 1 1 1 1 1 1 1 1 1 1 2 2 2 2 2 2 2 2 2 2 3 3 3 3 3 3 3 3 3 3 4 4 4 4 4 4 4 4 4 4 5 5 5 5 5 5 5 5 5 5 6 \n");
-                                printf("==>0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 \n");
-                                printf("==>                            0 0 0 0 0 0 0 0 0 0 1 1 1 1 1 1 1 1 1 1 2\n");
-                                printf("==>                            0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 \n");
-                                printf("==>");
-                                for (n = 0; n < bluetooth_adv_packet_length; n++)
-                                    printf("%02X", (unsigned char)ble_adv_buf[n]);
-                                printf("\n");
-                                printf("==>__________ad________________________mmmmmmmmmmmmtttthhbbzbzbccrr\n");
-                                fprintf(stdout, "rssi         = %03d\n", rssi_int);
-                            }
-                            fflush(stdout);
-                        }
-                        // end device type 99
+    reading->fields = 0;
+    for (position = 0; position < length; position += 1 + size)
+    {
+        object = &bthome_objects[data[position]];
+        size = object->length;
+        if (size == BTHOME_VARIABLE)
+        {
+            size = position + 1 < length ? 1 + data[position + 1] : length;
+        }
+        if (size == 0 || position + 1 + size > length)
+        {
+            break;
+        }
 
-                    } // end of Matched MAC address
+        raw = 0;
+        if (object->target != BTHOME_SKIP)
+        {
+            for (i = size; i > 0; i--)
+            {
+                raw = raw << 8 | data[position + i];
+            }
+            if (object->is_signed && (raw & (1LL << (8 * size - 1))))
+            {
+                raw -= 1LL << (8 * size);
+            }
+        }
 
-                    // if there are multiple advertising packets loop thru them
-                    offset = adv_info->data + adv_info->length + 2;
+        switch (object->target)
+        {
+        case BTHOME_TEMPERATURE:
+            reading->fields |= READING_TEMPERATURE;
+            reading->temperature_celsius = raw * object->factor;
+            break;
+        case BTHOME_HUMIDITY:
+            reading->fields |= READING_HUMIDITY;
+            reading->humidity = raw * object->factor;
+            break;
+        case BTHOME_BATTERY:
+            reading->fields |= READING_BATTERY_PCT;
+            reading->battery_pct = raw;
+            break;
+        case BTHOME_VOLTAGE:
+            reading->fields |= READING_BATTERY_MV;
+            reading->battery_mv = raw;
+            break;
+        case BTHOME_FRAME:
+            reading->fields |= READING_FRAME;
+            reading->frame = raw;
+            break;
+        case BTHOME_DIMMER:
+        case BTHOME_VALUE:
+            if (reading->value_count == READING_MAX_VALUES)
+            {
+                break;
+            }
+            value = &reading->values[reading->value_count];
+            value->name = object->name;
+            value->decimals = object->decimals;
+            // dimmer: the event (1 = left, 2 = right) then the steps
+            value->value = object->target == BTHOME_DIMMER ? ((raw & 0xff) == 1 ? -(raw >> 8) : raw >> 8) : raw * object->factor;
+            value->index = 0;
+            for (i = 0; i < reading->value_count; i++)
+            {
+                if (strcmp(reading->values[i].name, object->name) == 0)
+                {
+                    value->index++;
                 }
             }
+            reading->value_count++;
+            break;
         }
     }
+    return reading->fields != 0 || reading->value_count != 0;
+}
 
-    // <ctrl>-c to exit program received
-    fprintf(stdout, "\n<ctrl>-c signal received, exiting.\n");
-    snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d <ctrl>-c signal received, exiting.", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-    send_remote_syslog_message(LOG_INFO, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-    syslog(LOG_INFO, "%s", log_message);
+bool bthome_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    int length;
+    const uint8_t *data = ad_service_data(report, 0xFCD2, &length);
 
-    // Disable scanning.
-    memset(&scan_cp, 0, sizeof(scan_cp));
-    scan_cp.enable = 0x00; // Disable flag.
+    (void)decoder;
+    return bthome_objects_decode(data + 1, length - 1, reading);
+}
+
+// 8 = Xiaomi MiBeacon (LYWSDCGQ, LYWSD03MMC and others with the stock firmware), service data 0xFE95: a 2 byte frame
+// control, the product id, a frame counter, the mac address and capability when their bits are set, then objects of
+// a 2 byte id, a length and the value. most reports carry one value, the rest are filled in from the last reports
+// of the sensor. the stock firmware of most of them encrypts the objects, see crypto_decrypt
+#define MIBEACON_ENCRYPTED 0x08
+#define MIBEACON_MAC 0x10
+#define MIBEACON_CAPABILITY 0x20
+#define MIBEACON_OBJECTS 0x40
+
+// offset of the first object, -1 if the frame has none
+int mibeacon_objects(const uint8_t *data, int length)
+{
+    int position = 5;
 
-    struct hci_request disable_adv_rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
-    ret = hci_send_req(bluetooth_device, &disable_adv_rq, 1000);
-    if (ret < 0)
+    if (length < 5 || !(data[0] & MIBEACON_OBJECTS))
     {
-        hci_close_dev(bluetooth_device);
-        snprintf(log_message, LOGMESSAGESIZE, "%s v: %d.%d Failed to disable scan", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
-        send_remote_syslog_message(LOG_ERR, RSYSLOG_ADDRESS, PROGRAM_NAME, log_message);
-        syslog(LOG_ERR, "%s", log_message);
-        fprintf(stdout, "Failed to disable scan, return code %d\n", ret);
-        exit(1);
+        return -1;
     }
+    if (data[0] & MIBEACON_MAC)
+    {
+        position += 6;
+    }
+    if (data[0] & MIBEACON_CAPABILITY)
+    {
+        if (position >= length)
+        {
+            return -1;
+        }
+        // a second byte of I/O capability follows when bit 5 is set
+        position += (data[position] & 0x20) ? 2 : 1;
+    }
+    return position <= length ? position : -1;
+}
 
-    hci_close_dev(bluetooth_device);
-
-    // end MQTT session
-    MQTTClient_disconnect(client, 10000);
-    MQTTClient_destroy(&client);
+bool mibeacon_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    int length;
+    const uint8_t *data = ad_service_data(report, 0xFE95, &length);
 
-    exit(0);
+    (void)decoder;
+    return data != NULL && !(data[0] & MIBEACON_ENCRYPTED) && mibeacon_objects(data, length) >= 0;
 }
 
-unsigned int
-parser(config_t *config, char **argv)
+bool mibeacon_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
 {
-    /* Open file & declare libyaml types */
-    FILE *fp = fopen(argv[1], "r");
+    int length;
+    const uint8_t *data = ad_service_data(report, 0xFE95, &length);
+    const uint8_t *value;
+    float temperature;
+    int position;
+    int size;
+
+    (void)decoder;
+    reading->fields = 0;
+    for (position = mibeacon_objects(data, length); position + 3 <= length; position += 3 + size)
+    {
+        value = data + position + 3;
+        size = data[position + 2];
+        if (position + 3 + size > length)
+        {
+            break;
+        }
+        switch (data[position] | data[position + 1] << 8)
+        {
+        case 0x1004:
+            if (size >= 2)
+            {
+                reading->fields |= READING_TEMPERATURE;
+                reading->temperature_celsius = (int16_t)(value[0] | value[1] << 8) / 10.0;
+            }
+            break;
+        case 0x1006:
+            if (size >= 2)
+            {
+                reading->fields |= READING_HUMIDITY;
+                reading->humidity = (value[0] | value[1] << 8) / 10.0;
+            }
+            break;
+        case 0x100A:
+        case 0x4803:
+            if (size >= 1)
+            {
+                reading->fields |= READING_BATTERY_PCT;
+                reading->battery_pct = value[0];
+            }
+            break;
+        case 0x100D:
+            if (size >= 4)
+            {
+                reading->fields |= READING_TEMPERATURE | READING_HUMIDITY;
+                reading->temperature_celsius = (int16_t)(value[0] | value[1] << 8) / 10.0;
+                reading->humidity = (value[2] | value[3] << 8) / 10.0;
+            }
+            break;
+        case 0x4C01:
+            if (size >= 4)
+            {
+                memcpy(&temperature, value, sizeof(temperature));
+                reading->fields |= READING_TEMPERATURE;
+                reading->temperature_celsius = round(temperature * 100) / 100;
+            }
+            break;
+        case 0x4C02:
+            if (size >= 1)
+            {
+                reading->fields |= READING_HUMIDITY;
+                reading->humidity = value[0];
+            }
+            break;
+        }
+    }
+    return reading->fields != 0;
+}
 
-    if (fp == NULL)
+const ble_decoder_t builtin_decoders[] =
     {
-        fprintf(stdout, "ERROR: Failed to open config file: %s\n", argv[1]);
-        exit(EXIT_FAILURE);
+        {BLE_DECODER_ABI_VERSION, 1, "Xiaomi", "LYWSD03MMC-ATC", "FTHBVS", atc_match, atc_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 2, "Govee", "H5052", "FTHBS", govee_h5052_match, govee_h5052_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 3, "Govee", "H5072", "FTHBS", govee_h5072_match, govee_h5072_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 4, "Govee", "H5102", "FTHBS", govee_h5102_match, govee_h5102_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 5, "Govee", "H5075", "FTHBS", govee_h5072_match, govee_h5075_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 6, "Govee", "H5074", "FTHBS", govee_h5074_match, govee_h5052_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 7, "BTHome", "v2", "FTHBVS", bthome_match, bthome_decode, NULL},
+        {BLE_DECODER_ABI_VERSION, 8, "Xiaomi", "MiBeacon", "FTHBS", mibeacon_match, mibeacon_decode, NULL}};
+
+// the built in decoder of a sensor type, NULL if there is none
+const ble_decoder_t *builtin_decoder(int type)
+{
+    size_t d;
+
+    for (d = 0; d < sizeof(builtin_decoders) / sizeof(builtin_decoders[0]); d++)
+    {
+        if (builtin_decoders[d].type == type)
+        {
+            return &builtin_decoders[d];
+        }
     }
+    return NULL;
+}
 
-    yaml_parser_t parser;
-    yaml_event_t event;
+// decoder specs
+// a sensor that differs from another only in where its values are and how they are scaled is described in the
+// decoder_specs list instead of in code. each value is an expression of space separated steps, read left to right:
+//     u8@N s8@N u16le@N s16le@N u16be@N s16be@N ... u32be@N s32be@N   load the data at offset N
+//     &M          and with the mask M
+//     sign:B      sign and magnitude, when bit B is set clear it and negate
+//     div:N mod:N integer division and remainder
+//     ==N         1 when equal to N, else 0 (for require)
+//     *X /X +X    multiply, divide, add as a real number, integer steps can not follow
+// the expressions are compiled at startup into one array of 8 byte instructions run by spec_execute. the offsets
+// are checked against min_length when compiling, so running the program needs no bounds checks
+enum
+{
+    SPEC_END,
+    SPEC_TEST,
+    SPEC_U8,
+    SPEC_S8,
+    SPEC_U16LE,
+    SPEC_S16LE,
+    SPEC_U16BE,
+    SPEC_S16BE,
+    SPEC_U24LE,
+    SPEC_S24LE,
+    SPEC_U24BE,
+    SPEC_S24BE,
+    SPEC_U32LE,
+    SPEC_S32LE,
+    SPEC_U32BE,
+    SPEC_S32BE,
+    SPEC_MASK,
+    SPEC_SIGN,
+    SPEC_DIV,
+    SPEC_MOD,
+    SPEC_EQUAL,
+    SPEC_REAL,
+    SPEC_MULTIPLY_INTEGER, // the first real step also converts the integer
+    SPEC_DIVIDE_INTEGER,
+    SPEC_ADD_INTEGER,
+    SPEC_MULTIPLY,
+    SPEC_DIVIDE,
+    SPEC_ADD,
+    SPEC_ROUND,
+    SPEC_STORE_TEMPERATURE,
+    SPEC_STORE_HUMIDITY,
+    SPEC_STORE_BATTERY_PCT,
+    SPEC_STORE_BATTERY_MV,
+    SPEC_STORE_FRAME
+};
+
+#define SPEC_MAX_CODE 64
+#define SPEC_MAX_CONSTANTS 16
 
-    bool seq_status = 0;      /* IN or OUT of sequence index, init to OUT */
-    unsigned int map_seq = 0; /* Index of mapping inside sequence */
+typedef struct
+{
+    uint8_t op;
+    uint8_t offset;  // of a load
+    uint16_t unused;
+    int32_t arg;     // mask, bit, divisor, value compared or index of a real constant
+} spec_op_t;
 
-    init_prs(fp, &parser); /* Initiliaze parser & open file */
+typedef struct
+{
+    ble_decoder_t decoder; // context points back to the program
+    char entities[8];
+    int event_type;
+    int manufacturer;
+    int service;
+    int min_length;
+    int max_length;
+    uint32_t fields;
+    int decode_start; // the match program is at 0, the decode program here
+    spec_op_t code[SPEC_MAX_CODE];
+    double constants[SPEC_MAX_CONSTANTS];
+    int code_count;
+    int constant_count;
+} spec_program_t;
+
+spec_program_t spec_programs[MAX_DECODER_SPECS];
+
+// run the program from op with the data of the report, false when a test failed. each step jumps straight to the
+// next through a table of label addresses (a GCC extension), which predicts much better than a switch in a loop
+bool spec_execute(const spec_op_t *op, const double *constants, const uint8_t *d, reading_t *reading)
+{
+    static const void *steps[] = {
+        [SPEC_END] = &&spec_end,
+        [SPEC_TEST] = &&spec_test,
+        [SPEC_U8] = &&spec_u8,
+        [SPEC_S8] = &&spec_s8,
+        [SPEC_U16LE] = &&spec_u16le,
+        [SPEC_S16LE] = &&spec_s16le,
+        [SPEC_U16BE] = &&spec_u16be,
+        [SPEC_S16BE] = &&spec_s16be,
+        [SPEC_U24LE] = &&spec_u24le,
+        [SPEC_S24LE] = &&spec_s24le,
+        [SPEC_U24BE] = &&spec_u24be,
+        [SPEC_S24BE] = &&spec_s24be,
+        [SPEC_U32LE] = &&spec_u32le,
+        [SPEC_S32LE] = &&spec_s32le,
+        [SPEC_U32BE] = &&spec_u32be,
+        [SPEC_S32BE] = &&spec_s32be,
+        [SPEC_MASK] = &&spec_mask,
+        [SPEC_SIGN] = &&spec_sign,
+        [SPEC_DIV] = &&spec_div,
+        [SPEC_MOD] = &&spec_mod,
+        [SPEC_EQUAL] = &&spec_equal,
+        [SPEC_REAL] = &&spec_real,
+        [SPEC_MULTIPLY_INTEGER] = &&spec_multiply_integer,
+        [SPEC_DIVIDE_INTEGER] = &&spec_divide_integer,
+        [SPEC_ADD_INTEGER] = &&spec_add_integer,
+        [SPEC_MULTIPLY] = &&spec_multiply,
+        [SPEC_DIVIDE] = &&spec_divide,
+        [SPEC_ADD] = &&spec_add,
+        [SPEC_ROUND] = &&spec_round,
+        [SPEC_STORE_TEMPERATURE] = &&spec_store_temperature,
+        [SPEC_STORE_HUMIDITY] = &&spec_store_humidity,
+        [SPEC_STORE_BATTERY_PCT] = &&spec_store_battery_pct,
+        [SPEC_STORE_BATTERY_MV] = &&spec_store_battery_mv,
+        [SPEC_STORE_FRAME] = &&spec_store_frame};
+    int64_t v = 0;
+    double f = 0;
+
+#define SPEC_NEXT goto *steps[(++op)->op]
+    goto *steps[op->op];
+spec_end:
+    return true;
+spec_test:
+    if (v == 0)
+    {
+        return false;
+    }
+    SPEC_NEXT;
+spec_u8:
+    v = d[op->offset];
+    SPEC_NEXT;
+spec_s8:
+    v = (int8_t)d[op->offset];
+    SPEC_NEXT;
+spec_u16le:
+    v = d[op->offset] | d[op->offset + 1] << 8;
+    SPEC_NEXT;
+spec_s16le:
+    v = (int16_t)(d[op->offset] | d[op->offset + 1] << 8);
+    SPEC_NEXT;
+spec_u16be:
+    v = d[op->offset] << 8 | d[op->offset + 1];
+    SPEC_NEXT;
+spec_s16be:
+    v = (int16_t)(d[op->offset] << 8 | d[op->offset + 1]);
+    SPEC_NEXT;
+spec_u24le:
+    v = d[op->offset] | d[op->offset + 1] << 8 | d[op->offset + 2] << 16;
+    SPEC_NEXT;
+spec_s24le:
+    v = (int32_t)((uint32_t)(d[op->offset] | d[op->offset + 1] << 8 | d[op->offset + 2] << 16) << 8) >> 8;
+    SPEC_NEXT;
+spec_u24be:
+    v = d[op->offset] << 16 | d[op->offset + 1] << 8 | d[op->offset + 2];
+    SPEC_NEXT;
+spec_s24be:
+    v = (int32_t)((uint32_t)(d[op->offset] << 16 | d[op->offset + 1] << 8 | d[op->offset + 2]) << 8) >> 8;
+    SPEC_NEXT;
+spec_u32le:
+    v = (uint32_t)d[op->offset] | (uint32_t)d[op->offset + 1] << 8 | (uint32_t)d[op->offset + 2] << 16 | (uint32_t)d[op->offset + 3] << 24;
+    SPEC_NEXT;
+spec_s32le:
+    v = (int32_t)((uint32_t)d[op->offset] | (uint32_t)d[op->offset + 1] << 8 | (uint32_t)d[op->offset + 2] << 16 | (uint32_t)d[op->offset + 3] << 24);
+    SPEC_NEXT;
+spec_u32be:
+    v = (uint32_t)d[op->offset] << 24 | (uint32_t)d[op->offset + 1] << 16 | (uint32_t)d[op->offset + 2] << 8 | (uint32_t)d[op->offset + 3];
+    SPEC_NEXT;
+spec_s32be:
+    v = (int32_t)((uint32_t)d[op->offset] << 24 | (uint32_t)d[op->offset + 1] << 16 | (uint32_t)d[op->offset + 2] << 8 | (uint32_t)d[op->offset + 3]);
+    SPEC_NEXT;
+spec_mask:
+    v &= op->arg;
+    SPEC_NEXT;
+spec_sign:
+    if (v & op->arg)
+    {
+        v = -(v & ~(int64_t)op->arg);
+    }
+    SPEC_NEXT;
+spec_div:
+    v /= op->arg;
+    SPEC_NEXT;
+spec_mod:
+    v %= op->arg;
+    SPEC_NEXT;
+spec_equal:
+    v = v == op->arg;
+    SPEC_NEXT;
+spec_real:
+    f = v;
+    SPEC_NEXT;
+spec_multiply_integer:
+    f = v * constants[op->arg];
+    SPEC_NEXT;
+spec_divide_integer:
+    f = v / constants[op->arg];
+    SPEC_NEXT;
+spec_add_integer:
+    f = v + constants[op->arg];
+    SPEC_NEXT;
+spec_multiply:
+    f *= constants[op->arg];
+    SPEC_NEXT;
+spec_divide:
+    f /= constants[op->arg];
+    SPEC_NEXT;
+spec_add:
+    f += constants[op->arg];
+    SPEC_NEXT;
+spec_round:
+    v = lround(f);
+    SPEC_NEXT;
+spec_store_temperature:
+    reading->temperature_celsius = f;
+    SPEC_NEXT;
+spec_store_humidity:
+    reading->humidity = f;
+    SPEC_NEXT;
+spec_store_battery_pct:
+    reading->battery_pct = v;
+    SPEC_NEXT;
+spec_store_battery_mv:
+    reading->battery_mv = v;
+    SPEC_NEXT;
+spec_store_frame:
+    reading->frame = v;
+    SPEC_NEXT;
+#undef SPEC_NEXT
+}
 
-    do
+// the manufacturer or service data of the report the spec reads
+const uint8_t *spec_data(const spec_program_t *program, const ad_report_t *report, int *length)
+{
+    if (program->manufacturer >= 0)
     {
-        parse_next(&parser, &event); /* Parse new event */
+        return ad_manufacturer_data(report, program->manufacturer, length);
+    }
+    return ad_service_data(report, program->service, length);
+}
 
-        /* Decide what to do with each event */
-        event_switch(&seq_status, &map_seq, config, &parser, &event, fp);
+bool spec_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    const spec_program_t *program = decoder->context;
+    const uint8_t *data;
+    int length;
 
-        if (event.type != YAML_STREAM_END_EVENT)
+    if (program->event_type >= 0 && report->event_type != program->event_type)
+    {
+        return false;
+    }
+    data = spec_data(program, report, &length);
+    if (data == NULL || length < program->min_length || (program->max_length > 0 && length > program->max_length))
+    {
+        return false;
+    }
+    return program->decode_start == 1 || spec_execute(program->code, program->constants, data, NULL);
+}
+
+bool spec_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    const spec_program_t *program = decoder->context;
+    int length;
+
+    reading->fields = program->fields;
+    return spec_execute(program->code + program->decode_start, program->constants, spec_data(program, report, &length), reading);
+}
+
+void spec_error(const decoder_spec_config_t *spec, const char *what, const char *expression, const char *step)
+{
+    fprintf(stderr, "Decoder spec type %d %s \"%s\": %s\n", spec->type, what, expression, step);
+    exit(1);
+}
+
+void spec_emit(spec_program_t *program, const decoder_spec_config_t *spec, int op, int offset, int32_t arg)
+{
+    if (program->code_count == SPEC_MAX_CODE)
+    {
+        fprintf(stderr, "Decoder spec type %d is too long\n", spec->type);
+        exit(1);
+    }
+    program->code[program->code_count].op = op;
+    program->code[program->code_count].offset = offset;
+    program->code[program->code_count].arg = arg;
+    program->code_count++;
+}
+
+// compile one expression, leaving the value as a real number when want_real is set, else as an integer
+void spec_compile_expression(spec_program_t *program, const decoder_spec_config_t *spec, const char *what,
+                             const char *expression, bool want_real)
+{
+    static const struct
+    {
+        const char *name;
+        int op;
+        int width;
+    } loads[] = {{"u8", SPEC_U8, 1}, {"s8", SPEC_S8, 1}, {"u16le", SPEC_U16LE, 2}, {"s16le", SPEC_S16LE, 2},
+                 {"u16be", SPEC_U16BE, 2}, {"s16be", SPEC_S16BE, 2}, {"u24le", SPEC_U24LE, 3}, {"s24le", SPEC_S24LE, 3},
+                 {"u24be", SPEC_U24BE, 3}, {"s24be", SPEC_S24BE, 3}, {"u32le", SPEC_U32LE, 4}, {"s32le", SPEC_S32LE, 4},
+                 {"u32be", SPEC_U32BE, 4}, {"s32be", SPEC_S32BE, 4}};
+    char copy[64];
+    char *step;
+    char *save;
+    char *at;
+    char *end;
+    bool loaded = false;
+    bool real = false;
+    double constant;
+    long number;
+    size_t n;
+    int op;
+
+    snprintf(copy, sizeof(copy), "%s", expression);
+    for (step = strtok_r(copy, " ", &save); step != NULL; step = strtok_r(NULL, " ", &save))
+    {
+        if ((at = strchr(step, '@')) != NULL)
         {
-            yaml_event_delete(&event);
+            *at = '\0';
+            for (n = 0; n < sizeof(loads) / sizeof(loads[0]) && strcmp(step, loads[n].name) != 0; n++)
+            {
+            }
+            number = strtol(at + 1, &end, 0);
+            if (n == sizeof(loads) / sizeof(loads[0]) || *end != '\0' || loaded)
+            {
+                *at = '@';
+                spec_error(spec, what, expression, step);
+            }
+            if (number < 0 || number + loads[n].width > spec->min_length)
+            {
+                *at = '@';
+                spec_error(spec, what, expression, "reads past min_length");
+            }
+            spec_emit(program, spec, loads[n].op, number, 0);
+            loaded = true;
+            continue;
+        }
+        if (!loaded)
+        {
+            spec_error(spec, what, expression, "does not start with a load");
+        }
+        if (step[0] == '*' || step[0] == '/' || step[0] == '+')
+        {
+            constant = strtod(step + 1, &end);
+            if (*end != '\0' || end == step + 1 || (step[0] == '/' && constant == 0))
+            {
+                spec_error(spec, what, expression, step);
+            }
+            if (program->constant_count == SPEC_MAX_CONSTANTS)
+            {
+                spec_error(spec, what, expression, "too many constants");
+            }
+            if (step[0] == '*')
+            {
+                op = real ? SPEC_MULTIPLY : SPEC_MULTIPLY_INTEGER;
+            }
+            else if (step[0] == '/')
+            {
+                op = real ? SPEC_DIVIDE : SPEC_DIVIDE_INTEGER;
+            }
+            else
+            {
+                op = real ? SPEC_ADD : SPEC_ADD_INTEGER;
+            }
+            program->constants[program->constant_count] = constant;
+            spec_emit(program, spec, op, 0, program->constant_count++);
+            real = true;
+            continue;
+        }
+        if (real)
+        {
+            spec_error(spec, what, expression, "integer step after a real one");
+        }
+        if (step[0] == '&')
+        {
+            number = strtol(step + 1, &end, 0);
+            if (*end != '\0' || end == step + 1)
+            {
+                spec_error(spec, what, expression, step);
+            }
+            spec_emit(program, spec, SPEC_MASK, 0, number);
+        }
+        else if (!strncmp(step, "sign:", 5))
+        {
+            number = strtol(step + 5, &end, 0);
+            if (*end != '\0' || number < 0 || number > 30)
+            {
+                spec_error(spec, what, expression, step);
+            }
+            spec_emit(program, spec, SPEC_SIGN, 0, 1 << number);
+        }
+        else if (!strncmp(step, "div:", 4) || !strncmp(step, "mod:", 4))
+        {
+            number = strtol(step + 4, &end, 0);
+            if (*end != '\0' || number <= 0)
+            {
+                spec_error(spec, what, expression, step);
+            }
+            spec_emit(program, spec, step[0] == 'd' ? SPEC_DIV : SPEC_MOD, 0, number);
+        }
+        else if (!strncmp(step, "==", 2))
+        {
+            number = strtol(step + 2, &end, 0);
+            if (*end != '\0' || end == step + 2)
+            {
+                spec_error(spec, what, expression, step);
+            }
+            spec_emit(program, spec, SPEC_EQUAL, 0, number);
+        }
+        else
+        {
+            spec_error(spec, what, expression, step);
         }
+    }
+    if (!loaded)
+    {
+        spec_error(spec, what, expression, "does not start with a load");
+    }
+    if (want_real && !real)
+    {
+        spec_emit(program, spec, SPEC_REAL, 0, 0);
+    }
+    else if (!want_real && real)
+    {
+        spec_emit(program, spec, SPEC_ROUND, 0, 0);
+    }
+}
+
+// compile a spec from the configuration into its program and decoder
+const ble_decoder_t *spec_compile(const decoder_spec_config_t *spec, spec_program_t *program)
+{
+    static const char *names[DECODER_SPEC_FIELDS] = {"temperature", "humidity", "battery_pct", "battery_mv", "frame"};
+    static const uint32_t bits[DECODER_SPEC_FIELDS] = {READING_TEMPERATURE, READING_HUMIDITY, READING_BATTERY_PCT, READING_BATTERY_MV, READING_FRAME};
+    static const int stores[DECODER_SPEC_FIELDS] = {SPEC_STORE_TEMPERATURE, SPEC_STORE_HUMIDITY, SPEC_STORE_BATTERY_PCT, SPEC_STORE_BATTERY_MV, SPEC_STORE_FRAME};
+    int n;
+
+    memset(program, 0, sizeof(*program));
+    if ((spec->manufacturer < 0) == (spec->service < 0) || spec->manufacturer > 0xffff || spec->service > 0xffff)
+    {
+        fprintf(stderr, "Decoder spec type %d needs either a manufacturer or a service id\n", spec->type);
+        exit(1);
+    }
+    if (spec->min_length < 0 || spec->min_length > 255 || (spec->max_length > 0 && spec->max_length < spec->min_length))
+    {
+        fprintf(stderr, "Decoder spec type %d has a bad min_length or max_length\n", spec->type);
+        exit(1);
+    }
+    if (spec->fields[0][0] == '\0')
+    {
+        fprintf(stderr, "Decoder spec type %d has no temperature\n", spec->type);
+        exit(1);
+    }
+    program->event_type = spec->event_type;
+    program->manufacturer = spec->manufacturer;
+    program->service = spec->service;
+    program->min_length = spec->min_length;
+    program->max_length = spec->max_length;
 
-        if (map_seq > MAX_SENSORS)
+    if (spec->require[0] != '\0')
+    {
+        spec_compile_expression(program, spec, "require", spec->require, false);
+        spec_emit(program, spec, SPEC_TEST, 0, 0);
+    }
+    spec_emit(program, spec, SPEC_END, 0, 0);
+
+    program->decode_start = program->code_count;
+    for (n = 0; n < DECODER_SPEC_FIELDS; n++)
+    {
+        if (spec->fields[n][0] != '\0')
         {
-            break;
+            spec_compile_expression(program, spec, names[n], spec->fields[n], n < 2);
+            spec_emit(program, spec, stores[n], 0, 0);
+            program->fields |= bits[n];
         }
+    }
+    spec_emit(program, spec, SPEC_END, 0, 0);
 
-    } while (event.type != YAML_STREAM_END_EVENT);
+    // Home Assistant entities from the fields given, unless listed
+    if (spec->entities[0] != '\0')
+    {
+        snprintf(program->entities, sizeof(program->entities), "%s", spec->entities);
+    }
+    else
+    {
+        snprintf(program->entities, sizeof(program->entities), "FT%s%s%sS", (program->fields & READING_HUMIDITY) ? "H" : "",
+                 (program->fields & READING_BATTERY_PCT) ? "B" : "", (program->fields & READING_BATTERY_MV) ? "V" : "");
+    }
 
-    clean_prs(fp, &parser, &event); /* clean parser & close file */
+    program->decoder.abi_version = BLE_DECODER_ABI_VERSION;
+    program->decoder.type = spec->type;
+    program->decoder.make = spec->make;
+    program->decoder.model = spec->model;
+    program->decoder.entities = program->entities;
+    program->decoder.match = spec_match;
+    program->decoder.decode = spec_decode;
+    program->decoder.context = program;
+    return &program->decoder;
+}
 
-    return map_seq;
+void decoder_add(const ble_decoder_t *decoder, const char *source)
+{
+    int n;
+
+    if (decoder->abi_version != BLE_DECODER_ABI_VERSION)
+    {
+        fprintf(stderr, "Decoder for type %d in %s was built for interface version %d, not %d, not loaded\n",
+                decoder->type, source, decoder->abi_version, BLE_DECODER_ABI_VERSION);
+        return;
+    }
+    for (n = 0; n < decoder_count; n++)
+    {
+        if (decoders[n]->type == decoder->type)
+        {
+            fprintf(stderr, "Decoder for type %d in %s, the type already has a decoder\n", decoder->type, source);
+            exit(1);
+        }
+    }
+    if (decoder->type == 99 || decoder->match == NULL || decoder->decode == NULL || decoder_count == MAX_DECODERS)
+    {
+        fprintf(stderr, "Decoder for type %d in %s not loaded\n", decoder->type, source);
+        return;
+    }
+    decoders[decoder_count++] = decoder;
+    fprintf(stdout, "Decoder type %d : %s %s, %s\n", decoder->type, decoder->make, decoder->model, source);
 }
 
-void event_switch(bool *seq_status, unsigned int *map_seq, config_t *config,
-                  yaml_parser_t *parser, yaml_event_t *event, FILE *fp)
+// load the decoders of every shared object in the directory, they stay loaded until the program ends
+void decoder_load_directory(const char *directory)
 {
-    switch (event->type)
+    char path[PATH_MAX];
+    struct dirent *entry;
+    const ble_decoder_t *table;
+    ble_decoders_function_t function;
+    void *library;
+    size_t length;
+    int count;
+    int n;
+    DIR *dir = opendir(directory);
+
+    if (dir == NULL)
+    {
+        if (errno != ENOENT)
+        {
+            fprintf(stderr, "Could not open decoder directory %s: %s\n", directory, strerror(errno));
+        }
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        length = strlen(entry->d_name);
+        if (length < 4 || strcmp(entry->d_name + length - 3, ".so") != 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (library == NULL)
+        {
+            fprintf(stderr, "Could not load decoder %s\n", dlerror());
+            continue;
+        }
+        function = (ble_decoders_function_t)dlsym(library, BLE_DECODERS_SYMBOL);
+        if (function == NULL)
+        {
+            fprintf(stderr, "Decoder %s has no %s function\n", path, BLE_DECODERS_SYMBOL);
+            dlclose(library);
+            continue;
+        }
+        count = function(&table);
+        for (n = 0; n < count; n++)
+        {
+            decoder_add(&table[n], path);
+        }
+    }
+    closedir(dir);
+}
+
+// register the decoders and give each sensor the one for its type
+void decoder_init(config_t *config, int sensor_count)
+{
+    sensor_t *sensor;
+    size_t d;
+    int n;
+
+    for (d = 0; d < sizeof(builtin_decoders) / sizeof(builtin_decoders[0]); d++)
+    {
+        decoder_add(&builtin_decoders[d], "built in");
+    }
+    for (n = 0; n < config->decoder_spec_count; n++)
+    {
+        decoder_add(spec_compile(&config->decoder_specs[n], &spec_programs[n]), "decoder_specs");
+    }
+    if (config->decoder_directory[0] != '\0')
+    {
+        decoder_load_directory(config->decoder_directory);
+    }
+
+    for (n = 0; n < sensor_count; n++)
+    {
+        sensor = &config->sensors[n];
+        sensor_hot[n].type = sensor->type;
+        sensor_hot[n].decoder = NULL;
+        for (d = 0; d < (size_t)decoder_count; d++)
+        {
+            if (decoders[d]->type == sensor->type)
+            {
+                sensor_hot[n].decoder = decoders[d];
+            }
+        }
+        // the decoders stay loaded until the program ends
+        if (sensor_hot[n].decoder != NULL)
+        {
+            sensor->make = sensor_hot[n].decoder->make;
+            sensor->model = sensor_hot[n].decoder->model;
+        }
+        else
+        {
+            sensor->make = "";
+            sensor->model = "";
+            if (sensor->type != 99)
+            {
+                fprintf(stderr, "No decoder for sensor %s type %d, it is ignored\n", sensor->mac, sensor->type);
+            }
+        }
+    }
+}
+
+// encrypted advertisements
+// sensors with a bindkey encrypt the values of their reports with AES-CCM: BTHome v2 with the device information
+// bit 0 set, and MiBeacon version 4 and 5 with the encrypted bit of the frame control. each sensor gets an AES
+// context at startup with the key schedule done, and the nonce filled in as far as it is fixed. CCM is done here on
+// that context rather than with OpenSSL's CCM mode, which sets itself up again for every message and costs many
+// times the AES itself on a report of a few bytes. a report costs the counter check, one call for the counter
+// blocks and one per block of the CBC-MAC, without allocating. the decrypted report is put back together in a
+// buffer of the scan loop, with the encrypted bit cleared, and goes to the sensor's decoder like a report that was
+// never encrypted.
+// a report whose counter is not past the last one accepted is a repeat of the same advertisement or a replay and is
+// dropped, unless the sensor has been quiet for CRYPTO_RESTART_SECONDS, when it may have restarted with a new count
+#define CRYPTO_RESTART_SECONDS 300
+#define CRYPTO_MAX_DATA 64
+#define CRYPTO_TAG_SIZE 4
+
+typedef struct sensor_crypto
+{
+    EVP_CIPHER_CTX *ctx; // AES-128 with the key schedule of the bindkey, NULL when the sensor has no bindkey
+    uint16_t uuid;       // service data the encrypted reports are in
+    int nonce_length;    // 13 for BTHome, 12 for MiBeacon
+    uint8_t nonce[13];   // the fixed part filled in at startup
+    uint32_t counter;    // of the last report accepted
+    bool counter_valid;
+    time_t accepted;
+    uint32_t repeats; // since the last hourly report
+    uint32_t failed;
+} sensor_crypto_t;
+
+sensor_crypto_t sensor_crypto[MAX_SENSORS];
+int crypto_sensor_count = 0;
+
+// the cipher context for the key, the nonce starts with the mac address in the order of the format
+// false if the key is not 32 hex digits
+bool crypto_setup(sensor_crypto_t *c, const char *bindkey, const bdaddr_t *bdaddr, uint16_t uuid)
+{
+    uint8_t key[16];
+    unsigned int byte;
+    int i;
+
+    if (strlen(bindkey) != 2 * sizeof(key) || strspn(bindkey, "0123456789abcdefABCDEF") != 2 * sizeof(key))
+    {
+        return false;
+    }
+    for (i = 0; i < (int)sizeof(key); i++)
+    {
+        sscanf(bindkey + 2 * i, "%2x", &byte);
+        key[i] = byte;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->uuid = uuid;
+    c->nonce_length = uuid == 0xFCD2 ? 13 : 12;
+    for (i = 0; i < 6; i++)
+    {
+        // BTHome: the address as written, then the uuid. MiBeacon: the address as sent, lowest byte first
+        c->nonce[i] = uuid == 0xFCD2 ? bdaddr->b[5 - i] : bdaddr->b[i];
+    }
+    c->nonce[6] = 0xD2;
+    c->nonce[7] = 0xFC;
+    if ((c->ctx = EVP_CIPHER_CTX_new()) == NULL || EVP_EncryptInit_ex(c->ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1 ||
+        EVP_CIPHER_CTX_set_padding(c->ctx, 0) != 1)
+    {
+        fprintf(stderr, "Could not set up AES\n");
+        exit(1);
+    }
+    memset(key, 0, sizeof(key));
+    return true;
+}
+
+// AES-CCM (RFC 3610) with a 4 byte tag and the sensor's nonce, at most 14 bytes of additional data
+// decrypts length bytes of in to out, false if the tag does not match
+bool crypto_ccm_decrypt(sensor_crypto_t *c, const uint8_t *aad, int aad_length, const uint8_t *in, int length,
+                        const uint8_t *tag, uint8_t *out)
+{
+    uint8_t counters[CRYPTO_MAX_DATA + 16];
+    uint8_t block[16];
+    uint8_t difference = 0;
+    int size = 15 - c->nonce_length; // of the length and counter fields
+    int blocks = (length + 15) / 16;
+    int position;
+    int n;
+    int i;
+
+    // the counter blocks A0 ... Am encrypted in one call, A0 for the tag and the rest for the payload
+    for (n = 0; n <= blocks; n++)
+    {
+        counters[16 * n] = size - 1;
+        memcpy(counters + 16 * n + 1, c->nonce, c->nonce_length);
+        memset(counters + 16 * n + 1 + c->nonce_length, 0, size);
+        counters[16 * n + 15] = n;
+    }
+    if (EVP_EncryptUpdate(c->ctx, counters, &n, counters, 16 * (blocks + 1)) != 1)
+    {
+        return false;
+    }
+    for (i = 0; i < length; i++)
+    {
+        out[i] = in[i] ^ counters[16 + i];
+    }
+
+    // CBC-MAC of B0 (flags, nonce, length), the additional data after its length, then the payload
+    block[0] = (aad_length > 0 ? 0x40 : 0) | ((CRYPTO_TAG_SIZE - 2) / 2) << 3 | (size - 1);
+    memcpy(block + 1, c->nonce, c->nonce_length);
+    memset(block + 1 + c->nonce_length, 0, size);
+    block[14] = length >> 8;
+    block[15] = length;
+    if (EVP_EncryptUpdate(c->ctx, block, &n, block, 16) != 1)
+    {
+        return false;
+    }
+    if (aad_length > 0)
+    {
+        block[1] ^= aad_length;
+        for (i = 0; i < aad_length; i++)
+        {
+            block[2 + i] ^= aad[i];
+        }
+        if (EVP_EncryptUpdate(c->ctx, block, &n, block, 16) != 1)
+        {
+            return false;
+        }
+    }
+    for (position = 0; position < length; position += 16)
+    {
+        for (i = 0; i < 16 && position + i < length; i++)
+        {
+            block[i] ^= out[position + i];
+        }
+        if (EVP_EncryptUpdate(c->ctx, block, &n, block, 16) != 1)
+        {
+            return false;
+        }
+    }
+
+    // compared without returning early, so the time taken does not tell how much of a forged tag was right
+    for (i = 0; i < CRYPTO_TAG_SIZE; i++)
+    {
+        difference |= block[i] ^ counters[i] ^ tag[i];
+    }
+    return difference == 0;
+}
+
+// a context for every sensor with a bindkey, after decoder_init. the format follows from the sensor's type
+void crypto_init(config_t *config, int sensor_count)
+{
+    sensor_t *sensor;
+    bdaddr_t bdaddr;
+    uint16_t uuid;
+    int n;
+
+    crypto_sensor_count = sensor_count;
+    for (n = 0; n < sensor_count; n++)
+    {
+        sensor = &config->sensors[n];
+        memset(&sensor_crypto[n], 0, sizeof(sensor_crypto[n]));
+        if (sensor->bindkey[0] == '\0')
+        {
+            continue;
+        }
+        if (sensor->type == 7)
+        {
+            uuid = 0xFCD2;
+        }
+        else if (sensor->type == 8)
+        {
+            uuid = 0xFE95;
+        }
+        else
+        {
+            fprintf(stderr, "Sensor %s has a bindkey, only BTHome (type 7) and MiBeacon (type 8) sensors are decrypted\n", sensor->mac);
+            exit(1);
+        }
+        str2ba(sensor->mac, &bdaddr);
+        if (!crypto_setup(&sensor_crypto[n], sensor->bindkey, &bdaddr, uuid))
+        {
+            fprintf(stderr, "The bindkey of sensor %s is not 32 hex digits\n", sensor->mac);
+            exit(1);
+        }
+        sensor_hot[n].crypto = &sensor_crypto[n];
+    }
+}
+
+// decrypt the report in place of its service data view, into plain
+// returns false if the report is to be dropped: encrypted with another key, tampered with or cut short, a repeat,
+// or sent in the clear by a sensor that should encrypt
+bool crypto_decrypt(sensor_crypto_t *c, ad_report_t *report, uint8_t *plain)
+{
+    ad_view_t *view = NULL;
+    const uint8_t *d;
+    uint8_t aad = 0x11;
+    uint32_t counter;
+    time_t now;
+    int start;
+    int end;
+    int n;
+
+    for (n = 0; n < report->service_count; n++)
+    {
+        if (report->service[n].id == c->uuid)
+        {
+            view = &report->service[n];
+        }
+    }
+    if (view == NULL)
+    {
+        // nothing from this format, e.g. a scan response with the name
+        return true;
+    }
+    d = view->data;
+
+    if (c->uuid == 0xFCD2)
+    {
+        // device information, the objects, a 4 byte counter and the tag
+        if (view->length < 1 || !(d[0] & 0x01))
+        {
+            return false;
+        }
+        start = 1;
+        end = view->length - 4 - CRYPTO_TAG_SIZE;
+        if (end < start)
+        {
+            return false;
+        }
+        counter = d[end] | d[end + 1] << 8 | d[end + 2] << 16 | (uint32_t)d[end + 3] << 24;
+        c->nonce[8] = d[0];
+        memcpy(c->nonce + 9, d + end, 4);
+    }
+    else
+    {
+        // frame control, product id, frame counter ... the objects, a 3 byte counter and the tag. frames without
+        // objects are sent in the clear, those are left for the decoder to ignore
+        if (view->length < 5 || !(d[0] & MIBEACON_OBJECTS))
+        {
+            return true;
+        }
+        if (!(d[0] & MIBEACON_ENCRYPTED) || (d[1] >> 4) < 4 || (start = mibeacon_objects(d, view->length)) < 0)
+        {
+            return false;
+        }
+        end = view->length - 3 - CRYPTO_TAG_SIZE;
+        if (end < start)
+        {
+            return false;
+        }
+        counter = d[4] | d[end] << 8 | d[end + 1] << 16 | (uint32_t)d[end + 2] << 24;
+        memcpy(c->nonce + 6, d + 2, 3);
+        memcpy(c->nonce + 9, d + end, 3);
+    }
+    if (view->length > CRYPTO_MAX_DATA)
+    {
+        return false;
+    }
+
+    time(&now);
+    if (c->counter_valid && counter <= c->counter && now - c->accepted < CRYPTO_RESTART_SECONDS)
+    {
+        c->repeats++;
+        return false;
+    }
+
+    if (!crypto_ccm_decrypt(c, &aad, c->uuid == 0xFE95 ? 1 : 0, d + start, end - start, d + view->length - CRYPTO_TAG_SIZE,
+                            plain + start))
+    {
+        c->failed++;
+        return false;
+    }
+    memcpy(plain, d, start);
+    if (c->uuid == 0xFCD2)
+    {
+        plain[0] &= ~0x01;
+    }
+    else
+    {
+        plain[0] &= ~MIBEACON_ENCRYPTED;
+    }
+    c->counter = counter;
+    c->counter_valid = true;
+    c->accepted = now;
+    view->data = plain;
+    view->length = end;
+    return true;
+}
+
+// reports dropped for each sensor with a bindkey for the hourly statistics, and start counting again
+// returns the number of reports that did not decrypt
+int crypto_report(config_t *config, char *buffer, int size)
+{
+    uint32_t failed = 0;
+    uint32_t repeats = 0;
+    bool keyed = false;
+    int n;
+
+    for (n = 0; n < crypto_sensor_count; n++)
+    {
+        if (sensor_crypto[n].ctx == NULL)
+        {
+            continue;
+        }
+        keyed = true;
+        if (sensor_crypto[n].failed > 0 && !sensor_crypto[n].counter_valid)
+        {
+            log_syslog(LOG_WARNING, "Sensor %s: no encrypted report has decrypted, check its bindkey", config->sensors[n].mac);
+        }
+        failed += sensor_crypto[n].failed;
+        repeats += sensor_crypto[n].repeats;
+        sensor_crypto[n].failed = 0;
+        sensor_crypto[n].repeats = 0;
+    }
+    if (!keyed)
+    {
+        buffer[0] = '\0';
+        return 0;
+    }
+    snprintf(buffer, size, ", \"decrypt_failed\":%u, \"decrypt_repeats\":%u", failed, repeats);
+    return failed;
+}
+
+#ifdef DECODER_BENCH
+// ble_decoder_bench, built from this file by make ble_decoder_bench so none of it is in the daemon
+// the built in decoders against decoder specs describing the same sensors, on the same random reports. the readings
+// of both must be the same, then each is timed matching and decoding all of the reports. the ATC decoder is given
+// only ATC format reports, the spec does not describe the pvvx format
+#define BENCH_REPORTS 4096
+#define BENCH_ROUNDS 500
+
+const decoder_spec_config_t bench_specs[] =
+    {
+        {1, "Xiaomi", "LYWSD03MMC-ATC", "", 0, -1, 0x181A, 13, 14, "", {"s16be@6 /10", "u8@8", "u8@9", "u16be@10", "u8@12"}},
+        {2, "Govee", "H5052", "", 4, 0xEC88, -1, 6, 0, "", {"s16le@1 /100", "u16le@3 /100", "s8@5", "", ""}},
+        {3, "Govee", "H5072", "", 0, 0xEC88, -1, 5, 0, "", {"u24be@1 sign:23 div:10000", "u24be@1 &0x7fffff mod:1000 div:10", "s8@4", "", ""}},
+        {4, "Govee", "H5102", "", 0, 0x0001, -1, 6, 0, "", {"u24be@2 sign:23 div:10000", "u24be@2 &0x7fffff mod:1000 div:10", "s8@5", "", ""}},
+        {5, "Govee", "H5075", "", 0, 0xEC88, -1, 5, 0, "", {"u24be@1 sign:23 div:1000 /10", "u24be@1 &0x7fffff mod:1000 /10", "s8@4", "", ""}},
+        {6, "Govee", "H5074", "", 4, 0xEC88, -1, 7, 7, "", {"s16le@1 /100", "u16le@3 /100", "s8@5", "", ""}}};
+
+bool bench_same(const reading_t *a, const reading_t *b)
+{
+    return a->fields == b->fields && a->temperature_celsius == b->temperature_celsius && a->humidity == b->humidity &&
+           a->battery_pct == b->battery_pct && (!(a->fields & READING_BATTERY_MV) || a->battery_mv == b->battery_mv) &&
+           (!(a->fields & READING_FRAME) || a->frame == b->frame);
+}
+
+// nanoseconds per report to match and decode all of the reports BENCH_ROUNDS times
+double bench_time(const ble_decoder_t *decoder, const ad_report_t *reports)
+{
+    struct timespec start;
+    struct timespec end;
+    reading_t reading;
+    volatile double sink = 0;
+    double sum = 0;
+    int round;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (n = 0; n < BENCH_REPORTS; n++)
+        {
+            reading.value_count = 0;
+            if (decoder->match(decoder, &reports[n]) && decoder->decode(decoder, &reports[n], &reading))
+            {
+                sum += reading.temperature_celsius + reading.humidity + reading.battery_pct + reading.value_count;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sink = sum;
+    (void)sink;
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double)BENCH_ROUNDS * BENCH_REPORTS);
+}
+
+// BTHome v2 reports from the examples of the format, the values they must decode to, then the time per report for a
+// few kinds of device, and for random objects to time the checks of reports that end early
+typedef struct
+{
+    const char *name;
+    int length;
+    uint8_t data[16];
+    uint32_t fields;
+    double temperature_celsius;
+    double humidity;
+    int battery_pct;
+    int battery_mv;
+    int frame;
+    int value_count;
+    double value;
+} bench_bthome_t;
+
+const bench_bthome_t bench_bthome_reports[] =
+    {
+        {"temperature, humidity", 7, {0x40, 0x02, 0xCA, 0x09, 0x03, 0xBF, 0x13}, READING_TEMPERATURE | READING_HUMIDITY, 25.06, 50.55, 0, 0, 0, 0, 0},
+        {"pvvx", 14, {0x40, 0x00, 0x9D, 0x01, 0x64, 0x02, 0x6E, 0x08, 0x03, 0x4C, 0x15, 0x0C, 0x1C, 0x0B}, READING_TEMPERATURE | READING_HUMIDITY | READING_BATTERY_PCT | READING_BATTERY_MV | READING_FRAME, 21.58, 54.52, 100, 2844, 157, 0, 0},
+        {"Shelly BLU Button", 7, {0x44, 0x00, 0x05, 0x01, 0x5F, 0x3A, 0x01}, READING_BATTERY_PCT | READING_FRAME, 0, 0, 95, 0, 5, 1, 1},
+        {"temperature 0.1", 4, {0x40, 0x45, 0x11, 0x01}, READING_TEMPERATURE, 27.3, 0, 0, 0, 0, 0, 0},
+        {"negative dewpoint", 4, {0x40, 0x08, 0x18, 0xFC}, 0, 0, 0, 0, 0, 0, 1, -10.0},
+        {"unknown id", 6, {0x40, 0x02, 0xCA, 0x09, 0xFE, 0x01}, READING_TEMPERATURE, 25.06, 0, 0, 0, 0, 0, 0},
+        {"cut short", 3, {0x40, 0x02, 0xCA}, 0, 0, 0, 0, 0, 0, 0, 0}};
+
+int bench_bthome(ad_report_t *reports)
+{
+    uint8_t (*data)[24] = malloc(BENCH_REPORTS * sizeof(*data));
+    // the device information and object ids of each kind of report, the values are random. no ids = random objects
+    static const struct
+    {
+        const char *name;
+        uint8_t information;
+        int count;
+        uint8_t ids[8];
+    } kinds[] = {{"pvvx", 0x40, 5, {0x00, 0x01, 0x02, 0x03, 0x0C}},
+                 {"Shelly BLU Button", 0x44, 3, {0x00, 0x01, 0x3A}},
+                 {"weather station", 0x40, 7, {0x00, 0x01, 0x02, 0x03, 0x04, 0x12, 0x21}},
+                 {"random objects", 0x40, 0, {0}}};
+    const ble_decoder_t *decoder = builtin_decoder(7);
+    const bench_bthome_t *b;
+    ad_report_t report;
+    reading_t reading;
+    uint32_t random = 88172645u;
+    int mismatches = 0;
+    size_t k;
+    int length;
+    int n;
+    int i;
+
+    if (data == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    for (k = 0; k < sizeof(bench_bthome_reports) / sizeof(bench_bthome_reports[0]); k++)
+    {
+        b = &bench_bthome_reports[k];
+        memset(&report, 0, sizeof(report));
+        report.service_count = 1;
+        report.service[0] = (ad_view_t){0xFCD2, b->data, b->length};
+        memset(&reading, 0, sizeof(reading));
+        if (!decoder->match(decoder, &report) || decoder->decode(decoder, &report, &reading) != (b->fields != 0 || b->value_count != 0) ||
+            reading.fields != b->fields || fabs(reading.temperature_celsius - b->temperature_celsius) > 1e-9 ||
+            fabs(reading.humidity - b->humidity) > 1e-9 || reading.battery_pct != b->battery_pct ||
+            reading.battery_mv != b->battery_mv || reading.frame != b->frame || reading.value_count != b->value_count ||
+            (b->value_count > 0 && fabs(reading.values[0].value - b->value) > 1e-9))
+        {
+            printf("BTHome %s: decoded %.2f C %.2f %% %d %% %d mV frame %d, %d values\n", b->name, reading.temperature_celsius,
+                   reading.humidity, reading.battery_pct, reading.battery_mv, reading.frame, reading.value_count);
+            mismatches++;
+        }
+    }
+
+    printf("BTHome v2 report      bytes     ns\n");
+    for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        for (n = 0; n < BENCH_REPORTS; n++)
+        {
+            for (i = 0; i < (int)sizeof(data[n]); i++)
+            {
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                data[n][i] = random;
+            }
+            data[n][0] = kinds[k].information;
+            length = kinds[k].count > 0 ? 1 : sizeof(data[n]);
+            for (i = 0; i < kinds[k].count; i++)
+            {
+                data[n][length] = kinds[k].ids[i];
+                length += 1 + bthome_objects[kinds[k].ids[i]].length;
+            }
+            memset(&reports[n], 0, sizeof(reports[n]));
+            reports[n].service_count = 1;
+            reports[n].service[0] = (ad_view_t){0xFCD2, data[n], length};
+        }
+        printf("%-20s %6d  %5.1f\n", kinds[k].name, length, bench_time(decoder, reports));
+    }
+    free(data);
+    return mismatches;
+}
+
+// encrypted reports: the encrypted example of the BTHome format must decrypt to its values, a MiBeacon report
+// encrypted here must decrypt to what went in, a report with a changed byte must fail and a repeat be dropped. then
+// the time per report to decrypt and decode, each report with a new counter
+void bench_encrypt(const uint8_t *key, const uint8_t *nonce, int nonce_length, bool aad, uint8_t *data, int start, int end)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    uint8_t header = 0x11;
+    int n;
+
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_ccm(), NULL, NULL, NULL);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_IVLEN, nonce_length, NULL);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG, CRYPTO_TAG_SIZE, NULL);
+    EVP_EncryptInit_ex(ctx, NULL, NULL, key, nonce);
+    EVP_EncryptUpdate(ctx, NULL, &n, NULL, end - start);
+    if (aad)
+    {
+        EVP_EncryptUpdate(ctx, NULL, &n, &header, 1);
+    }
+    EVP_EncryptUpdate(ctx, data + start, &n, data + start, end - start);
+    EVP_EncryptFinal_ex(ctx, data + end, &n);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_GET_TAG, CRYPTO_TAG_SIZE, data + end + (nonce_length == 13 ? 4 : 3));
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+int bench_crypto(ad_report_t *reports)
+{
+    uint8_t (*data)[BENCH_REPORTS][32] = malloc(2 * sizeof(*data));
+    static const char *key_hex = "231d39c1d7cc1ab1aee224cd096db932";
+    static const uint8_t key[16] = {0x23, 0x1d, 0x39, 0xc1, 0xd7, 0xcc, 0x1a, 0xb1, 0xae, 0xe2, 0x24, 0xcd, 0x09, 0x6d, 0xb9, 0x32};
+    static const uint8_t example[] = {0x41, 0xa4, 0x72, 0x66, 0xc9, 0x5f, 0x73, 0x00, 0x11, 0x22, 0x33, 0x78, 0x23, 0x72, 0x14};
+    // pvvx objects in BTHome, temperature alone in MiBeacon
+    static const uint8_t bthome_plain[] = {0x41, 0x00, 0x9D, 0x01, 0x64, 0x02, 0x6E, 0x08, 0x03, 0x4C, 0x15, 0x0C, 0x1C, 0x0B};
+    static const uint8_t mibeacon_plain[] = {0x58, 0x58, 0x5B, 0x05, 0x00, 0xA5, 0x80, 0x8F, 0xE6, 0x48, 0x54, 0x04, 0x10, 0x02, 0xD6, 0x00};
+    const ble_decoder_t *decoder;
+    const uint8_t *plain;
+    sensor_crypto_t c;
+    bdaddr_t bdaddr;
+    ad_report_t report;
+    reading_t reading;
+    uint8_t decrypted[CRYPTO_MAX_DATA];
+    uint8_t changed[CRYPTO_MAX_DATA];
+    uint8_t nonce[13];
+    struct timespec start;
+    struct timespec end;
+    volatile double sink = 0;
+    double sum = 0;
+    int mismatches = 0;
+    int format;
+    int first;
+    int length;
+    int round;
+    int n;
+    int i;
+
+    if (data == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    str2ba("54:48:E6:8F:80:A5", &bdaddr);
+    crypto_setup(&c, key_hex, &bdaddr, 0xFCD2);
+    memset(&report, 0, sizeof(report));
+    report.service_count = 1;
+    report.service[0] = (ad_view_t){0xFCD2, example, sizeof(example)};
+    reading.value_count = 0;
+    if (!crypto_decrypt(&c, &report, decrypted) || !bthome_decode(NULL, &report, &reading) ||
+        fabs(reading.temperature_celsius - 25.06) > 1e-9 || fabs(reading.humidity - 50.55) > 1e-9)
+    {
+        printf("BTHome encrypted example did not decrypt\n");
+        mismatches++;
+    }
+    report.service[0] = (ad_view_t){0xFCD2, example, sizeof(example)};
+    if (crypto_decrypt(&c, &report, decrypted) || c.repeats != 1)
+    {
+        printf("BTHome encrypted example repeated was not dropped\n");
+        mismatches++;
+    }
+    EVP_CIPHER_CTX_free(c.ctx);
+
+    printf("encrypted report      bytes     ns\n");
+    for (format = 0; format < 2; format++)
+    {
+        plain = format == 0 ? bthome_plain : mibeacon_plain;
+        length = format == 0 ? sizeof(bthome_plain) : sizeof(mibeacon_plain);
+        first = format == 0 ? 1 : 11;
+        decoder = builtin_decoder(format == 0 ? 7 : 8);
+        crypto_setup(&c, key_hex, &bdaddr, format == 0 ? 0xFCD2 : 0xFE95);
+
+        // a new counter for each report, the nonce built here the way the formats describe it
+        for (n = 0; n < BENCH_REPORTS; n++)
+        {
+            memcpy(data[format][n], plain, length);
+            memset(&reports[n], 0, sizeof(reports[n]));
+            reports[n].service_count = 1;
+            if (format == 0)
+            {
+                for (i = 0; i < 4; i++)
+                {
+                    data[0][n][length + i] = (n + 1) >> (8 * i);
+                }
+                for (i = 0; i < 6; i++)
+                {
+                    nonce[i] = bdaddr.b[5 - i];
+                }
+                nonce[6] = 0xD2;
+                nonce[7] = 0xFC;
+                nonce[8] = plain[0];
+                memcpy(nonce + 9, data[0][n] + length, 4);
+                bench_encrypt(key, nonce, 13, false, data[0][n], first, length);
+                reports[n].service[0] = (ad_view_t){0xFCD2, data[0][n], length + 8};
+            }
+            else
+            {
+                data[1][n][4] = n + 1;
+                data[1][n][length] = (n + 1) >> 8;
+                data[1][n][length + 1] = 0;
+                data[1][n][length + 2] = 0;
+                memcpy(nonce, bdaddr.b, 6);
+                memcpy(nonce + 6, data[1][n] + 2, 3);
+                memcpy(nonce + 9, data[1][n] + length, 3);
+                bench_encrypt(key, nonce, 12, true, data[1][n], first, length);
+                reports[n].service[0] = (ad_view_t){0xFE95, data[1][n], length + 7};
+            }
+        }
+
+        for (n = 0; n < BENCH_REPORTS; n++)
+        {
+            report = reports[n];
+            reading.value_count = 0;
+            if (!crypto_decrypt(&c, &report, decrypted) || memcmp(decrypted + first, plain + first, length - first) != 0 ||
+                !decoder->match(decoder, &report) || !decoder->decode(decoder, &report, &reading))
+            {
+                if (mismatches++ == 0)
+                {
+                    printf("%s report %d did not decrypt\n", decoder->model, n);
+                }
+            }
+        }
+        report = reports[0];
+        c.counter_valid = false;
+        memcpy(changed, report.service[0].data, report.service[0].length);
+        changed[first] ^= 0x01;
+        report.service[0].data = changed;
+        if (crypto_decrypt(&c, &report, decrypted) || c.failed != 1)
+        {
+            printf("%s report with a changed byte was not dropped\n", decoder->model);
+            mismatches++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (round = 0; round < BENCH_ROUNDS; round++)
+        {
+            c.counter_valid = false;
+            for (n = 0; n < BENCH_REPORTS; n++)
+            {
+                report = reports[n];
+                reading.value_count = 0;
+                if (crypto_decrypt(&c, &report, decrypted) && decoder->match(decoder, &report) &&
+                    decoder->decode(decoder, &report, &reading))
+                {
+                    sum += reading.temperature_celsius;
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%-20s %6d  %5.1f\n", format == 0 ? "BTHome v2" : "MiBeacon v5", reports[0].service[0].length,
+               ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double)BENCH_ROUNDS * BENCH_REPORTS));
+        EVP_CIPHER_CTX_free(c.ctx);
+    }
+    sink = sum;
+    (void)sink;
+    free(data);
+    return mismatches;
+}
+
+int decoder_bench(void)
+{
+    // about 1 MB of reports, on the heap and shared by the three parts
+    ad_report_t *reports = malloc(BENCH_REPORTS * sizeof(ad_report_t));
+    uint8_t (*data)[16] = malloc(BENCH_REPORTS * sizeof(*data));
+    spec_program_t program;
+    const decoder_spec_config_t *spec;
+    const ble_decoder_t *builtin;
+    const ble_decoder_t *compiled;
+    reading_t expected;
+    reading_t got;
+    uint32_t random = 2463534242u;
+    double builtin_ns;
+    double spec_ns;
+    int mismatches = 0;
+    size_t b;
+    int n;
+    int i;
+
+    if (reports == NULL || data == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    // no per packet debug output while timing
+    logging_level = LOG_INFO;
+    printf("type model             code  built in ns  spec ns  ratio\n");
+    for (b = 0; b < sizeof(bench_specs) / sizeof(bench_specs[0]); b++)
+    {
+        spec = &bench_specs[b];
+        builtin = builtin_decoder(spec->type);
+        compiled = spec_compile(spec, &program);
+
+        // random values in reports of the shortest length the sensor sends, with the wrong event type one time in 8
+        for (n = 0; n < BENCH_REPORTS; n++)
+        {
+            for (i = 0; i < (int)sizeof(data[n]); i++)
+            {
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                data[n][i] = random;
+            }
+            memset(&reports[n], 0, sizeof(reports[n]));
+            reports[n].event_type = (random & 0x700) ? spec->event_type : 3;
+            if (spec->manufacturer >= 0)
+            {
+                reports[n].manufacturer_count = 1;
+                reports[n].manufacturer[0] = (ad_view_t){spec->manufacturer, data[n], spec->min_length};
+            }
+            else
+            {
+                reports[n].service_count = 1;
+                reports[n].service[0] = (ad_view_t){spec->service, data[n], spec->min_length};
+            }
+        }
+
+        for (n = 0; n < BENCH_REPORTS; n++)
+        {
+            memset(&expected, 0, sizeof(expected));
+            memset(&got, 0, sizeof(got));
+            if (builtin->match(builtin, &reports[n]) != compiled->match(compiled, &reports[n]) ||
+                (builtin->match(builtin, &reports[n]) &&
+                 (!builtin->decode(builtin, &reports[n], &expected) || !compiled->decode(compiled, &reports[n], &got) ||
+                  !bench_same(&expected, &got))))
+            {
+                if (mismatches++ == 0)
+                {
+                    printf("type %d report %d: built in %.2f C %.2f %% %d %%, spec %.2f C %.2f %% %d %%\n", spec->type, n,
+                           expected.temperature_celsius, expected.humidity, expected.battery_pct,
+                           got.temperature_celsius, got.humidity, got.battery_pct);
+                }
+            }
+        }
+
+        builtin_ns = bench_time(builtin, reports);
+        spec_ns = bench_time(compiled, reports);
+        printf("%4d %-17s %4d  %11.1f  %7.1f  %5.2f\n", spec->type, spec->model, program.code_count, builtin_ns, spec_ns,
+               spec_ns / builtin_ns);
+    }
+    free(data);
+    mismatches += bench_bthome(reports);
+    mismatches += bench_crypto(reports);
+    free(reports);
+    if (mismatches > 0)
+    {
+        printf("%d reports decoded differently\n", mismatches);
+        return 1;
+    }
+    printf("All reports decoded the same\n");
+    return 0;
+}
+#endif
+
+// the JSON state message of a reading, publish_type 1 for Home Assistant, else the legacy format
+// returns the length snprintf style, a value >= size means the message did not fit
+int state_payload(config_t *config, int sensor, const struct tm *tm, const char *addr, int rssi, const reading_t *reading, char *buffer, int size)
+{
+    sensor_t *s = &config->sensors[sensor];
+    double temperature_fahrenheit = reading->temperature_celsius * 9.0 / 5.0 + 32.0;
+    bool legacy = config->publish_type != 1;
+    const reading_value_t *value;
+    int length;
+    int n;
+
+    length = snprintf(buffer, size,
+                      legacy ? "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac-address\":\"%s\",\"rssi\":%d"
+                             : "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"rssi\":%d",
+                      tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec,
+                      addr, rssi);
+    if ((reading->fields & READING_TEMPERATURE) && length < size)
+    {
+        length += snprintf(buffer + length, size - length,
+                           legacy ? ",\"temperature\":%#.1F,\"units\":\"F\",\"temperature-celsius\":%#.1F" : ",\"tempf\":%#.1F,\"units\":\"F\",\"tempc\":%#.1F",
+                           temperature_fahrenheit, reading->temperature_celsius);
+    }
+    if ((reading->fields & READING_HUMIDITY) && length < size)
+    {
+        length += snprintf(buffer + length, size - length, ",\"humidity\":%#.1F", reading->humidity);
+    }
+    if ((reading->fields & READING_BATTERY_PCT) && length < size)
+    {
+        length += snprintf(buffer + length, size - length, legacy ? ",\"battery-pct\":%i" : ",\"batterypct\":%i", reading->battery_pct);
+    }
+    if ((reading->fields & READING_BATTERY_MV) && length < size)
+    {
+        length += snprintf(buffer + length, size - length, legacy ? ",\"battery-mv\":%i" : ",\"batterymv\":%i", reading->battery_mv);
+    }
+    if ((reading->fields & READING_FRAME) && length < size)
+    {
+        length += snprintf(buffer + length, size - length, ",\"frame\":%i", reading->frame);
+    }
+    for (n = 0; n < reading->value_count && length < size; n++)
+    {
+        value = &reading->values[n];
+        if (value->index > 0)
+        {
+            length += snprintf(buffer + length, size - length, ",\"%s%d\":%.*f", value->name, value->index + 1, value->decimals, value->value);
+        }
+        else
+        {
+            length += snprintf(buffer + length, size - length, ",\"%s\":%.*f", value->name, value->decimals, value->value);
+        }
+    }
+    if (length < size)
+    {
+        if (legacy)
+        {
+            length += snprintf(buffer + length, size - length, ",\"sensor-name\":\"%s\",\"location\":\"%s\",\"sensor-type\":\"%d\"}", s->name, s->location, s->type);
+        }
+        else
+        {
+            length += snprintf(buffer + length, size - length, "%s,\"type\":\"%d\"}", state_identity(config, sensor), s->type);
+        }
+    }
+    return length;
+}
+
+// foreign device census
+// advertising packets from devices that are not configured are counted in a small set associative cache keyed by
+// the binary address, each set replaced with the CLOCK algorithm, so the RF noise at a site can be seen without
+// keeping every address ever heard. configured sensors are matched on the binary address too, a foreign packet
+// costs a hash and a few compares instead of ba2str and a strcmp against every sensor
+#define CENSUS_SETS 64
+#define CENSUS_WAYS 4
+#define CENSUS_MAX_TOP 25
+
+typedef struct
+{
+    uint64_t mac; // 48 bit address, bit 48 set when the entry is in use
+    uint32_t hits;
+    int8_t rssi; // last seen
+    bool referenced;
+} census_entry_t;
+
+census_entry_t census[CENSUS_SETS][CENSUS_WAYS];
+uint8_t census_hand[CENSUS_SETS];
+uint32_t census_packets = 0;  // foreign packets since the last report
+uint32_t census_evictions = 0;
+uint64_t sensor_mac_keys[MAX_SENSORS];
+
+#define CENSUS_IN_USE (1ULL << 48)
+
+uint64_t census_key(const bdaddr_t *bdaddr)
+{
+    uint64_t key = 0;
+    int i;
+
+    for (i = 0; i < 6; i++)
+    {
+        key |= (uint64_t)bdaddr->b[i] << (8 * i);
+    }
+    return key | CENSUS_IN_USE;
+}
+
+// binary addresses of the configured sensors
+void census_init(config_t *config, int sensor_count)
+{
+    bdaddr_t bdaddr;
+    int x;
+
+    memset(census, 0, sizeof(census));
+    for (x = 0; x < sensor_count; x++)
+    {
+        str2ba(config->sensors[x].mac, &bdaddr);
+        sensor_mac_keys[x] = census_key(&bdaddr);
+    }
+}
+
+// count a packet from a device that is not configured
+void census_add(uint64_t key, int8_t rssi)
+{
+    census_entry_t *set = census[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+    uint8_t *hand = &census_hand[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+    census_entry_t *e;
+    int w;
+
+    census_packets++;
+    for (w = 0; w < CENSUS_WAYS; w++)
+    {
+        if (set[w].mac == key)
+        {
+            set[w].hits++;
+            set[w].rssi = rssi;
+            set[w].referenced = true;
+            return;
+        }
+    }
+
+    // not in the cache, take a free way or the first one not referenced since the hand last passed it
+    for (;;)
+    {
+        e = &set[*hand];
+        *hand = (*hand + 1) % CENSUS_WAYS;
+        if (e->mac == 0)
+        {
+            break;
+        }
+        if (!e->referenced)
+        {
+            census_evictions++;
+            break;
+        }
+        e->referenced = false;
+    }
+    e->mac = key;
+    e->hits = 1;
+    e->rssi = rssi;
+    e->referenced = false;
+}
+
+// JSON with the number of foreign devices and packets, and the top devices by packets, then start a new period
+int census_report(char *buffer, int size, int top)
+{
+    census_entry_t *best[CENSUS_MAX_TOP];
+    census_entry_t *e;
+    int devices = 0;
+    int count = 0;
+    int length;
+    int i;
+    int j;
+    int set;
+    int w;
+
+    if (top > CENSUS_MAX_TOP)
+    {
+        top = CENSUS_MAX_TOP;
+    }
+
+    // keep the top entries sorted by hits, insertion into a short list
+    for (set = 0; set < CENSUS_SETS; set++)
+    {
+        for (w = 0; w < CENSUS_WAYS; w++)
+        {
+            e = &census[set][w];
+            if (e->mac == 0)
+            {
+                continue;
+            }
+            devices++;
+            for (i = count; i > 0 && best[i - 1]->hits < e->hits; i--)
+            {
+                if (i < top)
+                {
+                    best[i] = best[i - 1];
+                }
+            }
+            if (i < top)
+            {
+                best[i] = e;
+                if (count < top)
+                {
+                    count++;
+                }
+            }
+        }
+    }
+
+    length = snprintf(buffer, size, "{\"devices\":%d,\"packets\":%u,\"evicted\":%u,\"top\":[", devices, census_packets, census_evictions);
+    for (j = 0; j < count && length < size; j++)
+    {
+        length += snprintf(buffer + length, size - length, "%s{\"mac\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"packets\":%u,\"rssi\":%d}",
+                           j ? "," : "",
+                           (unsigned)(best[j]->mac >> 40) & 0xff, (unsigned)(best[j]->mac >> 32) & 0xff, (unsigned)(best[j]->mac >> 24) & 0xff,
+                           (unsigned)(best[j]->mac >> 16) & 0xff, (unsigned)(best[j]->mac >> 8) & 0xff, (unsigned)best[j]->mac & 0xff,
+                           best[j]->hits, best[j]->rssi);
+    }
+    if (length < size)
+    {
+        length += snprintf(buffer + length, size - length, "]}");
+    }
+    if (length >= size)
+    {
+        length = size - 1;
+    }
+
+    memset(census, 0, sizeof(census));
+    census_packets = 0;
+    census_evictions = 0;
+    return length;
+}
+
+// raw packet trace
+// the last trace_entries advertising reports from configured sensors (and from every device with trace_foreign: 1)
+// are kept in a fixed ring, each recorded with one memcpy of the report. the ring is dumped in annotated form on
+// SIGUSR1 or with the trace request on the query socket, so new sensors can be looked at without printing every
+// packet as it arrives. the scan loop is the only writer, readers copy the ring and drop the entries that may
+// have been overwritten while they were copying
+#define TRACE_DATA_SIZE 31
+
+typedef struct
+{
+    uint64_t time_us;
+    uint8_t adapter;
+    uint8_t event_type;
+    int8_t rssi;
+    uint8_t length;
+    uint8_t mac[6]; // as in bdaddr_t, least significant byte first
+    uint8_t data[TRACE_DATA_SIZE];
+} trace_entry_t;
+
+trace_entry_t *trace_ring = NULL;
+int trace_size = 0;
+atomic_ulong trace_head = 0; // entries ever written
+int trace_foreign = 0;
+int trace_adapter = 0;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+const char *trace_event_names[] = {"ADV_IND", "ADV_DIRECT_IND", "ADV_SCAN_IND", "ADV_NONCONN_IND", "SCAN_RSP"};
+
+void trace_signal(int signal)
+{
+    (void)signal;
+    trace_dump_requested = 1;
+}
+
+void trace_init(config_t *config)
+{
+    struct sigaction act;
+
+    trace_size = config->trace_entries;
+    trace_foreign = config->trace_foreign;
+    trace_adapter = config->bluetooth_adapter;
+    if (trace_size <= 0)
+    {
+        trace_size = 0;
+        return;
+    }
+    trace_ring = calloc(trace_size, sizeof(trace_entry_t));
+    if (trace_ring == NULL)
+    {
+        fprintf(stderr, "Could not allocate %d trace entries\n", trace_size);
+        exit(1);
+    }
+
+    // SA_RESTART so blocking calls in the other threads carry on. the HCI socket has a receive timeout, and reads
+    // with a timeout are never restarted, so the scan loop still gets to the dump without waiting for a packet
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = trace_signal;
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &act, NULL);
+}
+
+// called from the scan loop for every advertising report
+void trace_record(const le_advertising_info *info, int8_t rssi)
+{
+    unsigned long head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+    trace_entry_t *e = &trace_ring[head % trace_size];
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    e->time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    e->adapter = trace_adapter;
+    e->event_type = info->evt_type;
+    e->rssi = rssi;
+    e->length = info->length < TRACE_DATA_SIZE ? info->length : TRACE_DATA_SIZE;
+    memcpy(e->mac, info->bdaddr.b, 6);
+    memcpy(e->data, info->data, e->length);
+    atomic_store_explicit(&trace_head, head + 1, memory_order_release);
+}
+
+// copy the newest entries, optionally only those of one address, oldest first
+// copy must have room for trace_size entries
+int trace_copy(trace_entry_t *copy, int max, const bdaddr_t *mac)
+{
+    unsigned long head = atomic_load_explicit(&trace_head, memory_order_acquire);
+    unsigned long first = head > (unsigned long)trace_size ? head - trace_size : 0;
+    unsigned long after;
+    unsigned long valid;
+    unsigned long i;
+    int count = 0;
+
+    for (i = first; i < head; i++)
+    {
+        copy[i - first] = trace_ring[i % trace_size];
+    }
+
+    // the writer may have overwritten the oldest entries meanwhile, and may be writing the slot of entry after - size
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&trace_head, memory_order_relaxed);
+    valid = after >= (unsigned long)trace_size ? after - trace_size + 1 : 0;
+    for (i = first > valid ? first : valid; i < head; i++)
+    {
+        if (mac == NULL || memcmp(copy[i - first].mac, mac->b, 6) == 0)
+        {
+            copy[count++] = copy[i - first];
+        }
+    }
+
+    // keep the newest
+    if (count > max)
+    {
+        memmove(copy, copy + count - max, max * sizeof(trace_entry_t));
+        count = max;
+    }
+    return count;
+}
+
+// AD structure type names for the annotated dump
+const char *trace_ad_name(int type)
+{
+    switch (type)
+    {
+    case 0x01:
+        return "flags";
+    case 0x02:
+    case 0x03:
+        return "16 bit service uuids";
+    case 0x06:
+    case 0x07:
+        return "128 bit service uuids";
+    case 0x08:
+        return "short name";
+    case 0x09:
+        return "complete name";
+    case 0x0a:
+        return "tx power";
+    case 0x16:
+        return "service data";
+    case 0x19:
+        return "appearance";
+    case 0xff:
+        return "manufacturer data";
+    default:
+        return "ad";
+    }
+}
+
+void trace_print(FILE *out, const trace_entry_t *e, bool json)
+{
+    time_t seconds = e->time_us / 1000000;
+    struct tm tm = *localtime(&seconds);
+    int n;
+    int i;
+
+    if (json)
+    {
+        fprintf(out, "{\"time_us\":%llu,\"adapter\":%d,\"mac\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"event\":%d,\"rssi\":%d,\"data\":\"",
+                (unsigned long long)e->time_us, e->adapter, e->mac[5], e->mac[4], e->mac[3], e->mac[2], e->mac[1], e->mac[0],
+                e->event_type, e->rssi);
+        for (n = 0; n < e->length; n++)
+        {
+            fprintf(out, "%02X", e->data[n]);
+        }
+        fprintf(out, "\",\"ad\":[");
+    }
+    else
+    {
+        fprintf(out, "%04d-%02d-%02d %02d:%02d:%02d.%06llu hci%d %02X:%02X:%02X:%02X:%02X:%02X %s rssi %d len %d\n",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                (unsigned long long)(e->time_us % 1000000), e->adapter,
+                e->mac[5], e->mac[4], e->mac[3], e->mac[2], e->mac[1], e->mac[0],
+                e->event_type < 5 ? trace_event_names[e->event_type] : "?", e->rssi, e->length);
+        fprintf(out, "  ");
+        for (n = 0; n < e->length; n++)
+        {
+            fprintf(out, "%02X", e->data[n]);
+        }
+        fprintf(out, "\n");
+    }
+
+    // walk the AD structures, length then type then data
+    for (n = 0, i = 0; n + 1 < e->length && e->data[n] != 0; n += e->data[n] + 1, i++)
+    {
+        int length = e->data[n] - 1;
+        int type = e->data[n + 1];
+        int k;
+
+        if (n + 1 + e->data[n] > e->length)
+        {
+            length = e->length - n - 2;
+        }
+        if (json)
+        {
+            fprintf(out, "%s{\"offset\":%d,\"type\":%d,\"name\":\"%s\",\"data\":\"", i ? "," : "", n, type, trace_ad_name(type));
+        }
+        else
+        {
+            fprintf(out, "  [%2d] 0x%02X %-22s ", n, type, trace_ad_name(type));
+        }
+        for (k = 0; k < length; k++)
+        {
+            fprintf(out, "%02X", e->data[n + 2 + k]);
+        }
+        if (json)
+        {
+            fprintf(out, "\"}");
+        }
+        else
+        {
+            // the uuid or company id in front of service and manufacturer data, little endian
+            if ((type == 0x16 || type == 0xff) && length >= 2)
+            {
+                fprintf(out, "  (%s 0x%04X)", type == 0x16 ? "uuid" : "company", e->data[n + 2] | e->data[n + 3] << 8);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    if (json)
+    {
+        fprintf(out, "]}");
+    }
+}
+
+// SIGUSR1, print the whole ring to stdout
+void trace_dump(void)
+{
+    trace_entry_t *copy;
+    int count;
+    int n;
+
+    trace_dump_requested = 0;
+    if (trace_size == 0)
+    {
+        fprintf(stdout, "Packet trace is disabled, trace_entries is 0\n");
+        return;
+    }
+    copy = malloc(trace_size * sizeof(trace_entry_t));
+    if (copy == NULL)
+    {
+        return;
+    }
+    count = trace_copy(copy, trace_size, NULL);
+    fprintf(stdout, "=== packet trace, %d reports ===\n", count);
+    for (n = 0; n < count; n++)
+    {
+        trace_print(stdout, &copy[n], false);
+    }
+    fprintf(stdout, "=== end of packet trace ===\n");
+    fflush(stdout);
+    free(copy);
+}
+
+// rolling statistics
+// for every sensor the most recent readings are kept in a fixed size ring, and min, max, mean and standard deviation
+// of temperature, humidity and rssi are accumulated (Welford's method) over each of the configured windows.
+// when a window closes the rollup is published to [base topic][id]/rollup/[window seconds]
+#define STATS_MAX_WINDOWS 4
+#define STATS_RING_SIZE 64
+
+enum
+{
+    STATS_TEMPERATURE,
+    STATS_HUMIDITY,
+    STATS_RSSI,
+    STATS_METRICS
+};
+
+const char *stats_metric_names[STATS_METRICS] = {"tempc", "humidity", "rssi"};
+
+typedef struct
+{
+    time_t time;
+    float temperature_celsius;
+    float humidity;
+    int8_t rssi;
+} stats_sample_t;
+
+typedef struct
+{
+    int count;
+    double mean;
+    double m2; // sum of squared differences from the mean
+    double min;
+    double max;
+} stats_accumulator_t;
+
+typedef struct
+{
+    stats_sample_t ring[STATS_RING_SIZE];
+    int ring_next;
+    int ring_count;
+    time_t window_start[STATS_MAX_WINDOWS];
+    stats_accumulator_t window[STATS_MAX_WINDOWS][STATS_METRICS];
+} sensor_stats_t;
+
+sensor_stats_t sensor_stats[MAX_SENSORS];
+
+// the rings are also read by the query thread
+pthread_mutex_t stats_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// window lengths in seconds from stats_windows, 0 windows disables the rollups
+int stats_window_seconds[STATS_MAX_WINDOWS];
+int stats_window_count = 0;
+
+// parse the comma separated list of window lengths, e.g. "60,300,3600"
+void stats_init(config_t *config)
+{
+    char windows[sizeof(config->stats_windows)];
+    char *token;
+    int seconds;
+
+    stats_window_count = 0;
+    memset(sensor_stats, 0, sizeof(sensor_stats));
+
+    strcpy(windows, config->stats_windows);
+    for (token = strtok(windows, ", "); token != NULL; token = strtok(NULL, ", "))
+    {
+        seconds = strtol(token, NULL, 10);
+        if (seconds <= 0)
+        {
+            fprintf(stderr, "Ignoring invalid stats window : %s\n", token);
+            continue;
+        }
+        if (stats_window_count == STATS_MAX_WINDOWS)
+        {
+            fprintf(stderr, "Only %d stats windows supported, ignoring : %s\n", STATS_MAX_WINDOWS, token);
+            break;
+        }
+        stats_window_seconds[stats_window_count++] = seconds;
+    }
+}
+
+void stats_accumulate(stats_accumulator_t *a, double value)
+{
+    double delta;
+
+    if (a->count == 0 || value < a->min)
+    {
+        a->min = value;
+    }
+    if (a->count == 0 || value > a->max)
+    {
+        a->max = value;
+    }
+    a->count++;
+    delta = value - a->mean;
+    a->mean += delta / a->count;
+    a->m2 += delta * (value - a->mean);
+}
+
+// add a decoded reading to the ring and every open window of the sensor
+void stats_add(int sensor, time_t now, double temperature_celsius, double humidity, int rssi)
+{
+    sensor_stats_t *st = &sensor_stats[sensor];
+    stats_sample_t *sample;
+    int w;
+
+    pthread_mutex_lock(&stats_ring_lock);
+    sample = &st->ring[st->ring_next];
+    sample->time = now;
+    sample->temperature_celsius = temperature_celsius;
+    sample->humidity = humidity;
+    sample->rssi = rssi;
+    st->ring_next = (st->ring_next + 1) % STATS_RING_SIZE;
+    if (st->ring_count < STATS_RING_SIZE)
+    {
+        st->ring_count++;
+    }
+    pthread_mutex_unlock(&stats_ring_lock);
+
+    for (w = 0; w < stats_window_count; w++)
+    {
+        if (st->window_start[w] == 0)
+        {
+            // windows are aligned to the clock, e.g. a 300 second window starts at :00, :05, :10 ...
+            st->window_start[w] = now - now % stats_window_seconds[w];
+        }
+        stats_accumulate(&st->window[w][STATS_TEMPERATURE], temperature_celsius);
+        stats_accumulate(&st->window[w][STATS_HUMIDITY], humidity);
+        stats_accumulate(&st->window[w][STATS_RSSI], rssi);
+    }
+}
+
+// publish and reset every window that has closed, called from the scan loop at most once a second
+void stats_check(config_t *config, int sensor_count, time_t now)
+{
+    char payload[MAXIMUM_JSON_MESSAGE];
+    char topic[200];
+    int length;
+    int x;
+    int w;
+    int m;
+    struct tm tm;
+
+    for (x = 0; x < sensor_count; x++)
+    {
+        sensor_stats_t *st = &sensor_stats[x];
+
+        for (w = 0; w < stats_window_count; w++)
+        {
+            if (st->window_start[w] == 0 || now < st->window_start[w] + stats_window_seconds[w])
+            {
+                continue;
+            }
+
+            tm = *gmtime(&st->window_start[w]);
+            length = snprintf(payload, sizeof(payload),
+                              "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",\"mac\":\"%s\",\"window\":%d",
+                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                              config->sensors[x].mac, stats_window_seconds[w]);
+
+            for (m = 0; m < STATS_METRICS; m++)
+            {
+                stats_accumulator_t *a = &st->window[w][m];
+
+                length += snprintf(payload + length, sizeof(payload) - length,
+                                   ",\"%s\":{\"count\":%d,\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f,\"stddev\":%.2f}",
+                                   stats_metric_names[m], a->count, a->min, a->max, a->mean,
+                                   a->count > 1 ? sqrt(a->m2 / (a->count - 1)) : 0.0);
+            }
+            length += snprintf(payload + length, sizeof(payload) - length, "}");
+
+            snprintf(topic, sizeof(topic), "%s%s/rollup/%d", config->mqtt_base_topic, config->sensors[x].my_id, stats_window_seconds[w]);
+            mqtt_publish_message(MQTT_CLASS_STATS, -1, topic, payload, length);
+
+            // the next window starts with the next reading
+            st->window_start[w] = 0;
+            memset(st->window[w], 0, sizeof(st->window[w]));
+        }
+    }
+}
+
+// local history
+// every sensor's readings are appended to a memory mapped segment file per day (UTC) in history_directory,
+// named [mac without colons]-[YYYYMMDD].hist. the file is columnar, time, temperature and humidity each have
+// their own region holding the zig-zag encoded difference from the previous reading as a variable length integer,
+// temperature and humidity in hundredths. a typical reading takes 3 bytes. nothing is synced on the hot path,
+// the kernel writes dirty pages back on its own schedule. segments older than history_retention_days are deleted
+#define HISTORY_MAGIC "BLEH"
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER_SIZE 4096
+#define HISTORY_COLUMN_SIZE (128 * 1024)
+#define HISTORY_SEGMENT_SECONDS (24 * 60 * 60)
+#define HISTORY_FILE_SIZE (HISTORY_HEADER_SIZE + HISTORY_COLUMNS * HISTORY_COLUMN_SIZE)
+
+enum
+{
+    HISTORY_TIME,
+    HISTORY_TEMPERATURE,
+    HISTORY_HUMIDITY,
+    HISTORY_COLUMNS
+};
+
+// start of every segment file, the column regions follow at HISTORY_HEADER_SIZE
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    int64_t start_time;                // first second covered by the segment
+    uint32_t column_size;              // bytes reserved for each column
+    uint32_t count;                    // readings stored
+    uint32_t used[HISTORY_COLUMNS];    // bytes used in each column
+    int64_t last_time;                 // previous reading, base for the next difference
+    int32_t last_value[HISTORY_COLUMNS];
+    char mac[18];
+} history_header_t;
+
+typedef struct
+{
+    int fd;
+    uint8_t *map;
+    history_header_t *header;
+    time_t end_time; // first second after the segment
+    int dropped;     // readings that did not fit in the segment
+} history_segment_t;
+
+history_segment_t history_segments[MAX_SENSORS];
+config_t *history_config = NULL;
+
+static inline uint32_t zigzag_encode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// append a LEB128 variable length integer, returns bytes written or 0 when it does not fit
+static inline int varint_put(uint8_t *p, uint32_t space, uint32_t value)
+{
+    uint32_t n = 0;
+
+    do
+    {
+        if (n == space)
+        {
+            return 0;
+        }
+        p[n++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        value >>= 7;
+    } while (value != 0);
+    return n;
+}
+
+// read a LEB128 variable length integer, returns bytes read or 0 when truncated
+static inline int varint_get(const uint8_t *p, uint32_t space, uint32_t *value)
+{
+    uint32_t n = 0;
+    int shift = 0;
+
+    *value = 0;
+    while (n < space && shift < 35)
+    {
+        *value |= (uint32_t)(p[n] & 0x7f) << shift;
+        if ((p[n++] & 0x80) == 0)
+        {
+            return n;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+// file name of the segment holding time t for a sensor
+void history_segment_path(char *path, size_t size, const char *mac, time_t t)
+{
+    char mac_hex[13];
+    struct tm tm = *gmtime(&t);
+    int n = 0;
+
+    for (; *mac && n < 12; mac++)
+    {
+        if (*mac != ':')
+        {
+            mac_hex[n++] = *mac;
+        }
+    }
+    mac_hex[n] = '\0';
+    snprintf(path, size, "%s/%s-%04d%02d%02d.hist", history_config->history_directory, mac_hex, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+void history_close(history_segment_t *seg)
+{
+    if (seg->map != NULL)
+    {
+        munmap(seg->map, HISTORY_FILE_SIZE);
+        close(seg->fd);
+        seg->map = NULL;
+        seg->header = NULL;
+    }
+}
+
+// delete segment files older than the retention period, run whenever a new segment is opened
+void history_expire(time_t now)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char mac_hex[13];
+    int year, month, day;
+    struct tm tm;
+    char path[512];
+    time_t oldest;
+
+    if (history_config->history_retention_days <= 0)
+    {
+        return;
+    }
+    oldest = now - (time_t)history_config->history_retention_days * HISTORY_SEGMENT_SECONDS;
+
+    dir = opendir(history_config->history_directory);
+    if (dir == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (sscanf(entry->d_name, "%12[0-9A-Fa-f]-%4d%2d%2d.hist", mac_hex, &year, &month, &day) != 4)
+        {
+            continue;
+        }
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        if (timegm(&tm) + HISTORY_SEGMENT_SECONDS <= oldest)
+        {
+            snprintf(path, sizeof(path), "%s/%s", history_config->history_directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// start of the oldest segment file of a sensor, -1 if there is none
+time_t history_oldest(const char *mac)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char mac_hex[13];
+    char wanted[13];
+    int year, month, day;
+    struct tm tm;
+    time_t start;
+    time_t oldest = -1;
+    int n = 0;
+
+    for (; *mac && n < 12; mac++)
+    {
+        if (*mac != ':')
+        {
+            wanted[n++] = *mac;
+        }
+    }
+    wanted[n] = '\0';
+
+    dir = opendir(history_config->history_directory);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (sscanf(entry->d_name, "%12[0-9A-Fa-f]-%4d%2d%2d.hist", mac_hex, &year, &month, &day) != 4 || strcmp(mac_hex, wanted) != 0)
+        {
+            continue;
+        }
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        start = timegm(&tm);
+        if (oldest < 0 || start < oldest)
+        {
+            oldest = start;
+        }
+    }
+    closedir(dir);
+    return oldest;
+}
+
+// map the segment for time t, continuing an existing file if the program was restarted during the day
+int history_open(int sensor, time_t t)
+{
+    history_segment_t *seg = &history_segments[sensor];
+    char path[512];
+    struct stat st;
+    history_header_t *h;
+
+    history_close(seg);
+    history_segment_path(path, sizeof(path), history_config->sensors[sensor].mac, t);
+
+    seg->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (seg->fd < 0)
+    {
+        fprintf(stderr, "Could not open history segment %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // the file is sparse, blocks are only allocated as the columns fill
+    if (fstat(seg->fd, &st) != 0 || (st.st_size != HISTORY_FILE_SIZE && ftruncate(seg->fd, HISTORY_FILE_SIZE) != 0))
+    {
+        fprintf(stderr, "Could not size history segment %s: %s\n", path, strerror(errno));
+        close(seg->fd);
+        return -1;
+    }
+    seg->map = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map history segment %s: %s\n", path, strerror(errno));
+        seg->map = NULL;
+        close(seg->fd);
+        return -1;
+    }
+
+    h = seg->header = (history_header_t *)seg->map;
+    if (memcmp(h->magic, HISTORY_MAGIC, 4) != 0 || h->version != HISTORY_VERSION || h->column_size != HISTORY_COLUMN_SIZE)
+    {
+        // new or unusable file, start the segment from scratch
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, HISTORY_MAGIC, 4);
+        h->version = HISTORY_VERSION;
+        h->start_time = t - t % HISTORY_SEGMENT_SECONDS;
+        h->column_size = HISTORY_COLUMN_SIZE;
+        h->last_time = h->start_time;
+        snprintf(h->mac, sizeof(h->mac), "%s", history_config->sensors[sensor].mac);
+    }
+    seg->end_time = h->start_time + HISTORY_SEGMENT_SECONDS;
+    seg->dropped = 0;
+
+    history_expire(t);
+    return 0;
+}
+
+// set up the history store, an empty history_directory disables it
+void history_init(config_t *config)
+{
+    int x;
+
+    history_config = config;
+    for (x = 0; x < MAX_SENSORS; x++)
+    {
+        history_segments[x].map = NULL;
+    }
+    if (config->history_directory[0] == '\0')
+    {
+        return;
+    }
+    if (mkdir(config->history_directory, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Could not create history directory %s: %s, history disabled\n", config->history_directory, strerror(errno));
+        config->history_directory[0] = '\0';
+    }
+}
+
+// append one reading to the sensor's current segment
+void history_add(int sensor, time_t now, double temperature_celsius, double humidity)
+{
+    history_segment_t *seg = &history_segments[sensor];
+    history_header_t *h;
+    int32_t value[HISTORY_COLUMNS];
+    uint8_t encoded[HISTORY_COLUMNS][5];
+    int length[HISTORY_COLUMNS];
+    int c;
+
+    if (history_config == NULL || history_config->history_directory[0] == '\0')
+    {
+        return;
+    }
+    if ((seg->map == NULL || now >= seg->end_time) && history_open(sensor, now) != 0)
+    {
+        return;
+    }
+    h = seg->header;
+
+    // thin out the stored readings to at most one per history_interval seconds
+    if (h->count > 0 && now - h->last_time < history_config->history_interval)
+    {
+        return;
+    }
+
+    value[HISTORY_TIME] = (int32_t)(now - h->last_time);
+    value[HISTORY_TEMPERATURE] = (int32_t)lround(temperature_celsius * 100.0);
+    value[HISTORY_HUMIDITY] = (int32_t)lround(humidity * 100.0);
+
+    // encode every column before writing any, a reading is stored completely or not at all
+    for (c = 0; c < HISTORY_COLUMNS; c++)
+    {
+        int32_t delta = c == HISTORY_TIME ? value[c] : value[c] - h->last_value[c];
+
+        length[c] = varint_put(encoded[c], HISTORY_COLUMN_SIZE - h->used[c], zigzag_encode(delta));
+        if (length[c] == 0)
+        {
+            seg->dropped++;
+            return;
+        }
+    }
+    for (c = 0; c < HISTORY_COLUMNS; c++)
+    {
+        memcpy(seg->map + HISTORY_HEADER_SIZE + c * HISTORY_COLUMN_SIZE + h->used[c], encoded[c], length[c]);
+        h->used[c] += length[c];
+        if (c != HISTORY_TIME)
+        {
+            h->last_value[c] = value[c];
+        }
+    }
+    h->last_time = now;
+    // the count is written last, readers never see a partly written reading
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+void history_shutdown(void)
+{
+    int x;
+
+    for (x = 0; x < MAX_SENSORS; x++)
+    {
+        history_close(&history_segments[x]);
+    }
+}
+
+// shared memory readings ring
+// every reading that passes the glitch filter is also copied into a ring in the POSIX shared memory object
+// readings_ring, for programs on the same machine that follow the readings without going through the MQTT server.
+// the layout and the functions readers use are in ble_readings.h. each slot is written like a seqlock, its version
+// is odd while the record is being written, and head is moved on once it is complete. the object is kept across
+// restarts so readers and sequence numbers carry on, unless its size or layout changed
+#define READINGS_RING_MAX (1 << 20)
+
+ble_readings_t *readings_ring = NULL;
+
+// create or reuse the shared memory object, an empty readings_ring disables it
+void readings_ring_init(config_t *config, int sensor_count)
+{
+    ble_readings_t *ring;
+    ble_readings_sensor_t *s;
+    struct stat st;
+    uint32_t size = 16;
+    size_t bytes;
+    int fd;
+    int x;
+
+    if (config->readings_ring[0] == '\0')
+    {
+        return;
+    }
+    while (size < (uint32_t)config->readings_ring_size && size < READINGS_RING_MAX)
+    {
+        size <<= 1;
+    }
+    bytes = BLE_READINGS_BYTES(size);
+
+    fd = shm_open(config->readings_ring, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Could not open readings ring %s: %s\n", config->readings_ring, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    ring = NULL;
+    if ((size_t)st.st_size >= sizeof(ble_readings_t))
+    {
+        ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring != MAP_FAILED && (size_t)st.st_size == bytes && memcmp(ring->magic, BLE_READINGS_MAGIC, 4) == 0 &&
+            ring->version == BLE_READINGS_VERSION && ring->size == size)
+        {
+            fprintf(stdout, "Readings ring %s continued at %u\n", config->readings_ring, ring->head);
+        }
+        else
+        {
+            // a ring of another size or layout, readers that have it mapped are told to open the new one
+            if (ring != MAP_FAILED)
+            {
+                __atomic_store_n(&ring->replaced, 1, __ATOMIC_RELEASE);
+                munmap(ring, st.st_size);
+            }
+            ring = NULL;
+            close(fd);
+            shm_unlink(config->readings_ring);
+            fd = shm_open(config->readings_ring, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        }
+    }
+    if (ring == NULL)
+    {
+        if (fd < 0 || ftruncate(fd, bytes) != 0 ||
+            (ring = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+            fprintf(stderr, "Could not create readings ring %s: %s\n", config->readings_ring, strerror(errno));
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return;
+        }
+        ring->version = BLE_READINGS_VERSION;
+        ring->size = size;
+        // the magic last, readers don't use a ring that is not set up yet
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(ring->magic, BLE_READINGS_MAGIC, 4);
+        fprintf(stdout, "Readings ring %s created, %u readings\n", config->readings_ring, size);
+    }
+    close(fd);
+
+    for (x = 0; x < sensor_count && x < BLE_READINGS_MAX_SENSORS; x++)
+    {
+        s = &ring->sensors[x];
+        s->type = config->sensors[x].type;
+        snprintf(s->mac, sizeof(s->mac), "%s", config->sensors[x].mac);
+        snprintf(s->unique, sizeof(s->unique), "%s", config->sensors[x].unique);
+        snprintf(s->name, sizeof(s->name), "%s", config->sensors[x].name);
+        snprintf(s->location, sizeof(s->location), "%s", config->sensors[x].location);
+    }
+    ring->sensor_count = x;
+    readings_ring = ring;
+}
+
+// copy a reading into the next slot
+void readings_ring_add(int sensor, time_t now, const reading_t *reading, int rssi)
+{
+    ble_readings_slot_t *slot;
+    ble_reading_record_t *r;
+    uint32_t sequence;
+    int i;
+
+    if (readings_ring == NULL)
+    {
+        return;
+    }
+    sequence = readings_ring->head;
+    slot = &readings_ring->slots[sequence & (readings_ring->size - 1)];
+    __atomic_store_n(&slot->version, (sequence << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r = &slot->record;
+    r->sequence = sequence;
+    r->sensor = sensor;
+    r->time = now;
+    r->rssi = rssi;
+    r->fields = reading->fields;
+    r->temperature_celsius = reading->temperature_celsius;
+    r->humidity = reading->humidity;
+    r->battery_pct = reading->battery_pct;
+    r->battery_mv = reading->battery_mv;
+    r->frame = reading->frame;
+    r->value_count = reading->value_count;
+    for (i = 0; i < reading->value_count; i++)
+    {
+        strncpy(r->values[i].name, reading->values[i].name, BLE_READINGS_NAME_SIZE - 1);
+        r->values[i].name[BLE_READINGS_NAME_SIZE - 1] = '\0';
+        r->values[i].index = reading->values[i].index;
+        r->values[i].decimals = reading->values[i].decimals;
+        r->values[i].value = reading->values[i].value;
+    }
+
+    __atomic_store_n(&slot->version, sequence << 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&readings_ring->head, sequence + 1, __ATOMIC_RELEASE);
+}
+
+// glitch filter
+// corrupted or misclassified packets occasionally decode to garbage, each reading is checked against a plausible
+// temperature range and a maximum rate of change from the last accepted reading before it is published. the
+// accepted values can then be replaced by the median of the last filter_median readings to take out single spikes.
+// a sensor that keeps being rejected for FILTER_MAX_REJECTS readings in a row is accepted again, so a real step
+// change (sensor moved outdoors) is not locked out forever
+#define FILTER_MAX_MEDIAN 9
+#define FILTER_MAX_REJECTS 5
+
+typedef struct
+{
+    time_t last_time; // last accepted reading, 0 = none yet
+    double last_temperature;
+    double last_humidity;
+    int consecutive_rejects;
+    double median_temperature[FILTER_MAX_MEDIAN];
+    double median_humidity[FILTER_MAX_MEDIAN];
+    int median_next;
+    int median_count;
+    int rejected_range; // counters, reset with the hourly stats
+    int rejected_rate;
+} sensor_filter_t;
+
+sensor_filter_t sensor_filters[MAX_SENSORS];
+
+// median of at most FILTER_MAX_MEDIAN values, insertion sort of a small copy
+double filter_median_of(const double *values, int count)
+{
+    double sorted[FILTER_MAX_MEDIAN];
+    double v;
+    int i;
+    int j;
+
+    for (i = 0; i < count; i++)
+    {
+        v = values[i];
+        for (j = i; j > 0 && sorted[j - 1] > v; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = v;
+    }
+    return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2.0;
+}
+
+// returns false if the reading is rejected, otherwise may replace the values with the median of the last few
+bool filter_reading(sensor_t *sensor, sensor_filter_t *f, time_t now, double *temperature_celsius, double *humidity)
+{
+    double minutes;
+
+    if ((sensor->filter_temp_min < sensor->filter_temp_max &&
+         (*temperature_celsius < sensor->filter_temp_min || *temperature_celsius > sensor->filter_temp_max)) ||
+        *humidity < 0.0 || *humidity > 100.0)
+    {
+        f->rejected_range++;
+        return false;
+    }
+
+    if (f->last_time != 0 && f->consecutive_rejects < FILTER_MAX_REJECTS)
+    {
+        // allow at least one minute worth of change, readings arrive several times a minute and a 0.1 step
+        // between two of them would otherwise exceed any sensible rate
+        minutes = (now - f->last_time > 60 ? now - f->last_time : 60) / 60.0;
+        if ((sensor->filter_temp_rate > 0 && fabs(*temperature_celsius - f->last_temperature) > sensor->filter_temp_rate * minutes) ||
+            (sensor->filter_hum_rate > 0 && fabs(*humidity - f->last_humidity) > sensor->filter_hum_rate * minutes))
+        {
+            f->rejected_rate++;
+            f->consecutive_rejects++;
+            return false;
+        }
+    }
+    f->consecutive_rejects = 0;
+    f->last_time = now;
+    f->last_temperature = *temperature_celsius;
+    f->last_humidity = *humidity;
+
+    if (sensor->filter_median > 1)
+    {
+        f->median_temperature[f->median_next] = *temperature_celsius;
+        f->median_humidity[f->median_next] = *humidity;
+        f->median_next = (f->median_next + 1) % sensor->filter_median;
+        if (f->median_count < sensor->filter_median)
+        {
+            f->median_count++;
+        }
+        *temperature_celsius = filter_median_of(f->median_temperature, f->median_count);
+        *humidity = filter_median_of(f->median_humidity, f->median_count);
+    }
+    return true;
+}
+
+// settings a sensor does not set itself come from the top level filter_* settings
+void filter_init(config_t *config, int sensor_count)
+{
+    sensor_t *sensor;
+    int x;
+
+    memset(sensor_filters, 0, sizeof(sensor_filters));
+    for (x = 0; x < sensor_count; x++)
+    {
+        sensor = &config->sensors[x];
+        if (sensor->filter_median < 0)
+        {
+            sensor->filter_median = config->filter_median;
+        }
+        if (sensor->filter_median > FILTER_MAX_MEDIAN)
+        {
+            sensor->filter_median = FILTER_MAX_MEDIAN;
+        }
+        if (isnan(sensor->filter_temp_min))
+        {
+            sensor->filter_temp_min = config->filter_temp_min;
+        }
+        if (isnan(sensor->filter_temp_max))
+        {
+            sensor->filter_temp_max = config->filter_temp_max;
+        }
+        if (isnan(sensor->filter_temp_rate))
+        {
+            sensor->filter_temp_rate = config->filter_temp_rate;
+        }
+        if (isnan(sensor->filter_hum_rate))
+        {
+            sensor->filter_hum_rate = config->filter_hum_rate;
+        }
+    }
+}
+
+config_t *reading_config = NULL;
+
+// what a reading of a sensor such as MiBeacon lacks is filled in from its last reports of the past few minutes
+#define READING_MERGE_SECONDS 600
+#define READING_MERGE (READING_TEMPERATURE | READING_HUMIDITY | READING_BATTERY_PCT)
+#define READING_SAMPLE (READING_TEMPERATURE | READING_HUMIDITY)
+
+// temperature and humidity that came in since the sensor's last sample for the statistics and history, values
+// filled in from earlier reports are only published, never counted a second time
+uint32_t reading_unsampled[MAX_SENSORS];
+
+// fill in what the reading lacks from the sensor's last reports, keep what it has for the next
+void reading_merge(int sensor, time_t now, reading_t *reading)
+{
+    sensor_hot_t *last = &sensor_hot[sensor];
+
+    if ((reading->fields & READING_MERGE) == READING_MERGE)
+    {
+        return;
+    }
+    if (reading->fields & READING_TEMPERATURE)
+    {
+        last->fields |= READING_TEMPERATURE;
+        last->time[0] = (uint32_t)now;
+        last->temperature_celsius = reading->temperature_celsius;
+    }
+    else if ((last->fields & READING_TEMPERATURE) && (uint32_t)now - last->time[0] < READING_MERGE_SECONDS)
+    {
+        reading->fields |= READING_TEMPERATURE;
+        reading->temperature_celsius = last->temperature_celsius;
+    }
+    if (reading->fields & READING_HUMIDITY)
+    {
+        last->fields |= READING_HUMIDITY;
+        last->time[1] = (uint32_t)now;
+        last->humidity = reading->humidity;
+    }
+    else if ((last->fields & READING_HUMIDITY) && (uint32_t)now - last->time[1] < READING_MERGE_SECONDS)
+    {
+        reading->fields |= READING_HUMIDITY;
+        reading->humidity = last->humidity;
+    }
+    if (reading->fields & READING_BATTERY_PCT)
+    {
+        last->fields |= READING_BATTERY_PCT;
+        last->time[2] = (uint32_t)now;
+        last->battery_pct = reading->battery_pct;
+    }
+    else if ((last->fields & READING_BATTERY_PCT) && (uint32_t)now - last->time[2] < READING_MERGE_SECONDS)
+    {
+        reading->fields |= READING_BATTERY_PCT;
+        reading->battery_pct = last->battery_pct;
+    }
+}
+
+// a decoded reading from a configured sensor, filtered, then fed to the rolling statistics and the local history
+// returns false if the glitch filter rejected it. a reading with only some of temperature, humidity and battery is
+// first completed from the sensor's last reports for publishing. a sensor that sends temperature and humidity in
+// separate reports makes a sample for the statistics and history once both have come in again. readings still
+// without both temperature and humidity, from sensors such as buttons or door contacts, only go through the claims
+bool sensor_reading(int sensor, time_t now, reading_t *reading, int rssi)
+{
+    static bool first_reading = true;
+    uint32_t fresh = reading->fields & READING_SAMPLE;
+
+    if (first_reading)
+    {
+        first_reading = false;
+        startup_mark(STARTUP_FIRST_READING);
+    }
+    reading_merge(sensor, now, reading);
+    if ((reading->fields & READING_SAMPLE) == READING_SAMPLE)
+    {
+        if (!filter_reading(&reading_config->sensors[sensor], &sensor_filters[sensor], now, &reading->temperature_celsius, &reading->humidity))
+        {
+            return false;
+        }
+        reading_unsampled[sensor] |= fresh;
+        if (reading_unsampled[sensor] == READING_SAMPLE)
+        {
+            reading_unsampled[sensor] = 0;
+            stats_add(sensor, now, reading->temperature_celsius, reading->humidity, rssi);
+            history_add(sensor, now, reading->temperature_celsius, reading->humidity);
+        }
+    }
+    claim_heard(sensor, rssi);
+    readings_ring_add(sensor, now, reading, rssi);
+    return true;
+}
+
+// local query API
+// a thread serves a unix domain socket at query_socket so programs on the same machine can get readings without
+// going through the MQTT server. each client gets a thread of its own, up to QUERY_MAX_CLIENTS at a time, and is
+// dropped after QUERY_TIMEOUT seconds without a request. one request per line, one JSON line back:
+//   all                        latest reading of every sensor
+//   latest [unique or mac]     latest reading of one sensor
+//   last [unique or mac] [n]   up to the last n readings held in memory (at most STATS_RING_SIZE)
+//   range [unique or mac] [from] [to]   readings in the local history between two unix times
+#define QUERY_MAX_CLIENTS 8
+#define QUERY_TIMEOUT 30
+#define QUERY_SOCKET_MODE 0660
+
+config_t *query_config = NULL;
+int query_sensor_count = 0;
+atomic_int query_clients = 0;
+
+// find a sensor by unique id or MAC address, -1 if not configured
+int query_find_sensor(const char *id)
+{
+    int x;
+
+    for (x = 0; x < query_sensor_count; x++)
+    {
+        if (strcmp(id, query_config->sensors[x].unique) == 0 || strcasecmp(id, query_config->sensors[x].mac) == 0)
+        {
+            return x;
+        }
+    }
+    return -1;
+}
+
+void query_print_sample(FILE *out, const stats_sample_t *sample)
+{
+    fprintf(out, "{\"time\":%lld,\"tempc\":%.2f,\"humidity\":%.2f,\"rssi\":%d}",
+            (long long)sample->time, sample->temperature_celsius, sample->humidity, sample->rssi);
+}
+
+// copy the newest n samples of a sensor's ring, oldest first, returns the number copied
+int query_copy_recent(int sensor, stats_sample_t *samples, int n)
+{
+    sensor_stats_t *st = &sensor_stats[sensor];
+    int i;
+
+    pthread_mutex_lock(&stats_ring_lock);
+    if (n > st->ring_count)
+    {
+        n = st->ring_count;
+    }
+    for (i = 0; i < n; i++)
+    {
+        samples[i] = st->ring[(st->ring_next - n + i + STATS_RING_SIZE) % STATS_RING_SIZE];
+    }
+    pthread_mutex_unlock(&stats_ring_lock);
+    return n;
+}
+
+void query_print_latest(FILE *out, int sensor)
+{
+    stats_sample_t sample;
+
+    fprintf(out, "{\"unique\":\"%s\",\"mac\":\"%s\",\"name\":\"%s\",\"location\":\"%s\",\"reading\":",
+            query_config->sensors[sensor].unique, query_config->sensors[sensor].mac,
+            query_config->sensors[sensor].name, query_config->sensors[sensor].location);
+    if (query_copy_recent(sensor, &sample, 1) == 1)
+    {
+        query_print_sample(out, &sample);
+    }
+    else
+    {
+        fprintf(out, "null");
+    }
+    fprintf(out, "}");
+}
+
+// print the readings of one history segment file between from and to, returns readings printed
+int query_print_history(FILE *out, const char *path, time_t from, time_t to, int printed)
+{
+    int fd;
+    uint8_t *map;
+    history_header_t *h;
+    uint32_t count;
+    uint32_t position[HISTORY_COLUMNS] = {0, 0, 0};
+    int32_t value[HISTORY_COLUMNS] = {0, 0, 0};
+    int64_t t;
+    uint32_t raw;
+    uint32_t i;
+    int c;
+    int n;
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return printed;
+    }
+    // reading past the end of a short or truncated file would raise SIGBUS
+    if (fstat(fd, &st) != 0 || st.st_size < HISTORY_FILE_SIZE)
+    {
+        close(fd);
+        return printed;
+    }
+    map = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return printed;
+    }
+
+    h = (history_header_t *)map;
+    if (memcmp(h->magic, HISTORY_MAGIC, 4) == 0 && h->version == HISTORY_VERSION && h->column_size == HISTORY_COLUMN_SIZE)
+    {
+        // readings beyond the count may still be being written by the scan loop
+        count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+        for (i = 0; i < count; i++)
+        {
+            for (c = 0; c < HISTORY_COLUMNS; c++)
+            {
+                n = varint_get(map + HISTORY_HEADER_SIZE + c * HISTORY_COLUMN_SIZE + position[c], HISTORY_COLUMN_SIZE - position[c], &raw);
+                if (n == 0)
+                {
+                    break;
+                }
+                position[c] += n;
+                value[c] += zigzag_decode(raw);
+            }
+            if (c < HISTORY_COLUMNS)
+            {
+                break;
+            }
+            t = h->start_time + value[HISTORY_TIME];
+            if (t < from || t > to)
+            {
+                continue;
+            }
+            fprintf(out, "%s{\"time\":%lld,\"tempc\":%.2f,\"humidity\":%.2f}", printed ? "," : "",
+                    (long long)t, value[HISTORY_TEMPERATURE] / 100.0, value[HISTORY_HUMIDITY] / 100.0);
+            printed++;
+        }
+    }
+    munmap(map, HISTORY_FILE_SIZE);
+    return printed;
+}
+
+// answer one request line
+void query_answer(FILE *out, char *request)
+{
+    char command[16];
+    char id[64];
+    long long a = 0;
+    long long b = 0;
+    int fields;
+    int sensor;
+    int x;
+
+    fields = sscanf(request, "%15s %63s %lld %lld", command, id, &a, &b);
+    if (fields < 1)
+    {
+        fprintf(out, "{\"error\":\"empty request\"}\n");
+        return;
+    }
+
+    if (strcmp(command, "all") == 0)
+    {
+        fprintf(out, "[");
+        for (x = 0; x < query_sensor_count; x++)
+        {
+            fprintf(out, "%s", x ? "," : "");
+            query_print_latest(out, x);
+        }
+        fprintf(out, "]\n");
+        return;
+    }
+
+    // raw reports from the trace ring, of all devices, one configured sensor or any address
+    if (strcmp(command, "trace") == 0)
+    {
+        trace_entry_t *copy;
+        bdaddr_t mac;
+        int n;
+
+        if (trace_size == 0 || (copy = malloc(trace_size * sizeof(trace_entry_t))) == NULL)
+        {
+            fprintf(out, "{\"error\":\"packet trace disabled\"}\n");
+            return;
+        }
+        if (fields >= 2 && strcmp(id, "all") != 0)
+        {
+            sensor = query_find_sensor(id);
+            str2ba(sensor >= 0 ? query_config->sensors[sensor].mac : id, &mac);
+        }
+        n = trace_copy(copy, fields >= 3 && a > 0 ? (int)a : trace_size, fields >= 2 && strcmp(id, "all") != 0 ? &mac : NULL);
+        fprintf(out, "[");
+        for (x = 0; x < n; x++)
+        {
+            fprintf(out, "%s", x ? "," : "");
+            trace_print(out, &copy[x], true);
+        }
+        fprintf(out, "]\n");
+        free(copy);
+        return;
+    }
+
+    if (fields < 2 || (sensor = query_find_sensor(id)) < 0)
+    {
+        fprintf(out, "{\"error\":\"unknown sensor\"}\n");
+        return;
+    }
+
+    if (strcmp(command, "latest") == 0)
+    {
+        query_print_latest(out, sensor);
+        fprintf(out, "\n");
+    }
+    else if (strcmp(command, "last") == 0 && fields == 3)
+    {
+        stats_sample_t samples[STATS_RING_SIZE];
+        int n = query_copy_recent(sensor, samples, a < 0 ? 0 : a > STATS_RING_SIZE ? STATS_RING_SIZE : (int)a);
+
+        fprintf(out, "[");
+        for (x = 0; x < n; x++)
+        {
+            fprintf(out, "%s", x ? "," : "");
+            query_print_sample(out, &samples[x]);
+        }
+        fprintf(out, "]\n");
+    }
+    else if (strcmp(command, "range") == 0 && fields == 4)
+    {
+        char path[512];
+        time_t now = time(NULL);
+        time_t oldest;
+        time_t from;
+        time_t to;
+        time_t day;
+        int printed = 0;
+
+        fprintf(out, "[");
+        if (query_config->history_directory[0] != '\0' && (oldest = history_oldest(query_config->sensors[sensor].mac)) >= 0)
+        {
+            // the client's range is cut to the days there are segments for
+            from = a < oldest ? oldest : a;
+            to = b > now ? now : b;
+            // one segment file per day
+            for (day = from - from % HISTORY_SEGMENT_SECONDS; day <= to; day += HISTORY_SEGMENT_SECONDS)
+            {
+                history_segment_path(path, sizeof(path), query_config->sensors[sensor].mac, day);
+                printed = query_print_history(out, path, from, to, printed);
+            }
+        }
+        fprintf(out, "]\n");
+    }
+    else
+    {
+        fprintf(out, "{\"error\":\"unknown request\"}\n");
+    }
+}
+
+// answer the requests of one client in order until it closes the connection or goes quiet
+void *query_client(void *arg)
+{
+    int client_fd = (int)(intptr_t)arg;
+    int out_fd;
+    FILE *in = NULL;
+    FILE *out = NULL;
+    char request[256];
+
+    if ((in = fdopen(client_fd, "r")) == NULL)
+    {
+        log_write(LOG_WARNING, LOG_SINK_ALL, "Query socket: %s\n", strerror(errno));
+        close(client_fd);
+    }
+    else if ((out_fd = dup(client_fd)) < 0 || (out = fdopen(out_fd, "w")) == NULL)
+    {
+        log_write(LOG_WARNING, LOG_SINK_ALL, "Query socket: %s\n", strerror(errno));
+        if (out_fd >= 0)
+        {
+            close(out_fd);
+        }
+    }
+    else
+    {
+        while (fgets(request, sizeof(request), in) != NULL)
+        {
+            query_answer(out, request);
+            fflush(out);
+        }
+    }
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+    atomic_fetch_sub(&query_clients, 1);
+    return NULL;
+}
+
+void *query_server(void *arg)
+{
+    int listen_fd = *(int *)arg;
+    int client_fd;
+    pthread_t thread;
+    struct timeval timeout = {QUERY_TIMEOUT, 0};
+
+    while (keep_running)
+    {
+        client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            continue;
+        }
+        if (atomic_load(&query_clients) >= QUERY_MAX_CLIENTS)
+        {
+            close(client_fd);
+            continue;
+        }
+        // a client that sends nothing, or reads nothing, is dropped instead of holding its thread
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        atomic_fetch_add(&query_clients, 1);
+        if (pthread_create(&thread, NULL, query_client, (void *)(intptr_t)client_fd) != 0)
+        {
+            atomic_fetch_sub(&query_clients, 1);
+            close(client_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// open the query socket and start serving it, an empty query_socket disables it
+void query_init(config_t *config, int sensor_count)
+{
+    static int listen_fd;
+    static pthread_t query_thread;
+    struct sockaddr_un addr;
+
+    query_config = config;
+    query_sensor_count = sensor_count;
+    if (config->query_socket[0] == '\0')
+    {
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(config->query_socket) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Query socket path too long: %s\n", config->query_socket);
+        return;
+    }
+    strcpy(addr.sun_path, config->query_socket);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(config->query_socket);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 8) != 0)
+    {
+        fprintf(stderr, "Could not open query socket %s: %s\n", config->query_socket, strerror(errno));
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+        }
+        return;
+    }
+    chmod(config->query_socket, QUERY_SOCKET_MODE);
+
+    if (pthread_create(&query_thread, NULL, query_server, &listen_fd) != 0)
+    {
+        fprintf(stderr, "Could not start query thread: %s\n", strerror(errno));
+        close(listen_fd);
+        return;
+    }
+    pthread_detach(query_thread);
+}
+
+// for reading configuration file
+// read a field from the input line
+char *getfield(char *line, int num)
+{
+    char *tok;
+    for (tok = strtok(line, ",");
+         tok && *tok;
+         tok = strtok(NULL, ",\n"))
+    {
+        if (!--num)
+            return tok;
+    }
+    return NULL;
+}
+
+// trim leading and trailing white space from a character string
+// https://stackoverflow.com/questions/122616/how-do-i-trim-leading-trailing-whitespace-in-a-standard-way
+char *trim(char *str)
+{
+    int isspace(int);
+    size_t len = 0;
+    char *frontp = str;
+    char *endp = NULL;
+
+    if (str == NULL)
+    {
+        return NULL;
+    }
+    if (str[0] == '\0')
+    {
+        return str;
+    }
+
+    len = strlen(str);
+    endp = str + len;
+
+    // Move the front and back pointers to address the first non-whitespace
+    // characters from each end.
+    while (isspace((unsigned char)*frontp))
+    {
+        ++frontp;
+    }
+    if (endp != frontp)
+    {
+        while (isspace((unsigned char)*(--endp)) && endp != frontp)
+        {
+        }
+    }
+
+    if (frontp != str && endp == frontp)
+        *str = '\0';
+    else if (str + len - 1 != endp)
+        *(endp + 1) = '\0';
+
+    // Shift the string so that it starts at str so that if it's dynamically
+    // allocated, we can still free it on the returned pointer.  Note the reuse
+    // of endp to mean the front of the string buffer now.
+    endp = str;
+    if (frontp != str)
+    {
+        while (*frontp)
+        {
+            *endp++ = *frontp++;
+        }
+        *endp = '\0';
+    }
+
+    return str;
+}
+
+int main(int argc, char *argv[])
+{
+
+    // startup
+    clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+    fprintf(stdout, "%s v%2d.%02d\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
+    log_init();
+
+    // handle signals, SIGINT
+    struct sigaction act;
+    act.sa_handler = intHandler;
+    sigaction(SIGINT, &act, NULL);
+    // a query client that hangs up before its answer is written must not end the program
+    signal(SIGPIPE, SIG_IGN);
+
+#ifdef DECODER_BENCH
+    return decoder_bench();
+#endif
+    if (argc != 2)
+    {
+        log_syslog(LOG_ERR, "Start program with a single argument pointing to yaml config file");
+        fprintf(stderr, "Start program with a single argument pointing to yaml config file\n");
+        exit(1);
+    }
+
+    config_t config;
+
+    int sensor_count;
+    sensor_count = parser(&config, argv);
+    startup_mark(STARTUP_CONFIG);
+    stats_init(&config);
+    history_init(&config);
+    query_init(&config, sensor_count);
+    readings_ring_init(&config, sensor_count);
+    filter_init(&config, sensor_count);
+    census_init(&config, sensor_count);
+    claim_init(&config, sensor_count);
+    trace_init(&config);
+    reading_config = &config;
+    decoder_init(&config, sensor_count);
+    crypto_init(&config, sensor_count);
+
+    int x;
+    for (x = 0; x < sensor_count; x++)
+    {
+        if (config.publish_type)
+        {
+            config.sensors[x].my_id = config.sensors[x].unique;
+        }
+        else
+        {
+            config.sensors[x].my_id = config.sensors[x].mac;
+        }
+    }
+    logging_level = config.logging_level;
+
+    if (config.discovery_prefix[0] == '\0')
+    {
+        strcpy(config.discovery_prefix, "homeassistant");
+    }
+    mqtt_policy_init(&config);
+    availability_init(&config, sensor_count);
+
+    if (logging_level > LOG_NOTICE)
+    {
+        print_data(sensor_count, &config);
+    }
+
+    int hci_devs_num;
+    struct hci_dev_info *hci_devs;
+
+    // bluetooth adapter mac address
+    char bluetooth_adapter_mac[19];
+    // adapter number
+    int bluetooth_adapter_number;
+
+    // get the info about each of the bluetooth adapters in system
+    if (hci_devlist(&hci_devs, &hci_devs_num))
+    {
+
+        log_syslog(LOG_ERR, "Couldn't enumerate HCI devices: %s", strerror(errno));
+        fprintf(stderr, "Couldn't enumerate HCI devices: %s", strerror(errno));
+        exit(1);
+    }
+    else
+    {
+        fprintf(stdout, "%u Bluetooth adapter(s) in system.\n", hci_devs_num);
+    }
+
+    // get requested adapter number from command line
+    bluetooth_adapter_number = config.bluetooth_adapter;
+
+    int ble_scan_type; // 0 = passive, 1 = active scan
+
+    ble_scan_type = config.scan_type;
+
+    if (ble_scan_type != 1)
+    {
+        ble_scan_type = 0;
+    }
+
+    //int ble_scan_interval = 65; // value * 0.625 ms, scan every 41 milliseconds
+    //int ble_scan_window = 750; // value * 0.625 ms, window 469 milliseconds
+    int ble_scan_window = 48;     // value * 0.625 ms, window 30 milliseconds
+    int ble_scan_interval = 1500; // value * 0.625 ms, scan every 975 milliseconds
+
+    ble_scan_window = config.scan_window;
+
+    if (ble_scan_window == 0)
+    {
+        ble_scan_window = 48;
+    }
+
+    ble_scan_interval = config.scan_interval;
+
+    if (ble_scan_interval == 0)
+    {
+        ble_scan_interval = 1500;
+    }
+
+    if (bluetooth_adapter_number < 0 || bluetooth_adapter_number > hci_devs_num - 1)
+    {
+        log_syslog(LOG_ERR, "Enter bluetooth adapter number between 0 and %u !!", hci_devs_num - 1);
+        fprintf(stderr, "Enter bluetooth adapter number between 0 and %u !!\n", hci_devs_num - 1);
+        exit(1);
+    }
+
+    // get MAC address for adapter selected
+    strcpy(bluetooth_adapter_mac, batostr(&hci_devs[bluetooth_adapter_number].bdaddr));
+
+    // log startup of program
+    // strcpy(log_message, "test message *****");
+    setlogmask(LOG_UPTO(LOG_INFO));
+    openlog(PROGRAM_NAME, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+    log_syslog(LOG_INFO, "Starting.");
+
+    // maximum number of sensors
+    // #define MAXIMUM_UNITS 40
+    // number of devices read from configuration file
+    int mac_total;
+
+    // total number of devices read from configuration file
+    mac_total = sensor_count;
+
+    fprintf(stdout, "Total devices in configuration file : %d\n", mac_total);
+
+    // // create the MQTT topic from the base topic string and the MAC address of sensor
+    // int topic_length;
+    // char topic_buffer[200];
+    // int topic_buffer_size = 200;
+
+    // initialize MQTT
+    pthread_t mqtt_startup_thread;
+    mqtt_startup_t mqtt_startup_args;
+
+    // set MQTT client ID to program name plus bluetooth mac address, to allow multiple instances on one machine
+    // or the gateway name, to run more than one instance with the same adapter against one server
+    snprintf(z_client_id_mqtt, MQTTCLIENTIDSIZE, "%s-%s", PROGRAM_NAME, config.gateway_name[0] ? config.gateway_name : bluetooth_adapter_mac);
+    fprintf(stdout, "MQTT client name : %s\n", z_client_id_mqtt);
+
+    mqtt_outputs_start(&config);
+
+    // connect and publish auto configuration in the background while the adapter is set up
+    mqtt_startup_args.config = &config;
+    mqtt_startup_args.sensor_count = sensor_count;
+    if (pthread_create(&mqtt_startup_thread, NULL, mqtt_startup, &mqtt_startup_args) != 0)
+    {
+        fprintf(stderr, "Could not start MQTT startup thread: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // Get HCI device.
+
+    int bluetooth_device = hci_open_dev(hci_get_route(&hci_devs[bluetooth_adapter_number].bdaddr));
+
+    log_syslog(LOG_INFO, "Bluetooth Adapter : %u has MAC address : %s", bluetooth_adapter_number, bluetooth_adapter_mac);
+    fprintf(stdout, "Bluetooth Adapter : %u has MAC address : %s\n", bluetooth_adapter_number, bluetooth_adapter_mac);
+
+    if (bluetooth_device < 0)
+    {
+        log_syslog(LOG_ERR, "failed to open HCI device");
+        fprintf(stderr, "Failed to open HCI device, return code %d\n", bluetooth_device);
+        exit(1);
+    }
+
+    // Set BLE scan parameters
+
+    log_syslog(LOG_INFO, "Advertising scan type (0=passive, 1=active): %u", ble_scan_type);
+    fprintf(stdout, "Advertising scan type (0=passive, 1=active): %u\n", ble_scan_type);
+
+    log_syslog(LOG_INFO, "Advertising scan window : %u %.1f ms", ble_scan_window, ble_scan_window * 0.625);
+    fprintf(stdout, "Advertising scan window   : %4u, %4.1f ms\n", ble_scan_window, ble_scan_window * 0.625);
+
+    log_syslog(LOG_INFO, "Advertising scan interval : %u %.1f ms", ble_scan_interval, ble_scan_interval * 0.625);
+    fprintf(stdout, "Advertising scan interval : %4u, %4.1f ms\n", ble_scan_interval, ble_scan_interval * 0.625);
+
+    le_set_scan_parameters_cp scan_params_cp;
+    memset(&scan_params_cp, 0, sizeof(scan_params_cp));
+    // BLE PASSIVE OR ACTIVE SCAN ***************************************************************************************
+    scan_params_cp.type = ble_scan_type; // 0x00 for passive scan, 0x01 for active scan (to get scan response packets)
+    scan_params_cp.interval = htobs(ble_scan_interval);
+    scan_params_cp.window = htobs(ble_scan_window);
+    //     scan_params_cp.interval         = htobs(0x0010);
+    //     scan_params_cp.window           = htobs(0x0010);
+    scan_params_cp.own_bdaddr_type = 0x00; // Public Device Address (default).
+    scan_params_cp.filter = 0x00;          // Accept all.
+
+    // Set the scan parameters and event mask, enable scanning and filter the results.
+
+    const char *scan_failed = scan_start(bluetooth_device, &scan_params_cp, SCAN_HCI_TIMEOUT);
+    if (scan_failed != NULL)
+    {
+        hci_close_dev(bluetooth_device);
+        log_syslog(LOG_ERR, "%s", scan_failed);
+        fprintf(stderr, "%s, you must run this program as ROOT\n", scan_failed);
+        exit(1);
+    }
+
+    log_syslog(LOG_INFO, "Scanning....");
+    //     fprintf(stdout, "%s v%2d.%02d\n", PROGRAM_NAME, VERSION_MAJOR, VERSION_MINOR);
+    fprintf(stdout, "Scanning....\n");
+    fflush(stdout);
+    startup_mark(STARTUP_SCANNING);
+
+    hci_input_init(bluetooth_device, hci_devs[bluetooth_adapter_number].dev_id, &config);
+    scan_watchdog_init(&config, hci_devs[bluetooth_adapter_number].dev_id, &hci_devs[bluetooth_adapter_number].bdaddr, &scan_params_cp, time(NULL));
+
+    // bluetooth advertising packet, points into the current batch
+    uint8_t *ble_adv_buf;
+    evt_le_meta_event *meta_event;
+    le_advertising_info *adv_info;
+    ad_report_t report;
+    sensor_hot_t *hot;
+    const ble_decoder_t *decoder;
+    reading_t reading;
+    uint8_t decrypted[CRYPTO_MAX_DATA]; // service data of an encrypted report after decrypting
+    int bluetooth_adv_packet_length;
+
+    // create the MQTT topic from the base topic string and the MAC address of sensor
+    int topic_length;
+    char topic_buffer[200];
+    int topic_buffer_size = 200;
+
+    // MQTT payload buffer
+    int payload_length;
+    char payload_buffer[MAXIMUM_JSON_MESSAGE];
+
+    // int payload_buff_size = 300;
+
+    // holds current time of current advertising packet that is received
+    time_t rawtime = time(NULL);
+    struct tm tm = *gmtime(&rawtime);
+    struct tm *time_packet_received;
+
+    // get the current hour, keep track every time we roll over to a new hour
+    int hour_current;
+    int hour_last;
+
+    time_t gmt_time_now;
+    struct tm tnp = *gmtime(&gmt_time_now);
+
+    time(&gmt_time_now);
+    tnp = *gmtime(&gmt_time_now);
+    hour_current = tnp.tm_hour;
+
+    if (hour_current == 0)
+    {
+        hour_last = 23;
+    }
+    else
+    {
+        hour_last = hour_current - 1;
+    }
+
+    log_write(LOG_INFO, LOG_SINK_STDOUT, "current hour (GMT) = %d\nlast    hour (GMT) = %d\n", hour_current, hour_last);
+
+    // time the closed rolling statistics windows were last checked
+    time_t stats_last_check = 0;
+
+    // loop until SIGINT received
+    while (keep_running)
+    {
+        // SIGUSR1 received
+        if (trace_dump_requested)
+        {
+            trace_dump();
+        }
+
+        // check if we have rolled over to a new hour, if so send report of advertising packets receive in last hour
+        time(&gmt_time_now);
+        tnp = *gmtime(&gmt_time_now);
+
+        // publish the rolling statistics of windows that have closed, checked at most once a second
+        if (stats_window_count > 0 && gmt_time_now != stats_last_check)
+        {
+            stats_last_check = gmt_time_now;
+            stats_check(&config, sensor_count, gmt_time_now);
+        }
+
+        // sensors not heard for offline_after seconds
+        availability_check();
+
+        // restart scanning or reopen the adapter when nothing is heard or the adapter has gone
+        scan_watchdog_check(&bluetooth_device, gmt_time_now);
+
+        if (hour_current != tnp.tm_hour)
+        {
+            hour_current = tnp.tm_hour;
+            // check if new day
+            if (hour_current == 0)
+            {
+                hour_last = 23;
+            }
+            else
+            {
+                hour_last = hour_current - 1;
+            }
+
+            // don't publish right at top of hour, wait a few seconds
+            sleep(10);
+
+            log_write(LOG_INFO, LOG_SINK_STDOUT, "*********** =========\nHOUR ROLLOVER\ncurrent hour (GMT) = %d\nlast    hour (GMT) = %d\n", hour_current, hour_last);
+
+            time(&gmt_time_now);
+            tnp = *gmtime(&gmt_time_now);
+
+            // the counters of the whole gateway go at the end of the message and always fit, the entries of the
+            // sensors fill the space before them, sensors that do not fit any more are only counted
+            char count_string_buffer[MAXIMUM_JSON_MESSAGE] = "";
+            int count_string_size = MAXIMUM_JSON_MESSAGE;
+            int count_string_length;
+            int sensor_counts[MAX_SENSORS];
+            int sensor_rejected[MAX_SENSORS];
+            int sensors_omitted = 0;
+            int entry_length;
+
+            int total_advertising_packets = 0;
+            int total_rejected = 0;
+            int n;
+            for (n = 0; n <= mac_total - 1; n++)
+            {
+                // readings the glitch filter dropped in the last hour
+                sensor_counts[n] = sensor_hot[n].readings_per_hour;
+                sensor_rejected[n] = sensor_filters[n].rejected_range + sensor_filters[n].rejected_rate;
+
+                log_write(LOG_INFO, LOG_SINK_STDOUT, "Location : %s packets received in last hour : %d %s\n", config.sensors[n].mac, sensor_hot[n].readings_per_hour, config.sensors[n].location);
+                if (sensor_rejected[n] > 0)
+                {
+                    log_write(LOG_INFO, LOG_SINK_STDOUT, "Location : %s readings rejected in last hour : %d out of range, %d rate of change\n", config.sensors[n].mac, sensor_filters[n].rejected_range, sensor_filters[n].rejected_rate);
+                }
+                total_advertising_packets = total_advertising_packets + sensor_counts[n];
+                total_rejected = total_rejected + sensor_rejected[n];
+                sensor_hot[n].readings_per_hour = 0;
+                sensor_filters[n].rejected_range = 0;
+                sensor_filters[n].rejected_rate = 0;
+            }
+
+            // the total of all advertising packets for all sensors of this type in last hour, then the counters of
+            // the radio, decryption, scan watchdog, availability, coordination and outputs
+            count_string_length = snprintf(count_string_buffer, count_string_size, "\"total_adv_packets\":%d, \"total_rejected\":%d, \"foreign_packets\":%u", total_advertising_packets, total_rejected, census_packets);
+            hci_input_report(count_string_buffer + count_string_length, count_string_size - count_string_length);
+            count_string_length += strlen(count_string_buffer + count_string_length);
+            crypto_report(&config, count_string_buffer + count_string_length, count_string_size - count_string_length);
+            count_string_length += strlen(count_string_buffer + count_string_length);
+            scan_watchdog_report(count_string_buffer + count_string_length, count_string_size - count_string_length);
+            count_string_length += strlen(count_string_buffer + count_string_length);
+            if (availability_config != NULL)
+            {
+                snprintf(count_string_buffer + count_string_length, count_string_size - count_string_length, ", \"offline_sensors\":%d", availability_offline_count());
+                count_string_length += strlen(count_string_buffer + count_string_length);
+            }
+            if (claim_config != NULL)
+            {
+                snprintf(count_string_buffer + count_string_length, count_string_size - count_string_length, ", \"publishing_sensors\":%d", claim_publishing_count());
+                count_string_length += strlen(count_string_buffer + count_string_length);
+            }
+            snprintf(count_string_buffer + count_string_length, count_string_size - count_string_length, ", \"output_dropped\":%d}", mqtt_outputs_report());
+            count_string_length += strlen(count_string_buffer + count_string_length);
+
+            // create JSON string with timestamp, count and location for each known device
+            payload_length = snprintf(payload_buffer, MAXIMUM_JSON_MESSAGE,
+                                      "{\"timestamp\":\"%04d%02d%02d%02d%02d%02d\",",
+                                      tnp.tm_year + 1900, tnp.tm_mon + 1, tnp.tm_mday, tnp.tm_hour, tnp.tm_min, tnp.tm_sec);
+            for (n = 0; n <= mac_total - 1; n++)
+            {
+                // room is kept for the counters and for sensors_omitted
+                entry_length = snprintf(payload_buffer + payload_length, MAXIMUM_JSON_MESSAGE - payload_length, "\"%s\":{\"count\":%d, \"location\":\"%s\", \"rejected\":%d},",
+                                        config.sensors[n].mac, sensor_counts[n], config.sensors[n].location, sensor_rejected[n]);
+                if (payload_length + entry_length + 32 + count_string_length >= MAXIMUM_JSON_MESSAGE)
+                {
+                    sensors_omitted = mac_total - n;
+                    break;
+                }
+                payload_length += entry_length;
+            }
+            if (sensors_omitted > 0)
+            {
+                log_write(LOG_WARNING, LOG_SINK_ALL, "Hourly statistics too long, counts of %d sensors left out\n", sensors_omitted);
+                payload_length += snprintf(payload_buffer + payload_length, MAXIMUM_JSON_MESSAGE - payload_length, "\"sensors_omitted\":%d, ", sensors_omitted);
+            }
+            payload_length += snprintf(payload_buffer + payload_length, MAXIMUM_JSON_MESSAGE - payload_length, "%s", count_string_buffer);
+
+            log_write(LOG_INFO, LOG_SINK_STDOUT, "payload_buffer JSON : %s\n", payload_buffer);
+
+            // publish it to a statistics topic under the root topic
+            topic_length = snprintf(topic_buffer, topic_buffer_size,
+                                    "%s%s",
+                                    config.mqtt_base_topic, topic_statistics);
+
+            // publish the message, held until the MQTT server is ready
+            mqtt_publish_message(MQTT_CLASS_STATS, -1, topic_buffer, payload_buffer, payload_length);
+
+            // devices heard in the last hour that are not configured
+            if (config.census_top > 0)
+            {
+                payload_length = census_report(payload_buffer, MAXIMUM_JSON_MESSAGE, config.census_top);
+                log_write(LOG_INFO, LOG_SINK_STDOUT, "census JSON : %s\n", payload_buffer);
+                topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, topic_census);
+                mqtt_publish_message(MQTT_CLASS_STATS, -1, topic_buffer, payload_buffer, payload_length);
+            }
+        }
+
+        // wait for the scan watchdog to find the adapter again
+        if (bluetooth_device < 0)
+        {
+            sleep(1);
+            continue;
+        }
+
+        // get the bluetooth packet
+        bluetooth_adv_packet_length = hci_input_next(bluetooth_device, &ble_adv_buf);
+        // apparently there can be multiple advertisement packets with the packet received
+        // packet type, event header, subevent and number of reports
+        if (bluetooth_adv_packet_length >= HCI_EVENT_HDR_SIZE + 3)
+        {
+            meta_event = (evt_le_meta_event *)(ble_adv_buf + HCI_EVENT_HDR_SIZE + 1);
+            if (meta_event->subevent == EVT_LE_ADVERTISING_REPORT)
+            {
+
+                uint8_t reports_count = meta_event->data[0];
+                const uint8_t *offset = meta_event->data + 1;
+                const uint8_t *next_offset;
+                while (reports_count--)
+                {
+                    // this is the advertising specific data within the packet
+                    adv_info = (le_advertising_info *)offset;
+
+                    // a report that does not fit in what was read ends the event
+                    next_offset = ad_parse(adv_info, ble_adv_buf + bluetooth_adv_packet_length, &report);
+                    if (next_offset == NULL)
+                    {
+                        break;
+                    }
+
+                    // get the MAC address of the device that sent the advertising packet
+                    char addr[18];
+                    uint64_t mac_key = census_key(&(adv_info->bdaddr));
+
+                    // check the MAC address of the BLE device and see if it is in out list of deies to monitor
+
+                    int mac_match = 0;
+                    int mac_index = 0;
+                    int i_match;
+
+                    for (i_match = 0; i_match < mac_total; ++i_match)
+                    {
+                        if (mac_key == sensor_mac_keys[i_match])
+                        {
+                            mac_match = 1;
+                            // keep a pointer to the mac address we matched
+                            mac_index = i_match;
+                        }
+                    }
+
+                    // keep the raw report in the trace ring
+                    if (trace_size > 0 && (mac_match == 1 || trace_foreign))
+                    {
+                        trace_record(adv_info, report.rssi);
+                    }
+
+                    // the address string is only needed for configured sensors
+                    if (mac_match == 1)
+                    {
+                        ba2str(&(adv_info->bdaddr), addr);
+                    }
+                    else
+                    {
+                        census_add(mac_key, report.rssi);
+                    }
+
+                    // found the mac address in our list we are interested in, so decipher it's data
+                    // if (1 == 1)
+                    if (mac_match == 1)
+                    {
+
+                        // the sensor's decoder, from its type at startup
+                        hot = &sensor_hot[mac_index];
+                        decoder = hot->decoder;
+                        reading.value_count = 0;
+                        if (decoder != NULL && (hot->crypto == NULL || crypto_decrypt(hot->crypto, &report, decrypted)) &&
+                            decoder->match(decoder, &report) && decoder->decode(decoder, &report, &reading))
+                        {
+                            //get the time that we received the advertising packet
+                            time(&rawtime);
+                            tm = *gmtime(&rawtime);
+                            time_packet_received = localtime(&rawtime);
+
+                            log_debug("=========\n"
+                                      "Current local time and date: %s"
+                                      "mac address =  %s  location = %s device type = %d "
+                                      "advertising_packet_type = %03d\n"
+                                      "rssi         = %03d\n"
+                                      "temp c       =  %.1f\n"
+                                      "humidity pct =  %.1f\n"
+                                      "battery pct  = %3d\n",
+                                      asctime(time_packet_received),
+                                      addr, config.sensors[mac_index].location, config.sensors[mac_index].type,
+                                      report.event_type,
+                                      report.rssi,
+                                      reading.temperature_celsius,
+                                      reading.humidity,
+                                      reading.battery_pct);
+
+                            // count the number of advertising packets we get from each unit
+                            hot->readings_per_hour++;
+
+                            // glitch filter, then rolling statistics and local history. rejected readings are not published
+                            // the filter may replace the readings with the median of the last few
+                            if (sensor_reading(mac_index, rawtime, &reading, report.rssi))
+                            {
+                                payload_length = state_payload(&config, mac_index, &tm, addr, report.rssi, &reading, payload_buffer, MAXIMUM_JSON_MESSAGE);
+                                if (config.publish_type == 1)
+                                {
+                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s/state", config.mqtt_base_topic, config.sensors[mac_index].my_id);
+                                }
+                                else
+                                {
+                                    topic_length = snprintf(topic_buffer, topic_buffer_size, "%s%s", config.mqtt_base_topic, config.sensors[mac_index].my_id);
+                                }
+
+                                if (payload_length >= MAXIMUM_JSON_MESSAGE)
+                                {
+                                    log_write(LOG_ERR, LOG_SINK_ALL, "MQTT payload too long, %d\n", payload_length);
+                                    exit(-1);
+                                }
+
+                                // publish the message, held until the MQTT server is ready
+                                mqtt_publish_message(MQTT_CLASS_STATE, mac_index, topic_buffer, payload_buffer, payload_length);
+                            }
+                        }
+
+                        // device type 99 = decoding
+                        // the raw reports are in the trace ring, dump them with SIGUSR1 or "trace" on the query socket
+                        if (hot->type == 99)
+                        {
+                            log_debug("mac address =  %s  location = %s device type = %d event type = %d, recorded in packet trace\n",
+                                      addr, config.sensors[mac_index].location, config.sensors[mac_index].type, adv_info->evt_type);
+                        }
+                        // end device type 99
+
+                    } // end of Matched MAC address
+
+                    // if there are multiple advertising packets loop thru them
+                    offset = next_offset;
+                }
+            }
+        }
+    }
+
+    // <ctrl>-c to exit program received
+    log_write(LOG_INFO, LOG_SINK_ALL, "<ctrl>-c signal received, exiting.\n");
+
+    // Disable scanning, unless the adapter is gone.
+    if (bluetooth_device >= 0)
+    {
+        if (!scan_stop(bluetooth_device, SCAN_HCI_TIMEOUT))
+        {
+            hci_close_dev(bluetooth_device);
+            log_write(LOG_ERR, LOG_SINK_ALL, "Failed to disable scan\n");
+            exit(1);
+        }
+        hci_close_dev(bluetooth_device);
+    }
+
+    // unmap the history segments, the kernel writes back what is still dirty
+    history_shutdown();
+
+    // the MQTT startup thread sends what is still queued while the server takes it, then it is done with the client
+    pthread_join(mqtt_startup_thread, NULL);
+
+    // end MQTT session
+    MQTTClient_disconnect(mqtt_primary.client, 10000);
+    MQTTClient_destroy(&mqtt_primary.client);
+
+    exit(0);
+}
+
+unsigned int
+parser(config_t *config, char **argv)
+{
+    /* Open file & declare libyaml types */
+    FILE *fp = fopen(argv[1], "r");
+
+    if (fp == NULL)
+    {
+        fprintf(stdout, "ERROR: Failed to open config file: %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    yaml_parser_t parser;
+    yaml_event_t event;
+
+    // settings missing from the file are left as 0 / empty string
+    memset(config, 0, sizeof(*config));
+    config->qos_state = QOS;
+    config->qos_discovery = QOS;
+    config->retain_discovery = 1;
+    config->qos_stats = QOS;
+    config->qos_alert = QOS;
+    config->retain_alert = 1;
+    config->census_top = 10;
+    config->trace_entries = 1024;
+    config->hci_batch = 16;
+    config->hci_receive_buffer = 1048576;
+    config->scan_watchdog = 120;
+    config->scan_watchdog_percent = 5;
+    config->mqtt_queue = 128;
+    config->readings_ring_size = 1024;
+    config->claim_interval = 30;
+    config->claim_timeout = 120;
+    config->claim_hysteresis = 5;
+
+    bool seq_status = 0;      /* IN or OUT of sequence index, init to OUT */
+    unsigned int map_seq = 0; /* Index of mapping inside sequence */
+
+    init_prs(fp, &parser); /* Initiliaze parser & open file */
+
+    do
+    {
+        parse_next(&parser, &event); /* Parse new event */
+
+        /* Decide what to do with each event */
+        event_switch(&seq_status, &map_seq, config, &parser, &event, fp);
+
+        if (event.type != YAML_STREAM_END_EVENT)
+        {
+            yaml_event_delete(&event);
+        }
+
+    } while (event.type != YAML_STREAM_END_EVENT);
+
+    clean_prs(fp, &parser, &event); /* clean parser & close file */
+
+    return map_seq;
+}
+
+// which list the mappings of a sequence belong to, set by the label in front of it
+enum
+{
+    PARSE_SENSORS,
+    PARSE_MQTT_OUTPUTS,
+    PARSE_DECODER_SPECS
+};
+int parse_sequence = PARSE_SENSORS;
+
+void event_switch(bool *seq_status, unsigned int *map_seq, config_t *config,
+                  yaml_parser_t *parser, yaml_event_t *event, FILE *fp)
+{
+    switch (event->type)
+    {
+    case YAML_STREAM_START_EVENT:
+        break;
+    case YAML_STREAM_END_EVENT:
+        break;
+    case YAML_DOCUMENT_START_EVENT:
+        break;
+    case YAML_DOCUMENT_END_EVENT:
+        break;
+    case YAML_SEQUENCE_START_EVENT:
+        (*seq_status) = true;
+        break;
+    case YAML_SEQUENCE_END_EVENT:
+        (*seq_status) = false;
+        break;
+    case YAML_MAPPING_START_EVENT:
+        if (*seq_status == 1 && parse_sequence == PARSE_MQTT_OUTPUTS)
+        {
+            if (config->mqtt_output_count == MAX_MQTT_OUTPUTS)
+            {
+                fprintf(stderr, "At most %d mqtt_outputs\n", MAX_MQTT_OUTPUTS);
+                exit(EXIT_FAILURE);
+            }
+            config->mqtt_outputs[config->mqtt_output_count].qos = -1;
+            config->mqtt_outputs[config->mqtt_output_count].retain = -1;
+            config->mqtt_outputs[config->mqtt_output_count].queue = 128;
+            config->mqtt_output_count++;
+        }
+        else if (*seq_status == 1 && parse_sequence == PARSE_DECODER_SPECS)
+        {
+            if (config->decoder_spec_count == MAX_DECODER_SPECS)
+            {
+                fprintf(stderr, "At most %d decoder_specs\n", MAX_DECODER_SPECS);
+                exit(EXIT_FAILURE);
+            }
+            config->decoder_specs[config->decoder_spec_count].event_type = -1;
+            config->decoder_specs[config->decoder_spec_count].manufacturer = -1;
+            config->decoder_specs[config->decoder_spec_count].service = -1;
+            config->decoder_spec_count++;
+        }
+        else if (*seq_status == 1)
+        {
+            if (*map_seq == MAX_SENSORS)
+            {
+                fprintf(stderr, "At most %d sensors\n", MAX_SENSORS);
+                exit(EXIT_FAILURE);
+            }
+            (*map_seq)++;
+            /* per sensor filter settings not given fall back to the top level ones */
+            config->sensors[(*map_seq) - 1].filter_median = -1;
+            config->sensors[(*map_seq) - 1].filter_temp_min = NAN;
+            config->sensors[(*map_seq) - 1].filter_temp_max = NAN;
+            config->sensors[(*map_seq) - 1].filter_temp_rate = NAN;
+            config->sensors[(*map_seq) - 1].filter_hum_rate = NAN;
+            config->sensors[(*map_seq) - 1].offline_after = -1;
+            config->sensors[(*map_seq) - 1].mac = "";
+            config->sensors[(*map_seq) - 1].location = "";
+            config->sensors[(*map_seq) - 1].name = "";
+            config->sensors[(*map_seq) - 1].unique = "";
+            config->sensors[(*map_seq) - 1].my_id = "";
+            config->sensors[(*map_seq) - 1].make = "";
+            config->sensors[(*map_seq) - 1].model = "";
+            config->sensors[(*map_seq) - 1].bindkey = "";
+        }
+        break;
+    case YAML_MAPPING_END_EVENT:
+        break;
+    case YAML_ALIAS_EVENT:
+        printf(" ERROR: Got alias (anchor %s)\n",
+               event->data.alias.anchor);
+        exit(EXIT_FAILURE);
+        break;
+    case YAML_SCALAR_EVENT:
+        to_data(seq_status, map_seq, config, parser, event, fp);
+        break;
+    case YAML_NO_EVENT:
+        puts(" ERROR: No event!");
+        exit(EXIT_FAILURE);
+        break;
+    }
+}
+
+void to_data(bool *seq_status, unsigned int *map_seq, config_t *config,
+             yaml_parser_t *parser, yaml_event_t *event, FILE *fp)
+{
+    char *buf = (char *)event->data.scalar.value;
+
+    /* Dictionary */
+    char *mqtt_server_url = "mqtt_server_url";
+    char *mqtt_base_topic = "mqtt_base_topic";
+    char *mqtt_username = "mqtt_username";
+    char *mqtt_password = "mqtt_password";
+    char *bluetooth_adapter = "bluetooth_adapter";
+    char *scan_type = "scan_type";
+    char *scan_window = "scan_window";
+    char *scan_interval = "scan_interval";
+    char *publish_type = "publish_type";
+    char *auto_configure = "auto_configure";
+    char *auto_conf_stats = "auto_conf_stats";
+    char *auto_conf_tempf = "auto_conf_tempf";
+    char *auto_conf_tempc = "auto_conf_tempc";
+    char *auto_conf_hum = "auto_conf_hum";
+    char *auto_conf_battery = "auto_conf_battery";
+    char *auto_conf_voltage = "auto_conf_voltage";
+    char *auto_conf_signal = "auto_conf_signal";
+    char *discovery_state_file = "discovery_state_file";
+    char *discovery_inflight = "discovery_inflight";
+    char *discovery_type = "discovery_type";
+    char *discovery_prefix = "discovery_prefix";
+    char *stats_windows = "stats_windows";
+    char *history_directory = "history_directory";
+    char *history_interval = "history_interval";
+    char *history_retention_days = "history_retention_days";
+    char *query_socket = "query_socket";
+    char *readings_ring = "readings_ring";
+    char *readings_ring_size = "readings_ring_size";
+    char *filter_median = "filter_median";
+    char *filter_temp_min = "filter_temp_min";
+    char *filter_temp_max = "filter_temp_max";
+    char *filter_temp_rate = "filter_temp_rate";
+    char *filter_hum_rate = "filter_hum_rate";
+    char *qos_state = "qos_state";
+    char *retain_state = "retain_state";
+    char *qos_discovery = "qos_discovery";
+    char *retain_discovery = "retain_discovery";
+    char *qos_stats = "qos_stats";
+    char *retain_stats = "retain_stats";
+    char *qos_alert = "qos_alert";
+    char *retain_alert = "retain_alert";
+    char *mqtt_version = "mqtt_version";
+    char *mqtt_state_expiry = "mqtt_state_expiry";
+    char *mqtt_queue = "mqtt_queue";
+    char *census_top = "census_top";
+    char *trace_entries = "trace_entries";
+    char *trace_foreign = "trace_foreign";
+    char *hci_batch = "hci_batch";
+    char *hci_receive_buffer = "hci_receive_buffer";
+    char *scan_watchdog = "scan_watchdog";
+    char *scan_watchdog_percent = "scan_watchdog_percent";
+    char *syslog_address = "syslog_address";
+    char *logging_level = "logging_level";
+    char *sensors = "sensors";
+    char *mqtt_outputs = "mqtt_outputs";
+    char *gateway_name = "gateway_name";
+    char *coordination = "coordination";
+    char *claim_interval = "claim_interval";
+    char *claim_timeout = "claim_timeout";
+    char *claim_hysteresis = "claim_hysteresis";
+    char *offline_after = "offline_after";
+    char *decoder_directory = "decoder_directory";
+    char *decoder_specs = "decoder_specs";
+
+    if (!strcmp(buf, mqtt_server_url))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->mqtt_server_url, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, mqtt_base_topic))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->mqtt_base_topic, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, mqtt_username))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->mqtt_username, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, mqtt_password))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->mqtt_password, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, bluetooth_adapter))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->bluetooth_adapter = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, scan_type))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->scan_type = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, scan_window))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->scan_window = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, scan_interval))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->scan_interval = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, publish_type))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->publish_type = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_configure))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_configure = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_stats))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_stats = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_tempf))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_tempf = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_tempc))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_tempc = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_hum))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_hum = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_battery))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_battery = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_voltage))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_voltage = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, auto_conf_signal))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->auto_conf_signal = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, discovery_state_file))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->discovery_state_file, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, discovery_inflight))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->discovery_inflight = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, discovery_type))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->discovery_type = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, discovery_prefix))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->discovery_prefix, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, stats_windows))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->stats_windows, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, history_directory))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->history_directory, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, history_interval))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->history_interval = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, history_retention_days))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->history_retention_days = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, query_socket))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->query_socket, (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, readings_ring) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(config->readings_ring, sizeof(config->readings_ring), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, readings_ring_size) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->readings_ring_size = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, filter_median) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->filter_median = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, filter_temp_min) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->filter_temp_min = strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, filter_temp_max) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->filter_temp_max = strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, filter_temp_rate) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->filter_temp_rate = strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, filter_hum_rate) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->filter_hum_rate = strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, qos_state) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->qos_state = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, retain_state) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->retain_state = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, qos_discovery) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->qos_discovery = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, retain_discovery) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->retain_discovery = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, qos_stats) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->qos_stats = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, retain_stats) && (*seq_status) == false)
     {
-    case YAML_STREAM_START_EVENT:
-        break;
-    case YAML_STREAM_END_EVENT:
-        break;
-    case YAML_DOCUMENT_START_EVENT:
-        break;
-    case YAML_DOCUMENT_END_EVENT:
-        break;
-    case YAML_SEQUENCE_START_EVENT:
-        (*seq_status) = true;
-        break;
-    case YAML_SEQUENCE_END_EVENT:
-        (*seq_status) = false;
-        break;
-    case YAML_MAPPING_START_EVENT:
-        if (*seq_status == 1)
-        {
-            (*map_seq)++;
-        }
-        break;
-    case YAML_MAPPING_END_EVENT:
-        break;
-    case YAML_ALIAS_EVENT:
-        printf(" ERROR: Got alias (anchor %s)\n",
-               event->data.alias.anchor);
-        exit(EXIT_FAILURE);
-        break;
-    case YAML_SCALAR_EVENT:
-        to_data(seq_status, map_seq, config, parser, event, fp);
-        break;
-    case YAML_NO_EVENT:
-        puts(" ERROR: No event!");
-        exit(EXIT_FAILURE);
-        break;
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->retain_stats = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-}
-
-void to_data(bool *seq_status, unsigned int *map_seq, config_t *config,
-             yaml_parser_t *parser, yaml_event_t *event, FILE *fp)
-{
-    char *buf = (char *)event->data.scalar.value;
-
-    /* Dictionary */
-    char *mqtt_server_url = "mqtt_server_url";
-    char *mqtt_base_topic = "mqtt_base_topic";
-    char *mqtt_username = "mqtt_username";
-    char *mqtt_password = "mqtt_password";
-    char *bluetooth_adapter = "bluetooth_adapter";
-    char *scan_type = "scan_type";
-    char *scan_window = "scan_window";
-    char *scan_interval = "scan_interval";
-    char *publish_type = "publish_type";
-    char *auto_configure = "auto_configure";
-    char *auto_conf_stats = "auto_conf_stats";
-    char *auto_conf_tempf = "auto_conf_tempf";
-    char *auto_conf_tempc = "auto_conf_tempc";
-    char *auto_conf_hum = "auto_conf_hum";
-    char *auto_conf_battery = "auto_conf_battery";
-    char *auto_conf_voltage = "auto_conf_voltage";
-    char *auto_conf_signal = "auto_conf_signal";
-    char *syslog_address = "syslog_address";
-    char *logging_level = "logging_level";
-    char *sensors = "sensors";
-
-    if (!strcmp(buf, mqtt_server_url))
+    else if (!strcmp(buf, qos_alert) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->mqtt_server_url, (char *)event->data.scalar.value);
+        config->qos_alert = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, mqtt_base_topic))
+    else if (!strcmp(buf, retain_alert) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->mqtt_base_topic, (char *)event->data.scalar.value);
+        config->retain_alert = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, mqtt_username))
+    else if (!strcmp(buf, mqtt_version) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->mqtt_username, (char *)event->data.scalar.value);
+        config->mqtt_version = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, mqtt_password))
+    else if (!strcmp(buf, mqtt_state_expiry) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->mqtt_password, (char *)event->data.scalar.value);
+        config->mqtt_state_expiry = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, bluetooth_adapter))
+    else if (!strcmp(buf, mqtt_queue) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->bluetooth_adapter = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->mqtt_queue = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, scan_type))
+    else if (!strcmp(buf, census_top) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->scan_type = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->census_top = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, scan_window))
+    else if (!strcmp(buf, trace_entries) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->scan_window = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->trace_entries = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, scan_interval))
+    else if (!strcmp(buf, trace_foreign) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->scan_interval = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->trace_foreign = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, publish_type))
+    else if (!strcmp(buf, hci_batch) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->publish_type = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->hci_batch = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_configure))
+    else if (!strcmp(buf, hci_receive_buffer) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_configure = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->hci_receive_buffer = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_conf_stats))
+    else if (!strcmp(buf, scan_watchdog) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_stats = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->scan_watchdog = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_conf_tempf))
+    else if (!strcmp(buf, scan_watchdog_percent) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_tempf = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->scan_watchdog_percent = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_conf_tempc))
+    else if (!strcmp(buf, gateway_name) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_tempc = strtol((char *)event->data.scalar.value, NULL, 10);
+        snprintf(config->gateway_name, sizeof(config->gateway_name), "%s", (char *)event->data.scalar.value);
     }
-    else if (!strcmp(buf, auto_conf_hum))
+    else if (!strcmp(buf, coordination) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_hum = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->coordination = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_conf_battery))
+    else if (!strcmp(buf, claim_interval) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_battery = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->claim_interval = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_conf_voltage))
+    else if (!strcmp(buf, claim_timeout) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_voltage = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->claim_timeout = strtol((char *)event->data.scalar.value, NULL, 10);
     }
-    else if (!strcmp(buf, auto_conf_signal))
+    else if (!strcmp(buf, claim_hysteresis) && (*seq_status) == false)
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->auto_conf_signal = strtol((char *)event->data.scalar.value, NULL, 10);
+        config->claim_hysteresis = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, offline_after) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->offline_after = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, decoder_directory) && (*seq_status) == false)
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        strcpy(config->decoder_directory, (char *)event->data.scalar.value);
     }
     else if (!strcmp(buf, syslog_address))
     {
@@ -2399,6 +8101,16 @@ void to_data(bool *seq_status, unsigned int *map_seq, config_t *config,
         parse_next(parser, event);
         config->logging_level = strtol((char *)event->data.scalar.value, NULL, 10);
     }
+    else if ((*seq_status) == true && parse_sequence == PARSE_MQTT_OUTPUTS)
+    {
+        /* Data from sequence of MQTT outputs */
+        to_data_from_output_map(buf, config, parser, event, fp);
+    }
+    else if ((*seq_status) == true && parse_sequence == PARSE_DECODER_SPECS)
+    {
+        /* Data from sequence of decoder specs */
+        to_data_from_decoder_spec_map(buf, config, parser, event, fp);
+    }
     else if ((*seq_status) == true)
     {
         /* Data from sequence of sensors */
@@ -2406,7 +8118,30 @@ void to_data(bool *seq_status, unsigned int *map_seq, config_t *config,
     }
     else if (!strcmp(buf, sensors))
     {
-        /* Do nothing, "sensors" is just the label of mapping's sequence */
+        /* "sensors" is just the label of mapping's sequence */
+        parse_sequence = PARSE_SENSORS;
+    }
+    else if (!strcmp(buf, mqtt_outputs))
+    {
+        /* label of the outputs sequence, or empty when there are none */
+        parse_sequence = PARSE_MQTT_OUTPUTS;
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        if (event->type == YAML_SEQUENCE_START_EVENT)
+        {
+            (*seq_status) = true;
+        }
+    }
+    else if (!strcmp(buf, decoder_specs))
+    {
+        /* label of the decoder specs sequence, or empty when there are none */
+        parse_sequence = PARSE_DECODER_SPECS;
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        if (event->type == YAML_SEQUENCE_START_EVENT)
+        {
+            (*seq_status) = true;
+        }
     }
     else
     {
@@ -2425,13 +8160,19 @@ void to_data_from_map(char *buf, unsigned int *map_seq, config_t *config,
     char *mac = "mac";
     char *location = "location";
     char *unique = "unique";
+    char *filter_median = "filter_median";
+    char *filter_temp_min = "filter_temp_min";
+    char *filter_temp_max = "filter_temp_max";
+    char *filter_temp_rate = "filter_temp_rate";
+    char *filter_hum_rate = "filter_hum_rate";
+    char *offline_after = "offline_after";
+    char *bindkey = "bindkey";
 
     if (!strcmp(buf, name))
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->sensors[(*map_seq) - 1].name,
-               (char *)event->data.scalar.value);
+        config->sensors[(*map_seq) - 1].name = string_intern((char *)event->data.scalar.value);
     }
     else if (!strcmp(buf, type))
     {
@@ -2444,26 +8185,231 @@ void to_data_from_map(char *buf, unsigned int *map_seq, config_t *config,
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        config->sensors[(*map_seq) - 1].readings_per_hour = 0;
-        strcpy(config->sensors[(*map_seq) - 1].mac,
-               (char *)event->data.scalar.value);
+        config->sensors[(*map_seq) - 1].mac = string_intern((char *)event->data.scalar.value);
     }
     else if (!strcmp(buf, location))
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->sensors[(*map_seq) - 1].location,
-               (char *)event->data.scalar.value);
+        config->sensors[(*map_seq) - 1].location = string_intern((char *)event->data.scalar.value);
     }
     else if (!strcmp(buf, unique))
     {
         yaml_event_delete(event);
         parse_next(parser, event);
-        strcpy(config->sensors[(*map_seq) - 1].unique,
-               (char *)event->data.scalar.value);
+        config->sensors[(*map_seq) - 1].unique = string_intern((char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, filter_median))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].filter_median =
+            strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, filter_temp_min))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].filter_temp_min =
+            strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, filter_temp_max))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].filter_temp_max =
+            strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, filter_temp_rate))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].filter_temp_rate =
+            strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, filter_hum_rate))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].filter_hum_rate =
+            strtod((char *)event->data.scalar.value, NULL);
+    }
+    else if (!strcmp(buf, offline_after))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].offline_after =
+            strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, bindkey))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        config->sensors[(*map_seq) - 1].bindkey = string_intern((char *)event->data.scalar.value);
+    }
+    else
+    {
+        printf("\n -ERROR: Unknow variable in config file: %s\n", buf);
+        clean_prs(fp, parser, event);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void to_data_from_output_map(char *buf, config_t *config,
+                             yaml_parser_t *parser, yaml_event_t *event, FILE *fp)
+{
+    /* Dictionary */
+    char *url = "url";
+    char *username = "username";
+    char *password = "password";
+    char *topic_prefix = "topic_prefix";
+    char *qos = "qos";
+    char *retain = "retain";
+    char *queue = "queue";
+
+    mqtt_output_config_t *output = &config->mqtt_outputs[config->mqtt_output_count - 1];
+
+    if (!strcmp(buf, url))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(output->url, sizeof(output->url), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, username))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(output->username, sizeof(output->username), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, password))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(output->password, sizeof(output->password), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, topic_prefix))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(output->topic_prefix, sizeof(output->topic_prefix), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, qos))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        output->qos = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, retain))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        output->retain = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, queue))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        output->queue = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else
+    {
+        printf("\n -ERROR: Unknow variable in config file: %s\n", buf);
+        clean_prs(fp, parser, event);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void to_data_from_decoder_spec_map(char *buf, config_t *config,
+                                   yaml_parser_t *parser, yaml_event_t *event, FILE *fp)
+{
+    /* Dictionary */
+    char *type = "type";
+    char *make = "make";
+    char *model = "model";
+    char *entities = "entities";
+    char *event_type = "event_type";
+    char *manufacturer = "manufacturer";
+    char *service = "service";
+    char *min_length = "min_length";
+    char *max_length = "max_length";
+    char *require = "require";
+    const char *fields[DECODER_SPEC_FIELDS] = {"temperature", "humidity", "battery_pct", "battery_mv", "frame"};
+    int n;
+
+    decoder_spec_config_t *spec = &config->decoder_specs[config->decoder_spec_count - 1];
+
+    if (!strcmp(buf, type))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        spec->type = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, make))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(spec->make, sizeof(spec->make), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, model))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(spec->model, sizeof(spec->model), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, entities))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(spec->entities, sizeof(spec->entities), "%s", (char *)event->data.scalar.value);
+    }
+    else if (!strcmp(buf, event_type))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        spec->event_type = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, manufacturer))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        spec->manufacturer = strtol((char *)event->data.scalar.value, NULL, 0);
+    }
+    else if (!strcmp(buf, service))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        spec->service = strtol((char *)event->data.scalar.value, NULL, 0);
+    }
+    else if (!strcmp(buf, min_length))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        spec->min_length = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, max_length))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        spec->max_length = strtol((char *)event->data.scalar.value, NULL, 10);
+    }
+    else if (!strcmp(buf, require))
+    {
+        yaml_event_delete(event);
+        parse_next(parser, event);
+        snprintf(spec->require, sizeof(spec->require), "%s", (char *)event->data.scalar.value);
     }
     else
     {
+        for (n = 0; n < DECODER_SPEC_FIELDS; n++)
+        {
+            if (!strcmp(buf, fields[n]))
+            {
+                yaml_event_delete(event);
+                parse_next(parser, event);
+                snprintf(spec->fields[n], sizeof(spec->fields[n]), "%s", (char *)event->data.scalar.value);
+                return;
+            }
+        }
         printf("\n -ERROR: Unknow variable in config file: %s\n", buf);
         clean_prs(fp, parser, event);
         exit(EXIT_FAILURE);
@@ -2523,9 +8469,65 @@ void print_data(unsigned int sensor_count, config_t *config)
     printf(" auto_conf_battery = %i\n", config->auto_conf_battery);
     printf(" auto_conf_voltage = %i\n", config->auto_conf_voltage);
     printf(" auto_conf_signal = %i\n", config->auto_conf_signal);
+    printf(" discovery_state_file = %s\n", config->discovery_state_file);
+    printf(" discovery_inflight = %i\n", config->discovery_inflight);
+    printf(" discovery_type = %i\n", config->discovery_type);
+    printf(" discovery_prefix = %s\n", config->discovery_prefix);
+    printf(" stats_windows = %s\n", config->stats_windows);
+    printf(" history_directory = %s\n", config->history_directory);
+    printf(" history_interval = %i\n", config->history_interval);
+    printf(" history_retention_days = %i\n", config->history_retention_days);
+    printf(" query_socket = %s\n", config->query_socket);
+    printf(" readings_ring = %s\n", config->readings_ring);
+    printf(" readings_ring_size = %i\n", config->readings_ring_size);
+    printf(" filter_median = %i\n", config->filter_median);
+    printf(" filter_temp_min = %.1f\n", config->filter_temp_min);
+    printf(" filter_temp_max = %.1f\n", config->filter_temp_max);
+    printf(" filter_temp_rate = %.1f\n", config->filter_temp_rate);
+    printf(" filter_hum_rate = %.1f\n", config->filter_hum_rate);
+    printf(" qos_state = %i\n", config->qos_state);
+    printf(" retain_state = %i\n", config->retain_state);
+    printf(" qos_discovery = %i\n", config->qos_discovery);
+    printf(" retain_discovery = %i\n", config->retain_discovery);
+    printf(" qos_stats = %i\n", config->qos_stats);
+    printf(" retain_stats = %i\n", config->retain_stats);
+    printf(" qos_alert = %i\n", config->qos_alert);
+    printf(" retain_alert = %i\n", config->retain_alert);
+    printf(" mqtt_version = %i\n", config->mqtt_version);
+    printf(" mqtt_state_expiry = %i\n", config->mqtt_state_expiry);
+    printf(" mqtt_queue = %i\n", config->mqtt_queue);
+    printf(" census_top = %i\n", config->census_top);
+    printf(" trace_entries = %i\n", config->trace_entries);
+    printf(" trace_foreign = %i\n", config->trace_foreign);
+    printf(" hci_batch = %i\n", config->hci_batch);
+    printf(" hci_receive_buffer = %i\n", config->hci_receive_buffer);
+    printf(" scan_watchdog = %i\n", config->scan_watchdog);
+    printf(" scan_watchdog_percent = %i\n", config->scan_watchdog_percent);
+    printf(" gateway_name = %s\n", config->gateway_name);
+    printf(" coordination = %i\n", config->coordination);
+    printf(" claim_interval = %i\n", config->claim_interval);
+    printf(" claim_timeout = %i\n", config->claim_timeout);
+    printf(" claim_hysteresis = %i\n", config->claim_hysteresis);
+    printf(" offline_after = %i\n", config->offline_after);
+    printf(" decoder_directory = %s\n", config->decoder_directory);
     printf(" syslog_address = %s\n", config->syslog_address);
     printf(" logging_level = %i\n", config->logging_level);
 
+    for (int i = 0; i < config->mqtt_output_count; i++)
+    {
+        printf(" mqtt_outputs %d = %s, topic_prefix %s, qos %i, retain %i, queue %i\n", i + 1,
+               config->mqtt_outputs[i].url, config->mqtt_outputs[i].topic_prefix, config->mqtt_outputs[i].qos,
+               config->mqtt_outputs[i].retain, config->mqtt_outputs[i].queue);
+    }
+
+    for (int i = 0; i < config->decoder_spec_count; i++)
+    {
+        printf(" decoder_specs %d = type %i, %s %s, event_type %i, manufacturer 0x%04X, service 0x%04X, length %i .. %i\n", i + 1,
+               config->decoder_specs[i].type, config->decoder_specs[i].make, config->decoder_specs[i].model,
+               config->decoder_specs[i].event_type, config->decoder_specs[i].manufacturer & 0xffff,
+               config->decoder_specs[i].service & 0xffff, config->decoder_specs[i].min_length, config->decoder_specs[i].max_length);
+    }
+
     puts(" sensor configs:");
     puts("\t -----------------");
     for (int i = 0; i < (int)sensor_count; i++)
@@ -2535,6 +8537,11 @@ void print_data(unsigned int sensor_count, config_t *config)
         printf("\t location = %s\n", config->sensors[i].location);
         printf("\t type = %i\n", config->sensors[i].type);
         printf("\t mac = %s\n", config->sensors[i].mac);
+        printf("\t filter median = %i, temp %.1f .. %.1f, temp rate %.1f, hum rate %.1f\n",
+               config->sensors[i].filter_median, config->sensors[i].filter_temp_min, config->sensors[i].filter_temp_max,
+               config->sensors[i].filter_temp_rate, config->sensors[i].filter_hum_rate);
+        printf("\t offline after = %i\n", config->sensors[i].offline_after);
+        printf("\t bindkey = %s\n", config->sensors[i].bindkey[0] != '\0' ? "set" : "");
         puts("\t -----------------");
     }
 }
@@ -0,0 +1,60 @@
+// decoder_switchbot.c
+// example decoder plugin for ble_sensor_mqtt_pub
+// gcc -Wall -O2 -fPIC -shared -o decoder_switchbot.so decoder_switchbot.c
+//
+// 100 = SwitchBot Meter (WoSensorTH), sent in the scan response, so it needs scan_type: 1
+// service data 0x0D00 (0xFD3D on newer firmware), 6 bytes:
+//   0     device type 'T', bit 7 is a flag
+//   2     battery percent, low 7 bits
+//   3     temperature tenths, low 4 bits
+//   4     temperature whole degrees C, low 7 bits, bit 7 set when above zero
+//   5     humidity percent, low 7 bits
+
+#include <stddef.h>
+#include "ble_decoder.h"
+
+static const uint8_t *switchbot_meter_data(const ad_report_t *report)
+{
+    const uint8_t *data;
+    int length;
+
+    if ((data = ad_service_data(report, 0x0D00, &length)) == NULL &&
+        (data = ad_service_data(report, 0xFD3D, &length)) == NULL)
+    {
+        return NULL;
+    }
+    if (length < 6 || (data[0] & 0x7f) != 'T')
+    {
+        return NULL;
+    }
+    return data;
+}
+
+static bool switchbot_meter_match(const ble_decoder_t *decoder, const ad_report_t *report)
+{
+    (void)decoder;
+    return switchbot_meter_data(report) != NULL;
+}
+
+static bool switchbot_meter_decode(const ble_decoder_t *decoder, const ad_report_t *report, reading_t *reading)
+{
+    const uint8_t *data = switchbot_meter_data(report);
+    double temperature = (data[4] & 0x7f) + (data[3] & 0x0f) / 10.0;
+
+    (void)decoder;
+    reading->fields = READING_TEMPERATURE | READING_HUMIDITY | READING_BATTERY_PCT;
+    reading->temperature_celsius = (data[4] & 0x80) ? temperature : -temperature;
+    reading->humidity = data[5] & 0x7f;
+    reading->battery_pct = data[2] & 0x7f;
+    return true;
+}
+
+static const ble_decoder_t switchbot_decoders[] =
+    {
+        {BLE_DECODER_ABI_VERSION, 100, "SwitchBot", "Meter", "FTHBS", switchbot_meter_match, switchbot_meter_decode, NULL}};
+
+int ble_decoders(const ble_decoder_t **decoders)
+{
+    *decoders = switchbot_decoders;
+    return sizeof(switchbot_decoders) / sizeof(switchbot_decoders[0]);
+}
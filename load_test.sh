@@ -0,0 +1,181 @@
+#!/bin/bash
+# load_test.sh
+# end to end load test of ble_sensor_mqtt_pub with a virtual bluetooth controller and a local mosquitto
+#
+# ble_load_gen creates the controller and sends advertising reports from the test sensors and foreign devices,
+# ble_sensor_mqtt_pub scans it and publishes to a mosquitto on localhost, and the readings published are matched
+# to the reports sent to get the latency, the readings lost, and the CPU and memory used.
+# the results are printed and appended as one line to the results file, so builds can be compared
+#
+# needs root, the hci_vhci kernel module, hciconfig, mosquitto and mosquitto_sub (2.0 or later)
+# build first with 'make ble_sensor_mqtt_pub ble_load_gen'
+
+SENSORS=100
+FOREIGN=2000
+RATE=100
+FOREIGN_RATE=1000
+DURATION=60
+BINARY=./ble_sensor_mqtt_pub
+GENERATOR=./ble_load_gen
+RESULTS=load_test_results.txt
+PORT=18830
+
+usage() {
+    echo "usage: $0 [-s sensors] [-f foreign devices] [-r sensor reports/s] [-R foreign reports/s] [-d seconds]" > /dev/stderr
+    echo "       [-b ble_sensor_mqtt_pub binary] [-o results file]" > /dev/stderr
+    exit 1
+}
+
+while getopts "s:f:r:R:d:b:o:" opt; do
+    case $opt in
+        s) SENSORS=$OPTARG ;;
+        f) FOREIGN=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        R) FOREIGN_RATE=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        b) BINARY=$OPTARG ;;
+        o) RESULTS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+if [ $EUID -ne 0 ]; then
+    echo "This script should be run as root." > /dev/stderr
+    exit 1
+fi
+
+for tool in "$BINARY" "$GENERATOR"; do
+    if [ ! -x "$tool" ]; then
+        echo "$tool not found, build with 'make ble_sensor_mqtt_pub ble_load_gen'" > /dev/stderr
+        exit 1
+    fi
+done
+
+WORK=$(mktemp -d)
+PIDS=""
+
+cleanup() {
+    for pid in $PIDS; do
+        kill $pid 2> /dev/null
+    done
+    wait 2> /dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap "echo Exited!; exit 1" SIGINT SIGTERM
+
+modprobe hci_vhci || exit 1
+
+# local broker, mosquitto 2 only listens on localhost when started without a configuration file
+mosquitto -p $PORT > "$WORK/mosquitto.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+mosquitto_sub -h 127.0.0.1 -p $PORT -t 'loadtest/#' -F '%U %p' > "$WORK/received" &
+PIDS="$PIDS $!"
+
+# the virtual controller, it prints its hciN name once it is registered
+"$GENERATOR" -s $SENSORS -f $FOREIGN -r $RATE -R $FOREIGN_RATE -d $DURATION \
+    -l "$WORK/sent" -c "$WORK/sensors.yaml" > "$WORK/generator.out" 2> "$WORK/generator.err" &
+GENERATOR_PID=$!
+PIDS="$PIDS $GENERATOR_PID"
+for i in $(seq 50); do
+    HCI=$(head -n 1 "$WORK/generator.out")
+    [ -n "$HCI" ] && break
+    sleep 0.1
+done
+if [ -z "$HCI" ]; then
+    echo "The virtual controller did not start" > /dev/stderr
+    cat "$WORK/generator.err" > /dev/stderr
+    exit 1
+fi
+hciconfig $HCI up || exit 1
+
+# ble_sensor_mqtt_pub numbers the adapters in the order of their hciN number, starting at 0
+ADAPTER=0
+for dev in /sys/class/bluetooth/hci*; do
+    n=${dev##*/hci}
+    case $n in
+        *[!0-9]*) ;;
+        *) [ $n -lt ${HCI#hci} ] && ADAPTER=$((ADAPTER + 1)) ;;
+    esac
+done
+
+# the shipped configuration pointed at the local broker, the virtual controller and the work directory, with the
+# generated sensors
+sed -e "s|^mqtt_server_url:.*|mqtt_server_url: \"tcp://127.0.0.1:$PORT\"|" \
+    -e "s|^mqtt_base_topic:.*|mqtt_base_topic: \"loadtest/\"|" \
+    -e "s|^mqtt_username:.*|mqtt_username: \"\"|" \
+    -e "s|^mqtt_password:.*|mqtt_password: \"\"|" \
+    -e "s|^bluetooth_adapter:.*|bluetooth_adapter: $ADAPTER|" \
+    -e "s|^auto_configure:.*|auto_configure: 0|" \
+    -e "s|^discovery_state_file:.*|discovery_state_file: \"$WORK/discovery\"|" \
+    -e "s|^history_directory:.*|history_directory: \"$WORK/history\"|" \
+    -e "s|^query_socket:.*|query_socket: \"$WORK/query.sock\"|" \
+    -e "s|^syslog_address:.*|syslog_address: \"\"|" \
+    -e "s|^logging_level:.*|logging_level: \"6\"|" \
+    -e '/^sensors:/,$d' ble_sensor_mqtt_pub.yaml > "$WORK/config.yaml"
+cat "$WORK/sensors.yaml" >> "$WORK/config.yaml"
+mkdir -p "$WORK/history"
+
+"$BINARY" "$WORK/config.yaml" > "$WORK/daemon.log" 2>&1 &
+DAEMON_PID=$!
+PIDS="$PIDS $DAEMON_PID"
+
+# CPU time is counted from the first report sent until the generator stops
+for i in $(seq 100); do
+    [ -s "$WORK/sent" ] && break
+    sleep 0.1
+done
+CLOCK_TICKS=$(getconf CLK_TCK)
+TICKS_START=$(awk '{print $14 + $15}' /proc/$DAEMON_PID/stat)
+TIME_START=$(date +%s.%N)
+
+wait $GENERATOR_PID
+TICKS_END=$(awk '{print $14 + $15}' /proc/$DAEMON_PID/stat 2> /dev/null)
+TIME_END=$(date +%s.%N)
+if [ -z "$TICKS_END" ]; then
+    echo "ble_sensor_mqtt_pub exited during the test" > /dev/stderr
+    tail -n 20 "$WORK/daemon.log" > /dev/stderr
+    exit 1
+fi
+RSS_PEAK=$(awk '/^VmHWM/ {print $2}' /proc/$DAEMON_PID/status)
+RSS=$(awk '/^VmRSS/ {print $2}' /proc/$DAEMON_PID/status)
+
+# let the last readings through
+sleep 3
+
+# sent:      seconds.nanoseconds mac frame
+# published: seconds.nanoseconds {json}, matched on mac and frame to the latest report sent before it
+{
+    awk '{print $1, "S", $2, $3}' "$WORK/sent"
+    awk 'match($0, /"mac":"[^"]*"/) {
+             mac = substr($0, RSTART + 7, RLENGTH - 8)
+             if (match($0, /"frame":[0-9]+/)) print $1, "R", mac, substr($0, RSTART + 8, RLENGTH - 8)
+         }' "$WORK/received"
+} | sort -n -k 1,1 | awk -v latencies="$WORK/latencies" '
+    $2 == "S" { key = $3 " " $4; if (key in pending) dropped++; pending[key] = $1; sent++ }
+    $2 == "R" { key = $3 " " $4
+                if (key in pending) { printf "%.3f\n", ($1 - pending[key]) * 1000 > latencies; delete pending[key]; received++ }
+                else duplicates++ }
+    END { for (key in pending) dropped++
+          printf "%d %d %d %d\n", sent, received, dropped, duplicates }' > "$WORK/counts"
+read SENT RECEIVED DROPPED DUPLICATES < "$WORK/counts"
+
+sort -n "$WORK/latencies" -o "$WORK/latencies" 2> /dev/null
+percentile() {
+    awk -v p=$1 '{v[NR] = $1} END {if (NR == 0) print "-"; else {i = int(NR * p / 100 + 0.5); if (i < 1) i = 1; print v[i]}}' "$WORK/latencies"
+}
+
+CPU=$(awk -v t0=$TICKS_START -v t1=$TICKS_END -v hz=$CLOCK_TICKS -v w0=$TIME_START -v w1=$TIME_END \
+    'BEGIN {printf "%.1f", (t1 - t0) / hz / (w1 - w0) * 100}')
+BUILD=$(git describe --always --dirty 2> /dev/null || echo unknown)
+SUM=$(md5sum "$BINARY" | cut -c1-12)
+
+REPORT="date=$(date '+%Y%m%d%H%M%S') build=$BUILD binary=$SUM sensors=$SENSORS foreign=$FOREIGN"
+REPORT="$REPORT rate=$RATE foreign_rate=$FOREIGN_RATE duration=$DURATION sent=$SENT received=$RECEIVED"
+REPORT="$REPORT dropped=$DROPPED duplicates=$DUPLICATES latency_ms_p50=$(percentile 50) latency_ms_p95=$(percentile 95)"
+REPORT="$REPORT latency_ms_p99=$(percentile 99) latency_ms_max=$(percentile 100) cpu_pct=$CPU rss_kb=$RSS rss_peak_kb=$RSS_PEAK"
+
+echo "$REPORT" | tr ' ' '\n'
+echo "$REPORT" >> "$RESULTS"
+echo "Appended to $RESULTS"